@@ -1,7 +1,10 @@
+#pragma once
 #include <td/actor/actor.h>
 #include <td/actor/MultiPromise.h>
 #include <block/block.h>
 #include "IndexData.h"
+#include "smc-interfaces/AccountInterfacesCache.h"
+#include "smc-interfaces/DetectionCaches.h"
 
 class BlockInterfaceProcessor: public td::actor::Actor {
 private:
@@ -9,6 +12,10 @@ private:
     td::Promise<ParsedBlockPtr> promise_;
     std::unordered_map<block::StdAddress, std::vector<BlockchainInterfaceV2>, AddressHasher> interfaces_{};
 public:
+    // scheduler node dedicated to get-method execution, detection runs on the main node if not set
+    inline static std::optional<td::actor::core::SchedulerId> detector_scheduler;
+    inline static AccountInterfacesCache<typename Detector::DetectedInterface> interfaces_cache;
+
     BlockInterfaceProcessor(ParsedBlockPtr block, td::Promise<ParsedBlockPtr> promise) : 
         block_(std::move(block)), promise_(std::move(promise)) {}
 
@@ -42,11 +49,32 @@ public:
             if (account_state.code.is_null()) {
                 continue;
             }
-            td::actor::create_actor<Detector>("InterfacesDetector", account_state.account, account_state.code, account_state.data, shard_states, block_->mc_block_.config_, 
-                td::PromiseCreator::lambda([SelfId = actor_id(this), account_state, promise = ig.get_promise()](std::vector<typename Detector::DetectedInterface> interfaces) mutable {
+            // code and data only results are reused, detectors depending on other accounts or time run every time
+            std::optional<std::vector<typename Detector::DetectedInterface>> cached;
+            if (DetectionCaches::enabled) {
+                cached = interfaces_cache.get(account_state.account, account_state.code_hash.value(), account_state.data_hash.value());
+            }
+            bool has_cached = cached.has_value();
+            auto options = td::actor::ActorOptions().with_name("InterfacesDetector");
+            if (detector_scheduler) {
+                options.on_scheduler(detector_scheduler.value());
+            }
+            td::actor::create_actor<Detector>(options, account_state.account, account_state.code, account_state.data, shard_states, block_->mc_block_.config_, 
+                td::PromiseCreator::lambda([SelfId = actor_id(this), account_state, cached = std::move(cached), promise = ig.get_promise()](std::vector<typename Detector::DetectedInterface> interfaces) mutable {
+                    if (cached) {
+                        interfaces.insert(interfaces.end(), std::make_move_iterator(cached->begin()), std::make_move_iterator(cached->end()));
+                    } else if (DetectionCaches::enabled) {
+                        std::vector<typename Detector::DetectedInterface> cacheable;
+                        for (const auto& interface : interfaces) {
+                            if (Detector::is_code_and_data_only(interface)) {
+                                cacheable.push_back(interface);
+                            }
+                        }
+                        interfaces_cache.put(account_state.account, account_state.code_hash.value(), account_state.data_hash.value(), std::move(cacheable));
+                    }
                     td::actor::send_closure(SelfId, &BlockInterfaceProcessor::process_address_interfaces, account_state.account, std::move(interfaces), 
                                             account_state.code_hash.value(), account_state.data_hash.value(), account_state.last_trans_lt, account_state.timestamp, std::move(promise));
-            })).release();
+            }), block_->mc_block_.get_method_context_, has_cached).release();
         }
     }
 
@@ -1,12 +1,36 @@
 #include "IndexScheduler.h"
 #include "td/utils/Time.h"
 #include "td/utils/StringBuilder.h"
+#include <cmath>
 #include <iostream>
 #include "BlockInterfacesDetector.h"
+#include "common/delay.h"
+#include "td/utils/filesystem.h"
+#include "td/utils/port/path.h"
+#include "smc-interfaces/DetectionCache.h"
+#include "smc-interfaces/DetectionCaches.h"
+#include "TraceStitcher.h"
+#include "InsertManagerBase.h"
 
 
+std::atomic<bool> IndexScheduler::shutdown_requested_{false};
+
 void IndexScheduler::start_up() {
     trace_assembler_ = td::actor::create_actor<TraceAssembler>("trace_assembler", working_dir_ + "/trace_assembler", max_queue_.mc_blocks_);
+    if (!trace_stream_.empty()) {
+        td::actor::send_closure(trace_assembler_, &TraceAssembler::set_trace_stream, trace_stream_);
+    }
+
+    // without an open db the detection cache neither returns nor stores anything
+    if (DetectionCaches::enabled) {
+        auto S = DetectionCache::instance().open(working_dir_ + "/detection_cache");
+        if (S.is_error()) {
+            LOG(ERROR) << "Failed to open detection cache, detection results will not be cached: " << S;
+        }
+    }
+    // verdicts file written before they moved to the detection cache, its verdicts counted data-dependent failures
+    td::unlink(working_dir_ + "/interface_verdicts").ignore();
+    next_flush_detection_cache_ = td::Timestamp::in(60.0);
 }
 
 std::string get_time_string(double seconds) {
@@ -40,12 +64,29 @@ void IndexScheduler::alarm() {
         last_existing_seqno_count_ = existing_seqnos_.size();
     avg_tps_ = alpha * avg_tps_ + (1 - alpha) * (existing_seqnos_.size() - last_existing_seqno_count_);
     last_existing_seqno_count_ = existing_seqnos_.size();
+
+    if (shutdown_requested_.load() && !draining_) {
+        start_drain("shutdown requested");
+    }
+    if (draining_) {
+        continue_drain();
+    }
     
     if (next_print_stats_.is_in_past()) {
         print_stats();
         next_print_stats_ = td::Timestamp::in(stats_timeout_);
     }
 
+    if (next_flush_detection_cache_.is_in_past()) {
+        ton::delay_action([]() {
+            auto S = DetectionCache::instance().flush();
+            if (S.is_error()) {
+                LOG(ERROR) << "Failed to flush detection cache: " << S;
+            }
+        }, td::Timestamp::now());
+        next_flush_detection_cache_ = td::Timestamp::in(60.0);
+    }
+
     auto Q = td::PromiseCreator::lambda([SelfId = actor_id(this)](td::Result<QueueState> R){
         R.ensure();
         td::actor::send_closure(SelfId, &IndexScheduler::got_insert_queue_state, R.move_as_ok());
@@ -63,6 +104,31 @@ void IndexScheduler::alarm() {
 }
 
 void IndexScheduler::run() {
+    // forced reindex goes over existing seqnos anyway, the watermark would only skip them
+    if (force_index_) {
+        got_commit_watermark(td::Status::Error("forced reindex"));
+        return;
+    }
+    auto P = td::PromiseCreator::lambda([SelfId = actor_id(this)](td::Result<std::uint32_t> R) {
+        td::actor::send_closure(SelfId, &IndexScheduler::got_commit_watermark, std::move(R));
+    });
+    td::actor::send_closure(insert_manager_, &InsertManagerInterface::get_commit_watermark, std::move(P), from_seqno_, to_seqno_);
+}
+
+void IndexScheduler::got_commit_watermark(td::Result<std::uint32_t> R) {
+    // the watermark is kept per range, but a value outside of it, e.g. written before the range changed, is not trusted
+    if (R.is_ok() && static_cast<std::int64_t>(R.ok()) + 1 >= from_seqno_ 
+            && (to_seqno_ <= 0 || static_cast<std::int64_t>(R.ok()) <= to_seqno_)) {
+        ton::BlockSeqno next_seqno = R.ok() + 1;
+        LOG(INFO) << "Commit watermark: " << R.ok() << ", next seqno: " << next_seqno;
+        restore_trace_assembler(next_seqno);
+        return;
+    }
+    if (R.is_error()) {
+        LOG(INFO) << "Commit watermark not available (" << R.move_as_error() << "), reading existing seqnos";
+    } else {
+        LOG(WARNING) << "Commit watermark " << R.ok() << " is outside of the indexed range, reading existing seqnos";
+    }
     auto P = td::PromiseCreator::lambda([SelfId = actor_id(this)](td::Result<std::vector<std::uint32_t>> R) {
         td::actor::send_closure(SelfId, &IndexScheduler::got_existing_seqnos, std::move(R));
     });
@@ -92,7 +158,10 @@ void IndexScheduler::got_existing_seqnos(td::Result<std::vector<std::uint32_t>>
                   << " existing seqnos in DB (continuous increasing sequence)";
         LOG(INFO) << "Next seqno: " << next_seqno;
     }
+    restore_trace_assembler(next_seqno);
+}
 
+void IndexScheduler::restore_trace_assembler(ton::BlockSeqno next_seqno) {
     auto P = td::PromiseCreator::lambda([SelfId = actor_id(this), from_seqno = from_seqno_, next_seqno](td::Result<ton::BlockSeqno> R) mutable {
         if (R.is_error()) {
             LOG(WARNING) << "TraceAssembler state not found for seqno " << next_seqno - 1;
@@ -113,14 +182,98 @@ void IndexScheduler::got_existing_seqnos(td::Result<std::vector<std::uint32_t>>
 }
 
 void IndexScheduler::got_trace_assembler_last_state_seqno(ton::BlockSeqno last_state_seqno) {
-    for (auto seqno = from_seqno_; seqno <= last_state_seqno; ++seqno) {
-        existing_seqnos_.insert(seqno);
+    if (static_cast<std::int64_t>(last_state_seqno) >= from_seqno_) {
+        existing_seqnos_.insert_range(from_seqno_, last_state_seqno);
     }
+    td::actor::send_closure(insert_manager_, &InsertManagerInterface::init_commit_watermark, last_state_seqno, from_seqno_, to_seqno_);
 
     LOG(INFO) << "Starting indexing from seqno: " << last_state_seqno + 1;
 
     td::actor::send_closure(trace_assembler_, &TraceAssembler::set_expected_seqno, last_state_seqno + 1);
+    // a range resumed after its last block was assembled still leaves its boundary
+    if (to_seqno_ > 0 && static_cast<std::int64_t>(last_state_seqno) >= to_seqno_) {
+        export_trace_boundary();
+    }
     alarm_timestamp() = td::Timestamp::now();
+
+    if (backfill_to_ > 0) {
+        start_backfill(last_state_seqno + 1);
+    }
+}
+
+void IndexScheduler::set_backfill_range(std::int32_t from_seqno, std::int32_t to_seqno) {
+    if (from_seqno <= 0 || to_seqno < from_seqno) {
+        LOG(ERROR) << "Invalid backfill range " << from_seqno << ".." << to_seqno;
+        std::_Exit(2);
+    }
+    backfill_from_ = from_seqno;
+    backfill_to_ = to_seqno;
+}
+
+void IndexScheduler::start_backfill(ton::BlockSeqno tip_start_seqno) {
+    // the tip lane owns everything from its start seqno, backfill stops right below it
+    if (backfill_to_ >= static_cast<std::int64_t>(tip_start_seqno)) {
+        backfill_to_ = static_cast<std::int32_t>(tip_start_seqno) - 1;
+    }
+    if (from_seqno_ > 0 && backfill_to_ >= from_seqno_) {
+        backfill_to_ = from_seqno_ - 1;
+    }
+    if (backfill_to_ < backfill_from_) {
+        LOG(INFO) << "Backfill range is already covered by the tip lane";
+        return;
+    }
+    LOG(INFO) << "Backfill range: " << backfill_from_ << ".." << backfill_to_;
+    backfill_trace_assembler_ = td::actor::create_actor<TraceAssembler>("backfill_trace_assembler",
+        working_dir_ + "/trace_assembler_backfill", max_queue_.mc_blocks_);
+
+    auto P = td::PromiseCreator::lambda([SelfId = actor_id(this)](td::Result<std::vector<std::uint32_t>> R) {
+        td::actor::send_closure(SelfId, &IndexScheduler::got_backfill_existing_seqnos, std::move(R));
+    });
+    td::actor::send_closure(insert_manager_, &InsertManagerInterface::get_existing_seqnos, std::move(P), backfill_from_, backfill_to_);
+}
+
+void IndexScheduler::got_backfill_existing_seqnos(td::Result<std::vector<std::uint32_t>> R) {
+    if (R.is_error()) {
+        LOG(ERROR) << "Error reading existing backfill seqnos, backfill disabled: " << R.move_as_error();
+        return;
+    }
+    // only the continuous prefix is skipped, the assembler has to see every seqno after it
+    SeqnoRangeSet existing_seqnos;
+    for (auto seqno : R.ok()) {
+        existing_seqnos.insert(seqno);
+    }
+    ton::BlockSeqno next_seqno = backfill_from_;
+    if (!force_index_ && existing_seqnos.contains(backfill_from_)) {
+        next_seqno = existing_seqnos.contiguous_end(backfill_from_) + 1;
+    }
+    LOG(INFO) << "Backfill: " << existing_seqnos.size() << " seqnos already in DB, next seqno: " << next_seqno;
+
+    auto P = td::PromiseCreator::lambda([SelfId = actor_id(this), from_seqno = backfill_from_, next_seqno](td::Result<ton::BlockSeqno> R) mutable {
+        if (R.is_error()) {
+            LOG(WARNING) << "Backfill TraceAssembler state not found for seqno " << next_seqno - 1;
+            if (next_seqno > static_cast<ton::BlockSeqno>(from_seqno)) {
+                next_seqno = static_cast<ton::BlockSeqno>(std::max(from_seqno, static_cast<int32_t>(next_seqno) - 50));
+            }
+            LOG(WARNING) << "Backfill traces that started before block " << next_seqno << " will be marked as broken and not inserted.";
+            td::actor::send_closure(SelfId, &IndexScheduler::got_backfill_trace_assembler_state_seqno, next_seqno - 1);
+        } else {
+            LOG(INFO) << "Restored backfill TraceAssembler state for seqno " << R.ok();
+            td::actor::send_closure(SelfId, &IndexScheduler::got_backfill_trace_assembler_state_seqno, R.move_as_ok());
+        }
+    });
+    td::actor::send_closure(backfill_trace_assembler_, &TraceAssembler::restore_state, next_seqno - 1, std::move(P));
+}
+
+void IndexScheduler::got_backfill_trace_assembler_state_seqno(ton::BlockSeqno last_state_seqno) {
+    next_backfill_seqno_ = last_state_seqno + 1;
+    td::actor::send_closure(backfill_trace_assembler_, &TraceAssembler::set_expected_seqno, next_backfill_seqno_);
+    backfill_started_ = true;
+    LOG(INFO) << "Starting backfill from seqno: " << next_backfill_seqno_;
+}
+
+bool IndexScheduler::is_backfill_seqno(std::uint32_t mc_seqno) const {
+    return backfill_started_ && static_cast<std::int64_t>(mc_seqno) >= backfill_from_
+        && static_cast<std::int64_t>(mc_seqno) <= backfill_to_;
 }
 
 void IndexScheduler::got_last_known_seqno(std::uint32_t last_known_seqno) {
@@ -128,7 +281,7 @@ void IndexScheduler::got_last_known_seqno(std::uint32_t last_known_seqno) {
         return;
     int skipped_count = 0;
     for (auto seqno = last_known_seqno_ + 1; seqno <= last_known_seqno; ++seqno) {
-        if (!force_index_ && (existing_seqnos_.find(seqno) != existing_seqnos_.end())) {
+        if (!force_index_ && existing_seqnos_.contains(seqno)) {
             ++skipped_count;
         }
         else if ((from_seqno_ <= 0 || seqno >= from_seqno_) && (to_seqno_ <= 0 || seqno <= to_seqno_)) {
@@ -145,6 +298,10 @@ void IndexScheduler::schedule_seqno(std::uint32_t mc_seqno) {
     LOG(DEBUG) << "Scheduled seqno " << mc_seqno;
 
     processing_seqnos_.insert(mc_seqno);
+    reserve_credit(mc_seqno);
+    if (is_backfill_seqno(mc_seqno)) {
+        ++backfill_processing_;
+    }
     auto P = td::PromiseCreator::lambda([SelfId = actor_id(this), mc_seqno](td::Result<MasterchainBlockDataState> R) {
         if (R.is_error()) {
             LOG(ERROR) << "Failed to fetch seqno " << mc_seqno << ": " << R.move_as_error();
@@ -159,8 +316,20 @@ void IndexScheduler::schedule_seqno(std::uint32_t mc_seqno) {
 
 void IndexScheduler::reschedule_seqno(std::uint32_t mc_seqno) {
     LOG(WARNING) << "Rescheduling seqno " << mc_seqno;
+    detection_finished(mc_seqno);
+    release_credit(mc_seqno);
+    bool backfill = is_backfill_seqno(mc_seqno);
+    if (backfill && processing_seqnos_.contains(mc_seqno)) {
+        --backfill_processing_;
+    }
     processing_seqnos_.erase(mc_seqno);
-    queued_seqnos_.push(mc_seqno);
+    if (draining_) {
+        drain_retry_seqnos_.push(mc_seqno);
+    } else if (backfill) {
+        backfill_retry_seqnos_.push(mc_seqno);
+    } else {
+        queued_seqnos_.push(mc_seqno);
+    }
 }
 
 void IndexScheduler::seqno_fetched(std::uint32_t mc_seqno, MasterchainBlockDataState block_data_state) {
@@ -184,6 +353,7 @@ void IndexScheduler::seqno_fetched(std::uint32_t mc_seqno, MasterchainBlockDataS
 
 void IndexScheduler::seqno_parsed(std::uint32_t mc_seqno, ParsedBlockPtr parsed_block) {
     LOG(DEBUG) << "Parsed seqno " << mc_seqno;
+    update_credit(mc_seqno, get_block_queue_state(*parsed_block));
 
     auto P = td::PromiseCreator::lambda([SelfId = actor_id(this), mc_seqno](td::Result<ParsedBlockPtr> R) {
         if (R.is_error()) {
@@ -193,11 +363,15 @@ void IndexScheduler::seqno_parsed(std::uint32_t mc_seqno, ParsedBlockPtr parsed_
         }
         td::actor::send_closure(SelfId, &IndexScheduler::seqno_traces_assembled, mc_seqno, R.move_as_ok());
     });
-    td::actor::send_closure(trace_assembler_, &TraceAssembler::assemble, mc_seqno, std::move(parsed_block), std::move(P));
+    auto &assembler = is_backfill_seqno(mc_seqno) ? backfill_trace_assembler_ : trace_assembler_;
+    td::actor::send_closure(assembler, &TraceAssembler::assemble, mc_seqno, std::move(parsed_block), std::move(P));
 }
 
 void IndexScheduler::seqno_traces_assembled(std::uint32_t mc_seqno, ParsedBlockPtr parsed_block) {
     LOG(DEBUG) << "Assembled traces for seqno " << mc_seqno;
+    if (static_cast<std::int64_t>(mc_seqno) == to_seqno_) {
+        export_trace_boundary();
+    }
 
     auto P = td::PromiseCreator::lambda([SelfId = actor_id(this), mc_seqno](td::Result<ParsedBlockPtr> R) {
         if (R.is_error()) {
@@ -207,11 +381,60 @@ void IndexScheduler::seqno_traces_assembled(std::uint32_t mc_seqno, ParsedBlockP
         }
         td::actor::send_closure(SelfId, &IndexScheduler::seqno_interfaces_processed, mc_seqno, R.move_as_ok());
     });
+    detecting_seqnos_[mc_seqno] = parsed_block->account_states_.size();
+    detecting_accounts_ += parsed_block->account_states_.size();
     td::actor::create_actor<BlockInterfaceProcessor>("BlockInterfaceProcessor", std::move(parsed_block), std::move(P)).release();
 }
 
+void IndexScheduler::set_detection_digests(std::string path, bool replay) {
+    auto S = detection_digests_.open(std::move(path), replay);
+    if (S.is_error()) {
+        LOG(ERROR) << S;
+        std::_Exit(2);
+    }
+}
+
+void IndexScheduler::export_trace_boundary() {
+    if (trace_boundary_dir_.empty()) {
+        return;
+    }
+    auto path = trace_boundary_path(trace_boundary_dir_, std::max(from_seqno_, 1), to_seqno_);
+    auto P = td::PromiseCreator::lambda([path](td::Result<td::Unit> R) {
+        if (R.is_error()) {
+            LOG(ERROR) << "Failed to export trace boundary " << path << ": " << R.move_as_error();
+            return;
+        }
+        LOG(INFO) << "Exported trace boundary " << path;
+    });
+    td::actor::send_closure(trace_assembler_, &TraceAssembler::export_boundary, path, std::max(from_seqno_, 1), std::move(P));
+}
+
+void IndexScheduler::set_trace_boundary_dir(std::string dir) {
+    if (to_seqno_ <= 0) {
+        LOG(ERROR) << "Trace boundary export needs --to";
+        std::_Exit(2);
+    }
+    td::mkdir(dir).ensure();
+    trace_boundary_dir_ = std::move(dir);
+}
+
+void IndexScheduler::detection_finished(std::uint32_t mc_seqno) {
+    auto it = detecting_seqnos_.find(mc_seqno);
+    if (it == detecting_seqnos_.end()) {
+        return;
+    }
+    detecting_accounts_ -= it->second;
+    detecting_seqnos_.erase(it);
+}
+
 void IndexScheduler::seqno_interfaces_processed(std::uint32_t mc_seqno, ParsedBlockPtr parsed_block) {
     LOG(DEBUG) << "Interfaces processed for seqno " << mc_seqno;
+    detection_finished(mc_seqno);
+    if (detection_digests_.enabled()) {
+        detection_digests_.add(mc_seqno, detection_digest(parsed_block->account_interfaces_));
+    }
+    // block data, shard states and config are needed for detection only, don't hold them in the insert queue
+    parsed_block->mc_block_ = {};
 
     auto P = td::PromiseCreator::lambda([SelfId = actor_id(this), mc_seqno](td::Result<ParsedBlockPtr> R) {
         if (R.is_error()) {
@@ -257,14 +480,28 @@ void IndexScheduler::print_stats() {
        << cur_queue_state_.blocks_ << "b, " 
        << cur_queue_state_.txs_ << "t, " 
        << cur_queue_state_.msgs_ << "m, "
-       << cur_queue_state_.traces_ << "T]";
+       << cur_queue_state_.traces_ << "T, "
+       << (cur_queue_state_.bytes_ >> 20) << "MB]"
+       << "\tD[" << detecting_accounts_ << "a]"
+       << "\tF[" << seqno_credits_.size() << "M, " << in_flight_state_.txs_ << "t, " << (in_flight_state_.bytes_ >> 20) << "MB]";
+    if (backfill_started_) {
+        sb << "\tB[" << std::min<std::int64_t>(next_backfill_seqno_, backfill_to_ + 1) - 1 << " / " << backfill_to_
+           << ", " << backfill_processing_ << " active]";
+    }
     LOG(INFO) << sb.as_cslice().str();
+    if (detection_digests_.enabled() && !detection_digests_.stats().empty()) {
+        LOG(INFO) << detection_digests_.stats();
+    }
 }
 
 void IndexScheduler::seqno_queued_to_insert(std::uint32_t mc_seqno, QueueState status) {
     LOG(DEBUG) << "Seqno queued to insert " << mc_seqno;
 
+    if (is_backfill_seqno(mc_seqno) && processing_seqnos_.contains(mc_seqno)) {
+        --backfill_processing_;
+    }
     processing_seqnos_.erase(mc_seqno);
+    release_credit(mc_seqno);
     got_insert_queue_state(status);
 }
 
@@ -284,17 +521,197 @@ void IndexScheduler::seqno_inserted(std::uint32_t mc_seqno, td::Unit result) {
 }
 
 void IndexScheduler::schedule_next_seqnos() {
+    if (draining_) {
+        return;
+    }
     LOG(DEBUG) << "Scheduling next seqnos. Current tasks: " << processing_seqnos_.size();
-    while (!queued_seqnos_.empty() && (processing_seqnos_.size() < max_active_tasks_)) {
+    bool detection_saturated = max_detecting_accounts_ > 0 && detecting_accounts_ >= max_detecting_accounts_;
+    if (detection_saturated) {
+        LOG(DEBUG) << "Interface detection is saturated: " << detecting_accounts_ << " accounts in progress";
+    }
+    while (!queued_seqnos_.empty() && (processing_seqnos_.size() < max_active_tasks_) && !detection_saturated
+           && has_fetch_credit(max_queue_)) {
         std::uint32_t seqno = queued_seqnos_.front();
         queued_seqnos_.pop();
         schedule_seqno(seqno);
     }
+    if (!detection_saturated) {
+        schedule_backfill_seqnos();
+    }
 
     if(to_seqno_ > 0 && last_known_seqno_ > to_seqno_ 
        && queued_seqnos_.empty() && processing_seqnos_.empty()
-       && cur_queue_state_.blocks_ == 0) {
-        // stop();
+       && (!backfill_started_ || backfill_finished_)) {
+        start_drain(PSTRING() << "reached seqno " << to_seqno_);
+        return;
+    }
+}
+
+void IndexScheduler::schedule_backfill_seqnos() {
+    if (!backfill_started_ || backfill_finished_) {
+        return;
+    }
+    // a quarter of the task slots and half of the insert queue stay reserved for the tip lane
+    std::uint32_t reserved_tip_tasks = std::max<std::uint32_t>(1, max_active_tasks_ / 4);
+    QueueState backfill_queue{max_queue_.mc_blocks_ / 2, max_queue_.blocks_ / 2, max_queue_.txs_ / 2,
+                              max_queue_.msgs_ / 2, max_queue_.traces_ / 2, max_queue_.bytes_ / 2};
+    if (max_active_tasks_ <= reserved_tip_tasks) {
+        return;
+    }
+    std::uint32_t backfill_tasks = max_active_tasks_ - reserved_tip_tasks;
+    while (processing_seqnos_.size() < max_active_tasks_ && backfill_processing_ < backfill_tasks
+           && has_fetch_credit(backfill_queue)) {
+        if (!backfill_retry_seqnos_.empty()) {
+            auto seqno = backfill_retry_seqnos_.front();
+            backfill_retry_seqnos_.pop();
+            schedule_seqno(seqno);
+            continue;
+        }
+        if (next_backfill_seqno_ > static_cast<std::uint32_t>(backfill_to_)) {
+            break;
+        }
+        schedule_seqno(next_backfill_seqno_++);
+    }
+    if (next_backfill_seqno_ > static_cast<std::uint32_t>(backfill_to_) && backfill_retry_seqnos_.empty()
+        && backfill_processing_ == 0) {
+        LOG(INFO) << "Backfill finished at seqno " << backfill_to_;
+        backfill_finished_ = true;
+    }
+}
+
+bool IndexScheduler::has_fetch_credit(const QueueState& limit) const {
+    // one seqno always gets through, even if a single block is larger than the limit
+    if (seqno_credits_.empty()) {
+        return true;
+    }
+    return (cur_queue_state_ + in_flight_state_ + seqno_credit_estimate_) < limit;
+}
+
+void IndexScheduler::reserve_credit(std::uint32_t mc_seqno) {
+    auto [it, inserted] = seqno_credits_.emplace(mc_seqno, seqno_credit_estimate_);
+    if (inserted) {
+        in_flight_state_ += it->second;
+    }
+}
+
+void IndexScheduler::update_credit(std::uint32_t mc_seqno, const QueueState& actual) {
+    auto it = seqno_credits_.find(mc_seqno);
+    if (it != seqno_credits_.end()) {
+        in_flight_state_ += actual - it->second;
+        it->second = actual;
+    }
+    // moving average of recent seqnos, the next credits are reserved with it. Kept in doubles, an integer
+    // average truncates small values to zero and never grows past (value - 7).
+    std::array<double, 5> values{static_cast<double>(actual.blocks_), static_cast<double>(actual.txs_), static_cast<double>(actual.msgs_),
+                                 static_cast<double>(actual.traces_), static_cast<double>(actual.bytes_)};
+    for (size_t i = 0; i < values.size(); ++i) {
+        seqno_credit_average_[i] = (7 * seqno_credit_average_[i] + values[i]) / 8;
+    }
+    auto rounded = [&](size_t i) {
+        return std::llround(seqno_credit_average_[i]);
+    };
+    seqno_credit_estimate_ = QueueState{1, static_cast<std::int32_t>(rounded(0)), static_cast<std::int32_t>(rounded(1)),
+                                        static_cast<std::int32_t>(rounded(2)), static_cast<std::int32_t>(rounded(3)), static_cast<std::int64_t>(rounded(4))};
+}
+
+void IndexScheduler::release_credit(std::uint32_t mc_seqno) {
+    auto it = seqno_credits_.find(mc_seqno);
+    if (it == seqno_credits_.end()) {
         return;
     }
+    in_flight_state_ -= it->second;
+    seqno_credits_.erase(it);
+}
+
+void IndexScheduler::request_shutdown() {
+    if (shutdown_requested_.exchange(true)) {
+        std::_Exit(1);
+    }
+}
+
+void IndexScheduler::start_drain(std::string reason) {
+    if (draining_) {
+        return;
+    }
+    LOG(INFO) << "Draining (" << reason << "): " << processing_seqnos_.size() << " seqnos in flight, no new seqnos are fetched";
+    draining_ = true;
+
+    // failed seqnos waiting for a retry are still needed if later ones of their lane wait for them in the trace assembler
+    std::uint32_t last_tip_seqno = 0;
+    for (const auto& [seqno, credit] : seqno_credits_) {
+        if (!is_backfill_seqno(seqno)) {
+            last_tip_seqno = std::max(last_tip_seqno, seqno);
+        }
+    }
+    while (!queued_seqnos_.empty()) {
+        auto seqno = queued_seqnos_.front();
+        queued_seqnos_.pop();
+        if (seqno < last_tip_seqno) {
+            drain_retry_seqnos_.push(seqno);
+        }
+    }
+    while (!backfill_retry_seqnos_.empty()) {
+        if (backfill_processing_ > 0) {
+            drain_retry_seqnos_.push(backfill_retry_seqnos_.front());
+        }
+        backfill_retry_seqnos_.pop();
+    }
+    continue_drain();
+}
+
+void IndexScheduler::continue_drain() {
+    while (!drain_retry_seqnos_.empty()) {
+        auto seqno = drain_retry_seqnos_.front();
+        drain_retry_seqnos_.pop();
+        schedule_seqno(seqno);
+    }
+    if (!processing_seqnos_.empty() || draining_inserts_) {
+        return;
+    }
+    LOG(INFO) << "All seqnos in flight are queued to insert, draining insert queue";
+    draining_inserts_ = true;
+    auto P = td::PromiseCreator::lambda([SelfId = actor_id(this)](td::Result<td::Unit> R) {
+        td::actor::send_closure(SelfId, &IndexScheduler::insert_queue_drained, std::move(R));
+    });
+    td::actor::send_closure(insert_manager_, &InsertManagerInterface::drain, std::move(P));
+}
+
+void IndexScheduler::insert_queue_drained(td::Result<td::Unit> R) {
+    if (R.is_error()) {
+        LOG(ERROR) << "Failed to drain insert queue: " << R.move_as_error();
+    } else {
+        LOG(INFO) << "Insert queue drained, last indexed seqno " << last_indexed_seqno_;
+    }
+    flush_trace_assembler_states();
+}
+
+void IndexScheduler::flush_trace_assembler_states() {
+    std::vector<td::actor::ActorId<TraceAssembler>> assemblers{trace_assembler_.get()};
+    if (!backfill_trace_assembler_.empty()) {
+        assemblers.push_back(backfill_trace_assembler_.get());
+    }
+    auto left = std::make_shared<std::atomic<size_t>>(assemblers.size());
+    for (auto& assembler : assemblers) {
+        auto P = td::PromiseCreator::lambda([SelfId = actor_id(this), left](td::Result<ton::BlockSeqno> R) {
+            if (R.is_error()) {
+                LOG(ERROR) << "Failed to flush TraceAssembler state: " << R.move_as_error();
+            } else {
+                LOG(INFO) << "Flushed TraceAssembler state for seqno " << R.ok();
+            }
+            if (--*left == 0) {
+                td::actor::send_closure(SelfId, &IndexScheduler::finish_drain);
+            }
+        });
+        td::actor::send_closure(assembler, &TraceAssembler::flush_state, std::move(P));
+    }
+}
+
+void IndexScheduler::finish_drain() {
+    auto S = DetectionCache::instance().flush();
+    if (S.is_error()) {
+        LOG(ERROR) << "Failed to flush detection cache: " << S;
+    }
+    LOG(INFO) << "Drain finished, stopping";
+    // the last reference stops the scheduler
+    watcher_.reset();
 }
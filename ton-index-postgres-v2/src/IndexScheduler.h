@@ -1,4 +1,6 @@
 #pragma once
+#include <array>
+#include <atomic>
 #include <queue>
 #include "td/actor/actor.h"
 
@@ -8,6 +10,8 @@
 #include "TraceAssembler.h"
 #include "InsertManager.h"
 #include "DataParser.h"
+#include "DetectionDigest.h"
+#include "SeqnoRangeSet.h"
 #include "smc-interfaces/InterfacesDetector.h"
 
 using Detector = InterfacesDetector<JettonWalletDetectorR, JettonMasterDetectorR, 
@@ -17,13 +21,14 @@ using Detector = InterfacesDetector<JettonWalletDetectorR, JettonMasterDetectorR
 class IndexScheduler: public td::actor::Actor {
 private:
   std::queue<std::uint32_t> queued_seqnos_;
-  std::set<std::uint32_t> processing_seqnos_;
-  std::set<std::uint32_t> existing_seqnos_;
+  SeqnoRangeSet processing_seqnos_;
+  SeqnoRangeSet existing_seqnos_;
 
   td::actor::ActorId<DbScanner> db_scanner_;
   td::actor::ActorId<InsertManagerInterface> insert_manager_;
   td::actor::ActorId<ParseManager> parse_manager_;
   td::actor::ActorOwn<TraceAssembler> trace_assembler_;
+  td::actor::ActorId<TraceStream> trace_stream_;
   std::shared_ptr<td::Destructor> watcher_;
 
   std::string working_dir_;
@@ -41,20 +46,64 @@ private:
   QueueState max_queue_{30000, 30000, 500000, 500000};
   QueueState cur_queue_state_;
 
+  // Fetch credits: every seqno between fetch and the insert queue holds the queue space it is expected to take,
+  // an estimate until parsed and its actual size after. Credits go back when the seqno enters the insert queue.
+  std::map<std::uint32_t, QueueState> seqno_credits_;
+  QueueState in_flight_state_;
+  QueueState seqno_credit_estimate_{1, 1, 0, 0, 0, 0};
+  // moving average behind the estimate: blocks, txs, msgs, traces, bytes
+  std::array<double, 5> seqno_credit_average_{1, 0, 0, 0, 0};
+
+  // accounts of blocks currently in interface detection, used as backpressure for fetching
+  std::map<std::uint32_t, size_t> detecting_seqnos_;
+  size_t detecting_accounts_{0};
+  size_t max_detecting_accounts_{0};
+
+  DetectionDigestLog detection_digests_;
+
+  // Backfill lane: historical range indexed with capacity left by the tip lane. Its traces are
+  // assembled by a separate TraceAssembler, since assembly needs consecutive seqnos.
+  std::int32_t backfill_from_{0};
+  std::int32_t backfill_to_{0};
+  bool backfill_started_{false};
+  bool backfill_finished_{false};
+  std::uint32_t next_backfill_seqno_{0};
+  std::queue<std::uint32_t> backfill_retry_seqnos_;
+  size_t backfill_processing_{0};
+  td::actor::ActorOwn<TraceAssembler> backfill_trace_assembler_;
+
+  // TraceAssembler state at to_seqno_ goes here, to be stitched with the neighbouring ranges
+  std::string trace_boundary_dir_;
+
+  // Drain: no new seqnos are fetched, the ones in flight go through the pipeline, then the insert queue
+  // is committed and the TraceAssembler snapshot written, so a restart continues right after them
+  static std::atomic<bool> shutdown_requested_;
+  bool draining_{false};
+  bool draining_inserts_{false};
+  std::queue<std::uint32_t> drain_retry_seqnos_;
+
   std::int32_t stats_timeout_{10};
   td::Timestamp next_print_stats_;
+  td::Timestamp next_flush_detection_cache_;
 public:
   IndexScheduler(td::actor::ActorId<DbScanner> db_scanner, td::actor::ActorId<InsertManagerInterface> insert_manager,
       td::actor::ActorId<ParseManager> parse_manager, std::string working_dir, std::int32_t from_seqno = 0, std::int32_t to_seqno = 0, bool force_index = false,
       std::uint32_t max_active_tasks = 32, QueueState max_queue = QueueState{30000, 30000, 500000, 500000}, std::int32_t stats_timeout = 10,
-      std::shared_ptr<td::Destructor> watcher = nullptr)
+      std::shared_ptr<td::Destructor> watcher = nullptr, td::actor::ActorId<TraceStream> trace_stream = {})
     : db_scanner_(db_scanner), insert_manager_(insert_manager), parse_manager_(parse_manager), working_dir_(std::move(working_dir)),
       from_seqno_(from_seqno), to_seqno_(to_seqno), force_index_(force_index), max_active_tasks_(max_active_tasks),
-      max_queue_(std::move(max_queue)), stats_timeout_(stats_timeout), watcher_(watcher) {};
+      max_queue_(std::move(max_queue)), stats_timeout_(stats_timeout), watcher_(watcher),
+      trace_stream_(std::move(trace_stream)) {};
 
   void start_up() override;
   void alarm() override;
   void run();
+  void set_max_detecting_accounts(size_t value) { max_detecting_accounts_ = value; }
+  void set_detection_digests(std::string path, bool replay);
+  void set_backfill_range(std::int32_t from_seqno, std::int32_t to_seqno);
+  void set_trace_boundary_dir(std::string dir);
+  // safe to call from a signal handler, the drain starts on the next alarm. A second call exits right away.
+  static void request_shutdown();
 private:
   void schedule_next_seqnos();
 
@@ -63,16 +112,37 @@ private:
   void seqno_fetched(std::uint32_t mc_seqno, MasterchainBlockDataState block_data_state);
   void seqno_parsed(std::uint32_t mc_seqno, ParsedBlockPtr parsed_block);
   void seqno_traces_assembled(std::uint32_t mc_seqno, ParsedBlockPtr parsed_block);
+  // writes the trace assembler state at to_seqno_ for stitching with the next range
+  void export_trace_boundary();
   void seqno_interfaces_processed(std::uint32_t mc_seqno, ParsedBlockPtr parsed_block);
   void seqno_actions_processed(std::uint32_t mc_seqno, ParsedBlockPtr parsed_block);
   void seqno_queued_to_insert(std::uint32_t mc_seqno, QueueState status);
   void seqno_inserted(std::uint32_t mc_seqno, td::Unit result);
+  void detection_finished(std::uint32_t mc_seqno);
 
+  void got_commit_watermark(td::Result<std::uint32_t> R);
   void got_existing_seqnos(td::Result<std::vector<std::uint32_t>> R);
+  void restore_trace_assembler(ton::BlockSeqno next_seqno);
   void got_trace_assembler_last_state_seqno(ton::BlockSeqno last_state_seqno);
   void got_last_known_seqno(std::uint32_t last_known_seqno);
 
+  void start_backfill(ton::BlockSeqno tip_start_seqno);
+  void got_backfill_existing_seqnos(td::Result<std::vector<std::uint32_t>> R);
+  void got_backfill_trace_assembler_state_seqno(ton::BlockSeqno last_state_seqno);
+  bool is_backfill_seqno(std::uint32_t mc_seqno) const;
+  void schedule_backfill_seqnos();
+
   void got_insert_queue_state(QueueState status);
+  bool has_fetch_credit(const QueueState& limit) const;
+  void reserve_credit(std::uint32_t mc_seqno);
+  void update_credit(std::uint32_t mc_seqno, const QueueState& actual);
+  void release_credit(std::uint32_t mc_seqno);
+
+  void start_drain(std::string reason);
+  void continue_drain();
+  void insert_queue_drained(td::Result<td::Unit> R);
+  void flush_trace_assembler_states();
+  void finish_drain();
 
   void print_stats();
 };
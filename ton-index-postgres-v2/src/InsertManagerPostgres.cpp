@@ -377,10 +377,6 @@ struct std::hash<std::pair<td::Bits256, td::Bits256>>
   }
 };
 
-// This set is used as a synchronization mechanism to prevent multiple queries for the same message
-// Otherwise Posgres will throw an error deadlock_detected
-std::unordered_set<td::Bits256> msg_bodies_in_progress;
-std::mutex messages_in_progress_mutex;
 std::mutex latest_account_states_update_mutex;
 
 //
@@ -396,29 +392,42 @@ void InsertBatchPostgres::alarm() {
     pqxx::connection c(connection_string_);
 
     pqxx::work txn(c);
-    insert_blocks(txn, with_copy_);
-    insert_shard_state(txn, with_copy_);
-    insert_transactions(txn, with_copy_);
-    insert_messages(txn, with_copy_);
-    insert_account_states(txn, with_copy_);
-    insert_jetton_transfers(txn, with_copy_);
-    insert_jetton_burns(txn, with_copy_);
-    insert_nft_transfers(txn, with_copy_);
-    insert_traces(txn, with_copy_);
     std::string insert_under_mutex_query;
-    insert_under_mutex_query += insert_jetton_masters(txn);
-    insert_under_mutex_query += insert_jetton_wallets(txn);
-    insert_under_mutex_query += insert_nft_collections(txn);
-    insert_under_mutex_query += insert_nft_items(txn);
-    insert_under_mutex_query += insert_getgems_nft_auctions(txn);
-    insert_under_mutex_query += insert_getgems_nft_sales(txn);
-    insert_under_mutex_query += insert_latest_account_states(txn);
+    if (!insert_tasks_.empty()) {
+      insert_blocks(txn, with_copy_);
+      insert_shard_state(txn, with_copy_);
+      insert_transactions(txn, with_copy_);
+      insert_messages(txn, with_copy_);
+      insert_account_states(txn, with_copy_);
+      insert_jetton_transfers(txn, with_copy_);
+      insert_jetton_burns(txn, with_copy_);
+      insert_nft_transfers(txn, with_copy_);
+      insert_traces(txn, with_copy_);
+      insert_under_mutex_query += insert_jetton_masters(txn);
+      insert_under_mutex_query += insert_jetton_wallets(txn);
+      insert_under_mutex_query += insert_nft_collections(txn);
+      insert_under_mutex_query += insert_nft_items(txn);
+      insert_under_mutex_query += insert_getgems_nft_auctions(txn);
+      insert_under_mutex_query += insert_getgems_nft_sales(txn);
+      insert_under_mutex_query += insert_latest_account_states(txn);
+    }
+    if (commit_watermark_) {
+      // greatest() since batches commit out of order
+      insert_under_mutex_query += (PSLICE() << "insert into commit_watermarks (from_seqno, to_seqno, mc_seqno) values (" 
+                                           << commit_watermark_->from_seqno << ", " << commit_watermark_->to_seqno << ", " << commit_watermark_->mc_seqno << ") "
+                                           << "on conflict (from_seqno, to_seqno) do update set mc_seqno = greatest(commit_watermarks.mc_seqno, excluded.mc_seqno);\n").str();
+    }
     
     {
       std::lock_guard<std::mutex> guard(latest_account_states_update_mutex);
       txn.exec0(insert_under_mutex_query);
       txn.commit();
     }
+    if (message_body_cache_) {
+      for (const auto& body_hash : msg_bodies_) {
+        message_body_cache_->add(body_hash);
+      }
+    }
 
     for(auto& task : insert_tasks_) {
       task.promise_.set_value(td::Unit());
@@ -426,11 +435,13 @@ void InsertBatchPostgres::alarm() {
     promise_.set_value(td::Unit());
     stop();
   } catch (const pqxx::integrity_constraint_violation &e) {
+    unlock_msg_bodies();
     LOG(WARNING) << "Error COPY to PG: " << e.what();
     LOG(WARNING) << "Apparently this block already exists in the database. Nevertheless we retry with INSERT ... ON CONFLICT ...";
     with_copy_ = false;
     alarm_timestamp() = td::Timestamp::now();
   } catch (const std::exception &e) {
+    unlock_msg_bodies();
     LOG(ERROR) << "Error inserting to PG: " << e.what();
     alarm_timestamp() = td::Timestamp::in(1.0);
   }
@@ -849,31 +860,32 @@ void InsertBatchPostgres::insert_messages(pqxx::work &txn, bool with_copy) {
   };
 
   std::vector<std::tuple<td::Bits256, std::string_view>> msg_bodies;
-  // we lock the message bodies to prevent multiple parallel queries for the same message
-  // otherwise it causes deadlocks
+  // a body locked by another batch is written by it, a body locked earlier by this one is a duplicate
+  msg_bodies_.clear();
+  msg_bodies_locked_ = true;
   auto lock_msg_body = [&](const td::Bits256& body_hash, const std::string& body_boc) {
-    if (msg_bodies_in_progress.find(body_hash) == msg_bodies_in_progress.end()) {
+    if (message_body_cache_ && message_body_cache_->contains(body_hash)) {
+      return;
+    }
+    if (message_body_locks_->try_lock(body_hash)) {
       msg_bodies.push_back({body_hash, body_boc});
-      msg_bodies_in_progress.insert(body_hash);
+      msg_bodies_.push_back(body_hash);
     }
   };
 
-  {
-    std::lock_guard<std::mutex> guard(messages_in_progress_mutex);
-    for (const auto& task : insert_tasks_) {
-      for (const auto &blk : task.parsed_block_->blocks_) {
-        for (const auto& transaction : blk.transactions) {
-          if (transaction.in_msg) {
-            lock_msg_body(transaction.in_msg->body->get_hash().bits(), transaction.in_msg->body_boc);
-            if (transaction.in_msg->init_state_boc) {
-              lock_msg_body(transaction.in_msg->init_state->get_hash().bits(), transaction.in_msg->init_state_boc.value());
-            }
+  for (const auto& task : insert_tasks_) {
+    for (const auto &blk : task.parsed_block_->blocks_) {
+      for (const auto& transaction : blk.transactions) {
+        if (transaction.in_msg) {
+          lock_msg_body(transaction.in_msg->body->get_hash().bits(), transaction.in_msg->body_boc);
+          if (transaction.in_msg->init_state_boc) {
+            lock_msg_body(transaction.in_msg->init_state->get_hash().bits(), transaction.in_msg->init_state_boc.value());
           }
-          for (const auto& msg : transaction.out_msgs) {
-            lock_msg_body(msg.body->get_hash().bits(), msg.body_boc);
-            if (msg.init_state_boc) {
-              lock_msg_body(msg.init_state->get_hash().bits(), msg.init_state_boc.value());
-            }
+        }
+        for (const auto& msg : transaction.out_msgs) {
+          lock_msg_body(msg.body->get_hash().bits(), msg.body_boc);
+          if (msg.init_state_boc) {
+            lock_msg_body(msg.init_state->get_hash().bits(), msg.init_state_boc.value());
           }
         }
       }
@@ -903,13 +915,18 @@ void InsertBatchPostgres::insert_messages(pqxx::work &txn, bool with_copy) {
   }
   bodies_stream.finish();
 
-  // unlock message bodies
-  {
-    std::lock_guard<std::mutex> guard(messages_in_progress_mutex);
-    for (const auto& [body_hash, body] : msg_bodies) {
-      msg_bodies_in_progress.erase(body_hash);
-    }
+  unlock_msg_bodies();
+}
+
+// bodies stay in msg_bodies_ for the cache, a retry after an error locks them again
+void InsertBatchPostgres::unlock_msg_bodies() {
+  if (!msg_bodies_locked_) {
+    return;
+  }
+  for (const auto& body_hash : msg_bodies_) {
+    message_body_locks_->unlock(body_hash);
   }
+  msg_bodies_locked_ = false;
 }
 
 void InsertBatchPostgres::insert_account_states(pqxx::work &txn, bool with_copy) {
@@ -1984,6 +2001,17 @@ void InsertManagerPostgres::start_up() {
       "last_transaction_lt bigint);\n"
     );
 
+    // row per indexed range (to_seqno 0 for an open range), all mc seqnos of the range up to mc_seqno are committed.
+    // The former single row table was shared by all ranges, its value isn't trusted.
+    query += (
+      "drop table if exists commit_watermark;\n"
+      "create table if not exists commit_watermarks ("
+      "from_seqno integer not null, "
+      "to_seqno integer not null, "
+      "mc_seqno integer not null, "
+      "primary key (from_seqno, to_seqno));\n"
+    );
+
     LOG(DEBUG) << query;
     txn.exec0(query);
     txn.commit();
@@ -2149,8 +2177,34 @@ void InsertManagerPostgres::set_max_data_depth(std::int32_t value) {
   max_data_depth_ = value;
 }
 
+void InsertManagerPostgres::set_message_body_cache_size(size_t value) {
+  LOG(INFO) << "InsertManagerPostgres message body cache size set to " << value;
+  message_body_cache_ = value > 0 ? std::make_shared<MessageBodyCache>(value) : nullptr;
+}
+
 void InsertManagerPostgres::create_insert_actor(std::vector<InsertTaskStruct> insert_tasks, td::Promise<td::Unit> promise) {
-  td::actor::create_actor<InsertBatchPostgres>("insert_batch_postgres", credential_, std::move(insert_tasks), std::move(promise), max_data_depth_).release();
+  create_insert_actor(std::move(insert_tasks), std::nullopt, std::move(promise));
+}
+
+void InsertManagerPostgres::create_insert_actor(std::vector<InsertTaskStruct> insert_tasks, std::optional<std::uint32_t> commit_watermark, td::Promise<td::Unit> promise) {
+  td::actor::create_actor<InsertBatchPostgres>("insert_batch_postgres", credential_, std::move(insert_tasks), std::move(promise), max_data_depth_, 
+                                               commit_watermark ? std::make_optional(CommitWatermarkRow{watermark_from_seqno_, watermark_to_seqno_, commit_watermark.value()}) : std::nullopt, 
+                                               message_body_cache_, message_body_locks_).release();
+}
+
+void InsertManagerPostgres::get_commit_watermark(td::Promise<std::uint32_t> promise, std::int32_t from_seqno, std::int32_t to_seqno) {
+  try {
+    pqxx::connection c(credential_.get_connection_string());
+    pqxx::work txn(c);
+    auto row = txn.exec((PSLICE() << "select mc_seqno from commit_watermarks where from_seqno = " << from_seqno << " and to_seqno = " << to_seqno).str());
+    if (row.empty()) {
+      promise.set_error(td::Status::Error(ErrorCode::ENTITY_NOT_FOUND, "commit watermark is not written yet"));
+      return;
+    }
+    promise.set_value(row[0][0].as<std::uint32_t>());
+  } catch (const std::exception &e) {
+    promise.set_error(td::Status::Error(ErrorCode::DB_ERROR, PSLICE() << "Error reading commit watermark from PG: " << e.what()));
+  }
 }
 
 void InsertManagerPostgres::get_existing_seqnos(td::Promise<std::vector<std::uint32_t>> promise, std::int32_t from_seqno, std::int32_t to_seqno) {
@@ -2175,3 +2229,50 @@ void InsertManagerPostgres::get_existing_seqnos(td::Promise<std::vector<std::uin
     promise.set_error(td::Status::Error(ErrorCode::DB_ERROR, PSLICE() << "Error selecting from PG: " << e.what()));
   }
 }
+
+td::Status apply_trace_stitch(const InsertManagerPostgres::Credential& credential, const TraceStitchResult& stitch) {
+  try {
+    pqxx::connection c(credential.get_connection_string());
+    pqxx::work txn(c);
+    txn.exec0("create temporary table trace_remap (old_trace_id tonhash primary key, new_trace_id tonhash) on commit drop;");
+    {
+      std::initializer_list<std::string_view> columns = {"old_trace_id", "new_trace_id"};
+      PopulateTableStream stream(txn, "trace_remap", columns, 1000, true);
+      for (const auto& [old_trace_id, new_trace_id] : stitch.remap) {
+        stream.insert_row(std::make_tuple(old_trace_id, new_trace_id));
+      }
+      stream.finish();
+    }
+    for (auto table : {"transactions", "messages", "jetton_transfers", "jetton_burns", "nft_transfers"}) {
+      auto updated = txn.exec0((PSLICE() << "update " << table << " set trace_id = trace_remap.new_trace_id from trace_remap "
+                                         << "where " << table << ".trace_id = trace_remap.old_trace_id;").str());
+      LOG(INFO) << "Stitched trace ids: " << updated.affected_rows() << " rows in " << table;
+    }
+
+    std::initializer_list<std::string_view> columns = { "trace_id", "external_hash", "mc_seqno_start", "mc_seqno_end",
+      "start_lt", "start_utime", "end_lt", "end_utime", "state", "pending_edges_", "edges_", "nodes_" };
+    PopulateTableStream stream(txn, "traces", columns, 1000, false);
+    stream.setConflictDoUpdate({"trace_id"}, "traces.end_lt <= EXCLUDED.end_lt");
+    for (const auto& trace : stitch.completed) {
+      stream.insert_row(std::make_tuple(
+        trace.trace_id,
+        trace.external_hash,
+        trace.mc_seqno_start,
+        trace.mc_seqno_end,
+        trace.start_lt,
+        trace.start_utime,
+        trace.end_lt,
+        trace.end_utime,
+        std::string("complete"),
+        trace.pending_edges_,
+        trace.edges_,
+        trace.nodes_
+      ));
+    }
+    stream.finish();
+    txn.commit();
+  } catch (const std::exception &e) {
+    return td::Status::Error(ErrorCode::DB_ERROR, PSLICE() << "Error applying trace stitch to PG: " << e.what());
+  }
+  return td::Status::OK();
+}
@@ -2,6 +2,8 @@
 #include <queue>
 #include <pqxx/pqxx>
 #include "InsertManagerBase.h"
+#include "TraceStitcher.h"
+#include "MessageBodyCache.h"
 
 
 class InsertBatchPostgres;
@@ -24,6 +26,9 @@ private:
   bool run_migrations_{false};
   std::int32_t max_data_depth_{0};
   std::int32_t out_of_sync_seqno_{0};
+  // off until set_message_body_cache_size
+  std::shared_ptr<MessageBodyCache> message_body_cache_;
+  std::shared_ptr<MessageBodyLocks> message_body_locks_{std::make_shared<MessageBodyLocks>()};
 public:
   InsertManagerPostgres(InsertManagerPostgres::Credential credential, bool custom_types, bool create_indexes, bool run_migrations) : 
     credential_(credential), custom_types_(custom_types), create_indexes_(create_indexes), run_migrations_(run_migrations) {}
@@ -31,16 +36,33 @@ public:
   void start_up() override;
 
   void set_max_data_depth(std::int32_t value);
+  // 0 disables the cache, every body is sent to message_contents
+  void set_message_body_cache_size(size_t value);
 
   void create_insert_actor(std::vector<InsertTaskStruct> insert_tasks, td::Promise<td::Unit> promise) override;
+  void create_insert_actor(std::vector<InsertTaskStruct> insert_tasks, std::optional<std::uint32_t> commit_watermark, td::Promise<td::Unit> promise) override;
   void get_existing_seqnos(td::Promise<std::vector<std::uint32_t>> promise, std::int32_t from_seqno = 0, std::int32_t to_seqno = 0) override;
+  void get_commit_watermark(td::Promise<std::uint32_t> promise, std::int32_t from_seqno = 0, std::int32_t to_seqno = 0) override;
 };
 
+// row of commit_watermarks written by a batch: the range it belongs to and the new watermark
+struct CommitWatermarkRow {
+  std::int32_t from_seqno;
+  std::int32_t to_seqno;
+  std::uint32_t mc_seqno;
+};
+
+// Moves rows of stitched traces to the trace they continue and inserts traces completed by stitching
+td::Status apply_trace_stitch(const InsertManagerPostgres::Credential& credential, const TraceStitchResult& stitch);
+
 
 class InsertBatchPostgres: public td::actor::Actor {
 public:
-  InsertBatchPostgres(InsertManagerPostgres::Credential credential, std::vector<InsertTaskStruct> insert_tasks, td::Promise<td::Unit> promise, std::int32_t max_data_depth = 12) :
-    credential_(std::move(credential)), insert_tasks_(std::move(insert_tasks)), promise_(std::move(promise)), max_data_depth_(max_data_depth) {
+  InsertBatchPostgres(InsertManagerPostgres::Credential credential, std::vector<InsertTaskStruct> insert_tasks, td::Promise<td::Unit> promise, std::int32_t max_data_depth = 12,
+                      std::optional<CommitWatermarkRow> commit_watermark = std::nullopt, std::shared_ptr<MessageBodyCache> message_body_cache = nullptr,
+                      std::shared_ptr<MessageBodyLocks> message_body_locks = std::make_shared<MessageBodyLocks>()) :
+    credential_(std::move(credential)), insert_tasks_(std::move(insert_tasks)), promise_(std::move(promise)), max_data_depth_(max_data_depth),
+    commit_watermark_(commit_watermark), message_body_cache_(std::move(message_body_cache)), message_body_locks_(std::move(message_body_locks)) {
       // sorting in descending seqno order for easier processing of interfaces
       std::sort(insert_tasks_.begin(), insert_tasks_.end(), [](const auto& a, const auto& b) {
         return a.mc_seqno_ > b.mc_seqno_;
@@ -55,6 +77,12 @@ private:
   std::vector<InsertTaskStruct> insert_tasks_;
   td::Promise<td::Unit> promise_;
   std::int32_t max_data_depth_;
+  std::optional<CommitWatermarkRow> commit_watermark_;
+  std::shared_ptr<MessageBodyCache> message_body_cache_;
+  std::shared_ptr<MessageBodyLocks> message_body_locks_;
+  // bodies this batch writes to message_contents: locked while written, known to the cache once committed
+  std::vector<td::Bits256> msg_bodies_;
+  bool msg_bodies_locked_{false};
   bool with_copy_{true};
 
   std::string stringify(schema::ComputeSkipReason compute_skip_reason);
@@ -66,6 +94,7 @@ private:
   void insert_shard_state(pqxx::work &txn, bool with_copy);
   void insert_transactions(pqxx::work &txn, bool with_copy);
   void insert_messages(pqxx::work &txn, bool with_copy);
+  void unlock_msg_bodies();
   void insert_account_states(pqxx::work &txn, bool with_copy);
   std::string insert_latest_account_states(pqxx::work &txn);
   void insert_jetton_transfers(pqxx::work &txn, bool with_copy);
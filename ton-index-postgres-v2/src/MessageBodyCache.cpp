@@ -0,0 +1,45 @@
+#include <algorithm>
+#include "MessageBodyCache.h"
+
+
+MessageBodyCache::MessageBodyCache(size_t capacity) : shard_capacity_(std::max<size_t>(1, capacity / message_body_shards)) {
+}
+
+bool MessageBodyCache::contains(const td::Bits256& hash) {
+  auto& shard = get_shard(hash);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  auto it = shard.index.find(hash);
+  if (it == shard.index.end()) {
+    return false;
+  }
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+  return true;
+}
+
+void MessageBodyCache::add(const td::Bits256& hash) {
+  auto& shard = get_shard(hash);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  auto it = shard.index.find(hash);
+  if (it != shard.index.end()) {
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return;
+  }
+  shard.lru.push_front(hash);
+  shard.index.emplace(hash, shard.lru.begin());
+  if (shard.lru.size() > shard_capacity_) {
+    shard.index.erase(shard.lru.back());
+    shard.lru.pop_back();
+  }
+}
+
+bool MessageBodyLocks::try_lock(const td::Bits256& hash) {
+  auto& shard = shards_[message_body_shard(hash)];
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  return shard.hashes.insert(hash).second;
+}
+
+void MessageBodyLocks::unlock(const td::Bits256& hash) {
+  auto& shard = shards_[message_body_shard(hash)];
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  shard.hashes.erase(hash);
+}
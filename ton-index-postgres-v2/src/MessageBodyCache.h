@@ -0,0 +1,66 @@
+#pragma once
+#include <array>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include "crypto/common/bitstring.h"
+
+
+// hashes are uniformly distributed already
+struct MessageBodyHasher {
+  std::size_t operator()(const td::Bits256& hash) const {
+    std::size_t value;
+    std::memcpy(&value, hash.data(), sizeof(value));
+    return value;
+  }
+};
+
+constexpr size_t message_body_shards = 64;
+
+inline size_t message_body_shard(const td::Bits256& hash) {
+  return hash.data()[31] % message_body_shards;
+}
+
+// Hashes of message bodies and init states committed to message_contents recently. Popular bodies
+// (empty comment, jetton notify) are skipped instead of being sent again only to hit ON CONFLICT DO NOTHING.
+// Only committed hashes are added, so a hit is always in the database. Shards are LRUs with own locks.
+class MessageBodyCache {
+public:
+  explicit MessageBodyCache(size_t capacity);
+
+  bool contains(const td::Bits256& hash);
+  void add(const td::Bits256& hash);
+private:
+  struct Shard {
+    std::mutex mutex;
+    std::list<td::Bits256> lru;  // most recent first
+    std::unordered_map<td::Bits256, std::list<td::Bits256>::iterator, MessageBodyHasher> index;
+  };
+
+  std::array<Shard, message_body_shards> shards_;
+  size_t shard_capacity_;
+
+  Shard& get_shard(const td::Bits256& hash) {
+    return shards_[message_body_shard(hash)];
+  }
+};
+
+
+// Bodies being written to message_contents by some insert batch. Parallel ON CONFLICT inserts of the same row
+// deadlock in Postgres, so a batch leaves bodies locked by another one to it. Batches only wait for each other
+// when they touch the same shard at the same moment.
+class MessageBodyLocks {
+public:
+  // false if the body is already locked, by another batch or earlier by the same one
+  bool try_lock(const td::Bits256& hash);
+  void unlock(const td::Bits256& hash);
+private:
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_set<td::Bits256, MessageBodyHasher> hashes;
+  };
+
+  std::array<Shard, message_body_shards> shards_;
+};
@@ -0,0 +1,47 @@
+#include "TraceStreamRedis.h"
+#include "TraceAssembler.h"
+
+
+sw::redis::ConnectionOptions TraceStreamRedis::connection_options(const std::string& redis_uri) {
+    sw::redis::ConnectionOptions options(redis_uri);
+    options.connect_timeout = connect_timeout;
+    options.socket_timeout = socket_timeout;
+    return options;
+}
+
+void TraceStreamRedis::publish(TraceStreamBatchPtr batch, td::Promise<td::Unit> promise) {
+    if (batch->traces.empty()) {
+        promise.set_value(td::Unit());
+        return;
+    }
+    try {
+        if (!pipeline_) {
+            pipeline_.emplace(redis_.pipeline());
+        }
+        for (const auto& trace : batch->traces) {
+            std::vector<TraceEdgeImpl> edges;
+            edges.reserve(trace.edges.size());
+            for (const auto& edge : trace.edges) {
+                edges.push_back(TraceEdgeImpl::from_schema(edge));
+            }
+            std::stringstream buffer;
+            msgpack::pack(buffer, edges);
+
+            std::vector<std::pair<std::string, std::string>> fields = {
+                {"mc_seqno", std::to_string(batch->mc_seqno)},
+                {"trace_id", trace.trace_id.to_hex()},
+                {"state", std::to_string(static_cast<int>(trace.state))},
+                {"mc_seqno_start", std::to_string(trace.mc_seqno_start)},
+                {"mc_seqno_end", std::to_string(trace.mc_seqno_end)},
+                {"edges", buffer.str()},
+            };
+            pipeline_->xadd(stream_key_, "*", fields.begin(), fields.end(), max_len_, true);
+        }
+        pipeline_->exec();
+    } catch (const std::exception& e) {
+        pipeline_.reset();
+        promise.set_error(td::Status::Error(PSLICE() << "redis publish of mc block " << batch->mc_seqno << " failed: " << e.what()));
+        return;
+    }
+    promise.set_value(td::Unit());
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <optional>
+#include <sw/redis++/redis++.h>
+#include "TraceStream.h"
+
+
+// Publishes every trace of a batch as an entry of a capped Redis stream. Entries of a batch go in one
+// pipeline. Redis calls block, so the sink is meant to run on a scheduler of its own, and bounded timeouts
+// turn a stalled server into a failed batch.
+class TraceStreamRedis: public TraceStreamSink {
+    static constexpr std::chrono::milliseconds connect_timeout{1000};
+    static constexpr std::chrono::milliseconds socket_timeout{5000};
+
+    sw::redis::Redis redis_;
+    std::string stream_key_;
+    long long max_len_;
+    // owns a dedicated connection, recreated after an error leaves it in unknown state
+    std::optional<sw::redis::Pipeline> pipeline_;
+
+    static sw::redis::ConnectionOptions connection_options(const std::string& redis_uri);
+public:
+    TraceStreamRedis(std::string redis_uri, std::string stream_key, long long max_len) :
+        redis_(connection_options(redis_uri)), stream_key_(std::move(stream_key)), max_len_(max_len) {}
+
+    void publish(TraceStreamBatchPtr batch, td::Promise<td::Unit> promise) override;
+};
@@ -8,11 +8,20 @@
 #include "crypto/vm/cp0.h"
 
 #include "InsertManagerPostgres.h"
+#include "InsertManagerComposite.h"
+#include "InsertManagerFile.h"
 #include "DataParser.h"
 #include "DbScanner.h"
 #include "TraceAssembler.h"
 #include "EventProcessor.h"
 #include "IndexScheduler.h"
+#include "BlockInterfacesDetector.h"
+#include "TraceStream.h"
+#include "TraceStreamRedis.h"
+#include "smc-interfaces/FastDecoders.h"
+#include "smc-interfaces/DetectionCache.h"
+#include "smc-interfaces/DetectionCaches.h"
+#include "smc-interfaces/InterfaceVerdictCache.h"
 
 
 int main(int argc, char *argv[]) {
@@ -24,32 +33,56 @@ int main(int argc, char *argv[]) {
   td::actor::ActorOwn<DbScanner> db_scanner_;
   td::actor::ActorOwn<ParseManager> parse_manager_;
   td::actor::ActorOwn<InsertManagerPostgres> insert_manager_;
+  std::vector<td::actor::ActorOwn<InsertManagerPostgres>> mirror_insert_managers_;
+  td::actor::ActorOwn<InsertManagerFile> file_insert_manager_;
+  td::actor::ActorOwn<InsertManagerComposite> composite_insert_manager_;
   td::actor::ActorOwn<IndexScheduler> index_scheduler_;
+  td::actor::ActorOwn<TraceStream> trace_stream_;
 
   // options
   td::uint32 threads = 7;
   td::uint32 io_workers = 1;
+  td::uint32 detector_threads = 0;
+  td::uint32 max_detecting_accounts = 0;
+  std::string detection_digests_path;
+  bool detection_replay = false;
   td::int32 stats_timeout = 10;
   std::string db_root;
   std::string working_dir;
   td::uint32 last_known_seqno = 0;
   td::uint32 from_seqno = 0;
   td::uint32 to_seqno = 0;
+  td::int32 backfill_from = 0;
+  td::int32 backfill_to = 0;
+  std::string trace_boundary_dir;
+  std::string stitch_traces_dir;
   bool force_index = false;
   bool custom_types = false;
   bool create_indexes = true;
   bool run_migrations = true;
   InsertManagerPostgres::Credential credential;
+  std::vector<std::string> mirror_dbnames;
+  std::string file_sink_dir;
+  std::int32_t file_sink_mc_blocks = 1000;
+  bool file_sink_only = false;
   bool testnet = false;
 
   std::uint32_t max_active_tasks = 7;
   std::uint32_t max_insert_actors = 12;
   std::int32_t max_data_depth = 0;
+  std::int32_t message_body_cache_size = 0;
   
   std::int32_t max_queue_size{-1};
   std::int32_t max_batch_size{-1};
   QueueState max_queue{10000, 100000, 100000, 100000};
   QueueState batch_size{2000, 2000, 10000, 10000};
+  double adaptive_batch_latency = 0;
+  double adaptive_batch_min_scale = 0.05;
+
+  std::string trace_stream_redis;
+  std::string trace_stream_key = "traces";
+  std::uint32_t trace_stream_buffer = 64;
+  std::int64_t trace_stream_max_len = 100000;
   
   td::OptionParser p;
   p.set_description("Parse TON DB and insert data into Postgres");
@@ -90,6 +123,28 @@ int main(int argc, char *argv[]) {
   p.add_option('d', "dbname", "PostgreSQL database name", [&](td::Slice value) { 
     credential.dbname = value.str();
   });
+  p.add_option('\0', "mirror-dbname", "Also insert into this PostgreSQL database on the same server, can be repeated", [&](td::Slice value) { 
+    mirror_dbnames.push_back(value.str());
+  });
+  p.add_option('\0', "file-sink", "Also write columnar files partitioned by mc seqno range to this directory", [&](td::Slice value) { 
+    file_sink_dir = value.str();
+  });
+  p.add_option('\0', "file-sink-only", "Write only the file sink, PostgreSQL is not used", [&]() { 
+    file_sink_only = true;
+  });
+  p.add_checked_option('\0', "file-sink-mc-blocks", "Mc blocks per file sink partition (default: 1000)", [&](td::Slice value) { 
+    int v;
+    try {
+      v = std::stoi(value.str());
+    } catch (...) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --file-sink-mc-blocks: not a number");
+    }
+    if (v <= 0) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --file-sink-mc-blocks: must be positive");
+    }
+    file_sink_mc_blocks = v;
+    return td::Status::OK();
+  });
   p.add_option('\0', "custom-types", "Use pgton extension with custom types", [&]() {
     custom_types = true;
     LOG(WARNING) << "Using pgton extension!";
@@ -129,6 +184,32 @@ int main(int argc, char *argv[]) {
     to_seqno = v;
     return td::Status::OK();
   });
+  p.add_checked_option('\0', "backfill-from", "First masterchain seqno of a historical range indexed in background, tip seqnos go first", [&](td::Slice value) { 
+    int v;
+    try {
+      v = std::stoi(value.str());
+    } catch (...) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --backfill-from: not a number");
+    }
+    backfill_from = v;
+    return td::Status::OK();
+  });
+  p.add_checked_option('\0', "backfill-to", "Last masterchain seqno of the background range, clamped below --from", [&](td::Slice value) { 
+    int v;
+    try {
+      v = std::stoi(value.str());
+    } catch (...) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --backfill-to: not a number");
+    }
+    backfill_to = v;
+    return td::Status::OK();
+  });
+  p.add_option('\0', "trace-boundary-dir", "Export TraceAssembler state at the end of --from/--to range to this directory for --stitch-traces", [&](td::Slice fname) { 
+    trace_boundary_dir = fname.str();
+  });
+  p.add_option('\0', "stitch-traces", "Stitch traces crossing ranges of workers exported with --trace-boundary-dir into this directory and exit", [&](td::Slice fname) { 
+    stitch_traces_dir = fname.str();
+  });
   p.add_option('\0', "force", "Ignore existing seqnos and force reindex", [&]() {
     force_index = true;
     LOG(WARNING) << "Force reindexing enabled";
@@ -144,6 +225,19 @@ int main(int argc, char *argv[]) {
     max_data_depth = v;
     return td::Status::OK();
   });
+  p.add_checked_option('\0', "message-body-cache", "Number of recently committed message body hashes not sent to the database again (default: 0, disabled)", [&](td::Slice value) { 
+    int v;
+    try {
+      v = std::stoi(value.str());
+    } catch (...) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --message-body-cache: not a number");
+    }
+    if (v < 0) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --message-body-cache: must be non-negative");
+    }
+    message_body_cache_size = v;
+    return td::Status::OK();
+  });
   p.add_checked_option('\0', "max-active-tasks", "Max active reading tasks", [&](td::Slice fname) { 
     int v;
     try {
@@ -188,6 +282,17 @@ int main(int argc, char *argv[]) {
     return td::Status::OK();
   });
 
+  p.add_checked_option('\0', "max-queue-bytes", "Max estimated memory of insert queue in bytes, 0 for no limit (default: 0)", [&](td::Slice fname) { 
+    long long v;
+    try {
+      v = std::stoll(fname.str());
+    } catch (...) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --max-queue-bytes: not a number");
+    }
+    max_queue.bytes_ = v;
+    return td::Status::OK();
+  });
+
   // insert manager settings
   p.add_checked_option('\0', "max-insert-actors", "Number of parallel insert actors (default: 3)", [&](td::Slice fname) { 
     int v;
@@ -231,6 +336,33 @@ int main(int argc, char *argv[]) {
     return td::Status::OK();
   });
 
+  p.add_checked_option('\0', "adaptive-batch", "Target batch commit latency in seconds. Batch sizes adapt between --adaptive-batch-min-scale and --max-batch-* to keep it", [&](td::Slice fname) { 
+    double v;
+    try {
+      v = std::stod(fname.str());
+    } catch (...) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --adaptive-batch: not a number");
+    }
+    if (v <= 0) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --adaptive-batch: must be positive");
+    }
+    adaptive_batch_latency = v;
+    return td::Status::OK();
+  });
+  p.add_checked_option('\0', "adaptive-batch-min-scale", "Lower bound of adaptive batch sizes as a fraction of --max-batch-* (default: 0.05)", [&](td::Slice fname) { 
+    double v;
+    try {
+      v = std::stod(fname.str());
+    } catch (...) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --adaptive-batch-min-scale: not a number");
+    }
+    if (v <= 0 || v > 1) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --adaptive-batch-min-scale: must be in (0, 1]");
+    }
+    adaptive_batch_min_scale = v;
+    return td::Status::OK();
+  });
+
   p.add_checked_option('\0', "max-queue-size", "Max size of insert queue", [&](td::Slice fname) { 
     int v;
     try {
@@ -252,6 +384,34 @@ int main(int argc, char *argv[]) {
     return td::Status::OK();
   });
   
+  // trace stream settings
+  p.add_option('\0', "trace-stream-redis", "Publish assembled traces to Redis stream right after trace assembly (e.g. tcp://127.0.0.1:6379)", [&](td::Slice value) {
+    trace_stream_redis = value.str();
+  });
+  p.add_option('\0', "trace-stream-key", "Redis stream key for traces (default: traces)", [&](td::Slice value) {
+    trace_stream_key = value.str();
+  });
+  p.add_checked_option('\0', "trace-stream-max-len", "Approximate max length of Redis trace stream (default: 100000)", [&](td::Slice fname) { 
+    int v;
+    try {
+      v = std::stoi(fname.str());
+    } catch (...) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --trace-stream-max-len: not a number");
+    }
+    trace_stream_max_len = v;
+    return td::Status::OK();
+  });
+  p.add_checked_option('\0', "trace-stream-buffer", "Number of mc blocks queued for a slow trace stream sink before the oldest are dropped (default: 64)", [&](td::Slice fname) { 
+    int v;
+    try {
+      v = std::stoi(fname.str());
+    } catch (...) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --trace-stream-buffer: not a number");
+    }
+    trace_stream_buffer = v;
+    return td::Status::OK();
+  });
+
   // scheduler settings
   p.add_checked_option('t', "threads", "Scheduler threads (default: 7)", [&](td::Slice fname) { 
     int v;
@@ -273,6 +433,57 @@ int main(int argc, char *argv[]) {
     io_workers = v;
     return td::Status::OK();
   });
+  p.add_checked_option('\0', "detector-threads", "Dedicated threads for interfaces detection, 0 to share main scheduler threads (default: 0)", [&](td::Slice fname) { 
+    int v;
+    try {
+      v = std::stoi(fname.str());
+    } catch (...) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --detector-threads: not a number");
+    }
+    detector_threads = v;
+    return td::Status::OK();
+  });
+  p.add_checked_option('\0', "fast-decoders-validate", "Run get-methods for every n-th natively decoded account and disable decoders disagreeing with them, 0 to never run (default: 0)", [&](td::Slice fname) { 
+    int v;
+    try {
+      v = std::stoi(fname.str());
+    } catch (...) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --fast-decoders-validate: not a number");
+    }
+    FastDecoderRegistry::validate_every = v;
+    return td::Status::OK();
+  });
+  p.add_checked_option('\0', "detection-cache-size", "Number of jetton masters and of NFT collections kept in memory by the detection cache (default: 100000)", [&](td::Slice fname) { 
+    int v;
+    try {
+      v = std::stoi(fname.str());
+    } catch (...) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --detection-cache-size: not a number");
+    }
+    if (v < 0) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --detection-cache-size: must be non-negative");
+    }
+    DetectionCache::capacity = v;
+    return td::Status::OK();
+  });
+  p.add_checked_option('\0', "max-detecting-accounts", "Pause fetching new blocks while this many accounts wait for interfaces detection, 0 for no limit (default: 0)", [&](td::Slice fname) { 
+    int v;
+    try {
+      v = std::stoi(fname.str());
+    } catch (...) {
+      return td::Status::Error(ton::ErrorCode::error, "bad value for --max-detecting-accounts: not a number");
+    }
+    max_detecting_accounts = v;
+    return td::Status::OK();
+  });
+  p.add_option('\0', "detection-digests", "Append digest of detected interfaces of every mc block to this file", [&](td::Slice fname) { 
+    detection_digests_path = fname.str();
+  });
+  p.add_option('\0', "detection-replay", "Compare digest of detected interfaces of every mc block with ones recorded by --detection-digests", [&](td::Slice fname) { 
+    detection_digests_path = fname.str();
+    detection_replay = true;
+    DetectionCaches::enabled = false;
+  });
   p.add_checked_option('\0', "stats-freq", "Pause between printing stats in seconds", [&](td::Slice fname) { 
     int v;
     try {
@@ -289,11 +500,40 @@ int main(int argc, char *argv[]) {
     LOG(ERROR) << "failed to parse options: " << S.move_as_error();
     std::_Exit(2);
   }
+  // verdicts are persisted by IndexScheduler, other tools sharing the detectors keep them off
+  InterfaceVerdictCache::enabled = DetectionCaches::enabled;
+  if (stitch_traces_dir.size() > 0) {
+    auto states = read_trace_boundaries(stitch_traces_dir);
+    if (states.is_error()) {
+      LOG(ERROR) << states.move_as_error();
+      std::_Exit(2);
+    }
+    LOG(INFO) << "Stitching traces of " << states.ok().size() << " ranges";
+    auto stitch = stitch_trace_boundaries(states.ok());
+    if (stitch.is_error()) {
+      LOG(ERROR) << stitch.move_as_error();
+      std::_Exit(2);
+    }
+    LOG(INFO) << "Joined " << stitch.ok().stitched_edges << " edges, " << stitch.ok().remap.size() << " trace ids remapped, "
+              << stitch.ok().completed.size() << " traces completed, " << stitch.ok().pending_traces << " still pending, "
+              << stitch.ok().broken_traces << " broken";
+    auto R = apply_trace_stitch(credential, stitch.ok());
+    if (R.is_error()) {
+      LOG(ERROR) << R;
+      std::_Exit(2);
+    }
+    LOG(INFO) << "Done!";
+    return 0;
+  }
   if (working_dir.size() == 0) {
     LOG(ERROR) << "Please specify working directory with -W or --working-dir";
     std::_Exit(2);
   }
   td::mkdir(working_dir).ensure();
+  if (file_sink_only && (file_sink_dir.empty() || !mirror_dbnames.empty())) {
+    LOG(ERROR) << "--file-sink-only needs --file-sink and no --mirror-dbname";
+    std::_Exit(2);
+  }
 
   if (max_queue_size > 0) {
     max_queue.mc_blocks_ = max_queue_size;
@@ -317,21 +557,108 @@ int main(int argc, char *argv[]) {
     td::actor::SchedulerContext::get()->stop();
   });
 
-  td::actor::Scheduler scheduler({td::actor::Scheduler::NodeInfo{threads, io_workers}});
-  scheduler.run_in_context([&] { insert_manager_ = td::actor::create_actor<InsertManagerPostgres>("insertmanager", credential, custom_types, create_indexes, run_migrations); });
+  std::vector<td::actor::Scheduler::NodeInfo> scheduler_nodes{td::actor::Scheduler::NodeInfo{threads, io_workers}};
+  if (detector_threads > 0) {
+    scheduler_nodes.push_back(td::actor::Scheduler::NodeInfo{detector_threads, 0});
+    BlockInterfaceProcessor::detector_scheduler = td::actor::core::SchedulerId{1};
+  }
+  // redis calls block, the trace stream sink gets a thread of its own
+  td::actor::core::SchedulerId trace_stream_scheduler;
+  if (trace_stream_redis.size() > 0) {
+    trace_stream_scheduler = td::actor::core::SchedulerId{static_cast<td::uint8>(scheduler_nodes.size())};
+    scheduler_nodes.push_back(td::actor::Scheduler::NodeInfo{1, 0});
+  }
+  td::actor::Scheduler scheduler(scheduler_nodes);
+  td::actor::ActorId<InsertManagerInterface> insert_sink;
+  if (!file_sink_only) {
+    scheduler.run_in_context([&] { insert_manager_ = td::actor::create_actor<InsertManagerPostgres>("insertmanager", credential, custom_types, create_indexes, run_migrations); });
+    insert_sink = insert_manager_.get();
+  }
+  if (!mirror_dbnames.empty() || !file_sink_dir.empty()) {
+    scheduler.run_in_context([&] {
+      std::vector<td::actor::ActorId<InsertManagerInterface>> sinks;
+      if (!insert_manager_.empty()) {
+        sinks.push_back(insert_manager_.get());
+      }
+      for (const auto& dbname : mirror_dbnames) {
+        auto mirror_credential = credential;
+        mirror_credential.dbname = dbname;
+        mirror_insert_managers_.push_back(td::actor::create_actor<InsertManagerPostgres>("insertmanager_" + dbname, mirror_credential, custom_types, create_indexes, run_migrations));
+        sinks.push_back(mirror_insert_managers_.back().get());
+      }
+      if (!file_sink_dir.empty()) {
+        file_insert_manager_ = td::actor::create_actor<InsertManagerFile>("fileinsertmanager", file_sink_dir, file_sink_mc_blocks);
+        // the lowest seqno indexed, partitions below it are never written
+        auto file_sink_from = backfill_from > 0 ? std::min<td::uint32>(from_seqno, backfill_from) : from_seqno;
+        td::actor::send_closure(file_insert_manager_, &InsertManagerFile::set_seqno_range, file_sink_from, to_seqno);
+        // batches are staged as chunks, only the mc blocks limit rolls them
+        QueueState file_batch_size{file_sink_mc_blocks, std::numeric_limits<std::int32_t>::max(), std::numeric_limits<std::int32_t>::max(),
+                                   std::numeric_limits<std::int32_t>::max(), std::numeric_limits<std::int32_t>::max()};
+        td::actor::send_closure(file_insert_manager_, &InsertManagerFile::set_insert_batch_size, file_batch_size);
+        td::actor::send_closure(file_insert_manager_, &InsertManagerFile::set_max_queue_bytes, max_queue.bytes_);
+        sinks.push_back(file_insert_manager_.get());
+      }
+      if (sinks.size() == 1) {
+        insert_sink = sinks[0];
+        return;
+      }
+      composite_insert_manager_ = td::actor::create_actor<InsertManagerComposite>("compositeinsertmanager", std::move(sinks));
+      insert_sink = composite_insert_manager_.get();
+    });
+  }
   scheduler.run_in_context([&] { parse_manager_ = td::actor::create_actor<ParseManager>("parsemanager"); });
   scheduler.run_in_context([&] { db_scanner_ = td::actor::create_actor<DbScanner>("scanner", db_root, dbs_secondary, working_dir + "/secondary_logs"); });
 
+  if (trace_stream_redis.size() > 0) {
+    scheduler.run_in_context([&] {
+      trace_stream_ = td::actor::create_actor<TraceStream>("tracestream", trace_stream_buffer);
+      td::actor::send_closure(trace_stream_, &TraceStream::add_sink,
+        td::actor::create_actor<TraceStreamRedis>(td::actor::ActorOptions().with_name("tracestreamredis").on_scheduler(trace_stream_scheduler),
+                                                  trace_stream_redis, trace_stream_key, trace_stream_max_len));
+    });
+  }
+
   scheduler.run_in_context([&, watcher = std::move(watcher)] { index_scheduler_ = td::actor::create_actor<IndexScheduler>("indexscheduler", db_scanner_.get(), 
-    insert_manager_.get(), parse_manager_.get(), working_dir, from_seqno, to_seqno, force_index, max_active_tasks, max_queue, stats_timeout, watcher); 
+    insert_sink, parse_manager_.get(), working_dir, from_seqno, to_seqno, force_index, max_active_tasks, max_queue, stats_timeout, watcher,
+    trace_stream_.get()); 
   });
   scheduler.run_in_context([&] { 
-    td::actor::send_closure(insert_manager_, &InsertManagerPostgres::set_parallel_inserts_actors, max_insert_actors);
-    td::actor::send_closure(insert_manager_, &InsertManagerPostgres::set_insert_batch_size, batch_size);
-    td::actor::send_closure(insert_manager_, &InsertManagerPostgres::set_max_data_depth, max_data_depth);
-    td::actor::send_closure(insert_manager_, &InsertManagerPostgres::print_info);
+    std::vector<td::actor::ActorId<InsertManagerPostgres>> insert_managers;
+    if (!insert_manager_.empty()) {
+      insert_managers.push_back(insert_manager_.get());
+    }
+    for (auto& mirror : mirror_insert_managers_) {
+      insert_managers.push_back(mirror.get());
+    }
+    for (auto& insert_manager : insert_managers) {
+      td::actor::send_closure(insert_manager, &InsertManagerPostgres::set_parallel_inserts_actors, max_insert_actors);
+      td::actor::send_closure(insert_manager, &InsertManagerPostgres::set_insert_batch_size, batch_size);
+      td::actor::send_closure(insert_manager, &InsertManagerPostgres::set_max_queue_bytes, max_queue.bytes_);
+      if (adaptive_batch_latency > 0) {
+        td::actor::send_closure(insert_manager, &InsertManagerPostgres::set_adaptive_batch, adaptive_batch_latency, adaptive_batch_min_scale);
+      }
+      td::actor::send_closure(insert_manager, &InsertManagerPostgres::set_max_data_depth, max_data_depth);
+      td::actor::send_closure(insert_manager, &InsertManagerPostgres::set_message_body_cache_size, message_body_cache_size);
+      td::actor::send_closure(insert_manager, &InsertManagerPostgres::print_info);
+    }
+  });
+  scheduler.run_in_context([&] { 
+    td::actor::send_closure(index_scheduler_, &IndexScheduler::set_max_detecting_accounts, max_detecting_accounts);
+    if (!detection_digests_path.empty()) {
+      td::actor::send_closure(index_scheduler_, &IndexScheduler::set_detection_digests, detection_digests_path, detection_replay);
+    }
+    if (trace_boundary_dir.size() > 0) {
+      td::actor::send_closure(index_scheduler_, &IndexScheduler::set_trace_boundary_dir, trace_boundary_dir);
+    }
+    if (backfill_from > 0 || backfill_to > 0) {
+      td::actor::send_closure(index_scheduler_, &IndexScheduler::set_backfill_range, backfill_from, backfill_to);
+    }
+    td::actor::send_closure(index_scheduler_, &IndexScheduler::run);
   });
-  scheduler.run_in_context([&] { td::actor::send_closure(index_scheduler_, &IndexScheduler::run); });
+  // SIGTERM and SIGINT drain the pipeline before exiting, a second signal exits right away
+  td::set_signal_handler(td::SignalType::Quit, [](int sig) {
+    IndexScheduler::request_shutdown();
+  }).ensure();
   
   while(scheduler.run(1)) {
     // do something
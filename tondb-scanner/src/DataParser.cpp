@@ -8,6 +8,8 @@
 #include "validator/interfaces/block.h"
 #include "validator/interfaces/shard.h"
 #include "convert-utils.h"
+#include <algorithm>
+#include <numeric>
 
 using namespace ton::validator; //TODO: remove this
 
@@ -52,6 +54,7 @@ td::Status ParseQuery::parse_impl() {
     // config
     if (block_ds.block_data->block_id().is_masterchain()) {
       TRY_RESULT_ASSIGN(mc_block_.config_, block::ConfigInfo::extract_config(block_ds.block_state, block::ConfigInfo::needCapabilities | block::ConfigInfo::needLibraries));
+      mc_block_.get_method_context_ = GetMethodContext{info.gen_utime, info.end_lt, extra.rand_seed};
     }
 
     result->blocks_.push_back(schema_block);
@@ -533,10 +536,45 @@ td::Result<schema::TransactionDescr> ParseQuery::process_transaction_descr(vm::C
   }
 }
 
+// Adjacent runs are merged pairwise over indices, so every transaction is moved once.
+std::vector<schema::Transaction> merge_account_runs(std::vector<schema::Transaction> txs, const std::vector<size_t>& run_ends) {
+  std::vector<size_t> order(txs.size());
+  std::iota(order.begin(), order.end(), 0);
+  auto tx_less = [&txs](size_t lhs, size_t rhs) {
+    return schema::TransactionLtOrder{}(txs[lhs], txs[rhs]);
+  };
+
+  std::vector<size_t> bounds{0};
+  for (auto run_end : run_ends) {
+    if (run_end > bounds.back()) {
+      bounds.push_back(run_end);
+    }
+  }
+  while (bounds.size() > 2) {
+    std::vector<size_t> merged{0};
+    for (size_t i = 2; i < bounds.size(); i += 2) {
+      std::inplace_merge(order.begin() + bounds[i - 2], order.begin() + bounds[i - 1], order.begin() + bounds[i], tx_less);
+      merged.push_back(bounds[i]);
+    }
+    if (bounds.size() % 2 == 0) {
+      merged.push_back(bounds.back());
+    }
+    bounds = std::move(merged);
+  }
+
+  std::vector<schema::Transaction> res;
+  res.reserve(txs.size());
+  for (auto index : order) {
+    res.push_back(std::move(txs[index]));
+  }
+  return res;
+}
+
 td::Result<std::vector<schema::Transaction>> ParseQuery::parse_transactions(const ton::BlockIdExt& blk_id, const block::gen::Block::Record &block, 
                               const block::gen::BlockInfo::Record &info, const block::gen::BlockExtra::Record &extra,
                               std::map<td::Bits256, AccountStateShort> &account_states) {
   std::vector<schema::Transaction> res;
+  std::vector<size_t> run_ends;
   try {
     vm::AugmentedDictionary acc_dict{vm::load_cell_slice_ref(extra.account_blocks), 256, block::tlb::aug_ShardAccountBlocks};
 
@@ -621,11 +659,12 @@ td::Result<std::vector<schema::Transaction>> ParseQuery::parse_transactions(cons
         
         account_states[cur_addr] = {schema_tx.account_state_hash_after, schema_tx.lt, schema_tx.hash};
       }
+      run_ends.push_back(res.size());
     }
   } catch (vm::VmError err) {
       return td::Status::Error(PSLICE() << "error while parsing AccountBlocks : " << err.get_msg());
   }
-  return res;
+  return merge_account_runs(std::move(res), run_ends);
 }
 
 td::Result<std::vector<schema::AccountState>> ParseQuery::parse_account_states_new(ton::WorkchainId workchain_id, uint32_t gen_utime, std::map<td::Bits256, AccountStateShort> &account_states) {
@@ -2,6 +2,10 @@
 #include "IndexData.h"
 
 
+// Merges consecutive runs of transactions (one run per account, each sorted by lt) into TransactionLtOrder.
+// run_ends are the end offsets of the runs.
+std::vector<schema::Transaction> merge_account_runs(std::vector<schema::Transaction> txs, const std::vector<size_t>& run_ends);
+
 class ParseQuery: public td::actor::Actor {
 private:
   const int mc_seqno_;
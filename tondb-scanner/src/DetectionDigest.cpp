@@ -0,0 +1,154 @@
+#include <fstream>
+#include <algorithm>
+#include "DetectionDigest.h"
+
+
+namespace {
+// canonical encoding of detected fields, every value is prefixed so optional and variable length values can't collide
+class DigestWriter {
+public:
+  void write(bool value) { buf_.push_back(value ? '\x01' : '\x00'); }
+  void write(std::uint64_t value) { 
+    for (int i = 0; i < 8; ++i) {
+      buf_.push_back(static_cast<char>(value >> (i * 8)));
+    }
+  }
+  void write(std::uint32_t value) { write(static_cast<std::uint64_t>(value)); }
+  void write(const std::string& value) {
+    write(static_cast<std::uint64_t>(value.size()));
+    buf_ += value;
+  }
+  void write(const td::Bits256& value) { buf_.append(value.as_slice().begin(), value.as_slice().size()); }
+  void write(const block::StdAddress& value) {
+    write(static_cast<std::uint32_t>(value.workchain));
+    write(value.addr);
+  }
+  void write(const td::RefInt256& value) { write(value.not_null() ? value->to_dec_string() : std::string{}); }
+  void write(const std::map<std::string, std::string>& value) {
+    write(static_cast<std::uint64_t>(value.size()));
+    for (const auto& [k, v] : value) {
+      write(k);
+      write(v);
+    }
+  }
+  template <typename T>
+  void write(const std::optional<T>& value) {
+    write(value.has_value());
+    if (value) {
+      write(value.value());
+    }
+  }
+
+  void write(const JettonWalletDataV2& v) {
+    write(v.balance); write(v.address); write(v.owner); write(v.jetton); write(v.mintless_is_claimed);
+    write(v.last_transaction_lt); write(v.last_transaction_now); write(v.code_hash); write(v.data_hash);
+  }
+  void write(const JettonMasterDataV2& v) {
+    write(v.address); write(v.total_supply); write(v.mintable); write(v.admin_address); write(v.jetton_content);
+    write(v.jetton_wallet_code_hash); write(v.data_hash); write(v.code_hash); write(v.last_transaction_lt); write(v.last_transaction_now);
+  }
+  void write(const NFTCollectionDataV2& v) {
+    write(v.address); write(v.next_item_index); write(v.owner_address); write(v.collection_content);
+    write(v.last_transaction_lt); write(v.last_transaction_now); write(v.data_hash); write(v.code_hash);
+  }
+  void write(const NFTItemDataV2::DNSEntry& v) {
+    write(v.domain); write(v.wallet); write(v.next_resolver); write(v.site_adnl); write(v.storage_bag_id);
+  }
+  void write(const NFTItemDataV2& v) {
+    write(v.address); write(v.init); write(v.index); write(v.collection_address); write(v.owner_address); write(v.content);
+    write(v.last_transaction_lt); write(v.last_transaction_now); write(v.code_hash); write(v.data_hash); write(v.dns_entry);
+  }
+  void write(const GetGemsNftFixPriceSaleData& v) {
+    write(v.address); write(v.is_complete); write(v.created_at); write(v.marketplace_address); write(v.nft_address);
+    write(v.nft_owner_address); write(v.full_price); write(v.marketplace_fee_address); write(v.marketplace_fee);
+    write(v.royalty_address); write(v.royalty_amount); write(v.last_transaction_lt); write(v.last_transaction_now);
+    write(v.code_hash); write(v.data_hash);
+  }
+  void write(const GetGemsNftAuctionData& v) {
+    write(v.address); write(v.end); write(v.end_time); write(v.mp_addr); write(v.nft_addr); write(v.nft_owner);
+    write(v.last_bid); write(v.last_member); write(v.min_step); write(v.mp_fee_addr); write(v.mp_fee_factor); write(v.mp_fee_base);
+    write(v.royalty_fee_addr); write(v.royalty_fee_factor); write(v.royalty_fee_base); write(v.max_bid); write(v.min_bid);
+    write(v.created_at); write(v.last_bid_at); write(v.is_canceled); write(v.last_transaction_lt); write(v.last_transaction_now);
+    write(v.code_hash); write(v.data_hash);
+  }
+
+  const std::string& data() const { return buf_; }
+private:
+  std::string buf_;
+};
+}
+
+td::Bits256 detection_digest(const std::unordered_map<block::StdAddress, std::vector<BlockchainInterfaceV2>, AddressHasher>& account_interfaces) {
+  std::vector<const std::pair<const block::StdAddress, std::vector<BlockchainInterfaceV2>>*> sorted;
+  sorted.reserve(account_interfaces.size());
+  for (const auto& entry : account_interfaces) {
+    sorted.push_back(&entry);
+  }
+  std::sort(sorted.begin(), sorted.end(), [](const auto* lhs, const auto* rhs) {
+    return std::make_pair(lhs->first.workchain, lhs->first.addr) < std::make_pair(rhs->first.workchain, rhs->first.addr);
+  });
+
+  DigestWriter writer;
+  for (const auto* entry : sorted) {
+    writer.write(entry->first);
+    writer.write(static_cast<std::uint64_t>(entry->second.size()));
+    for (const auto& interface : entry->second) {
+      writer.write(static_cast<std::uint32_t>(interface.index()));
+      std::visit([&](const auto& value) { writer.write(value); }, interface);
+    }
+  }
+
+  return td::sha256_bits256(writer.data());
+}
+
+td::Status DetectionDigestLog::open(std::string path, bool replay) {
+  path_ = std::move(path);
+  replay_ = replay;
+  if (!replay_) {
+    out_ = std::make_unique<std::ofstream>(path_, std::ios::app);
+    if (!out_->is_open()) {
+      return td::Status::Error("Failed to open detection digests file " + path_);
+    }
+    return td::Status::OK();
+  }
+
+  std::ifstream in(path_);
+  if (!in.is_open()) {
+    return td::Status::Error("Failed to open detection digests file " + path_);
+  }
+  ton::BlockSeqno seqno;
+  std::string hex;
+  while (in >> seqno >> hex) {
+    td::Bits256 digest;
+    if (digest.from_hex(hex) != 256) {
+      return td::Status::Error(PSLICE() << "Bad detection digest for seqno " << seqno << " in " << path_);
+    }
+    recorded_[seqno] = digest;
+  }
+  LOG(INFO) << "Loaded " << recorded_.size() << " detection digests from " << path_;
+  return td::Status::OK();
+}
+
+void DetectionDigestLog::add(ton::BlockSeqno mc_seqno, const td::Bits256& digest) {
+  if (!replay_) {
+    *out_ << mc_seqno << " " << digest.to_hex() << "\n";
+    out_->flush();
+    return;
+  }
+  auto it = recorded_.find(mc_seqno);
+  if (it == recorded_.end()) {
+    ++missing_;
+  } else if (it->second == digest) {
+    ++matched_;
+  } else {
+    ++mismatched_;
+    LOG(ERROR) << "Detection digest mismatch for seqno " << mc_seqno << ": recorded " << it->second.to_hex() << ", got " << digest.to_hex();
+  }
+}
+
+std::string DetectionDigestLog::stats() const {
+  if (!replay_) {
+    return "";
+  }
+  return PSTRING() << "Detection replay: " << matched_ << " matched, " << mismatched_ << " mismatched, " << missing_ << " not recorded";
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <fstream>
+#include "IndexData.h"
+
+
+// Hash of everything detected for a mc block, independent of map order
+td::Bits256 detection_digest(const std::unordered_map<block::StdAddress, std::vector<BlockchainInterfaceV2>, AddressHasher>& account_interfaces);
+
+// Per mc seqno detection digests. In record mode digests are appended to the file, in replay mode
+// every processed seqno is compared with the recorded one to prove a reindex gives identical output.
+class DetectionDigestLog {
+public:
+  td::Status open(std::string path, bool replay);
+  void add(ton::BlockSeqno mc_seqno, const td::Bits256& digest);
+
+  bool enabled() const { return !path_.empty(); }
+  std::string stats() const;
+private:
+  std::string path_;
+  bool replay_{false};
+  std::map<ton::BlockSeqno, td::Bits256> recorded_;
+  std::unique_ptr<std::ofstream> out_;
+
+  size_t matched_{0};
+  size_t mismatched_{0};
+  size_t missing_{0};
+};
@@ -228,6 +228,21 @@ struct Transaction {
   TransactionDescr description;
 };
 
+// (lt, workchain, account address) order of Block::transactions, the order TraceAssembler consumes them in.
+// Same as the sort TraceAssembler used to do over the whole mc block. Transactions of one account are not
+// adjacent, consumers (inserters, TraceAssembler, event processors) must not rely on grouping by account.
+struct TransactionLtOrder {
+  bool operator()(const Transaction& lhs, const Transaction& rhs) const {
+    if (lhs.lt != rhs.lt) {
+      return lhs.lt < rhs.lt;
+    }
+    if (lhs.account.workchain != rhs.account.workchain) {
+      return lhs.account.workchain < rhs.account.workchain;
+    }
+    return lhs.account.addr < rhs.account.addr;
+  }
+};
+
 struct BlockReference {
   int32_t workchain;
   int64_t shard;
@@ -267,7 +282,7 @@ struct Block {
   std::string rand_seed;
   std::string created_by;
 
-  std::vector<Transaction> transactions;
+  std::vector<Transaction> transactions;  // sorted by TransactionLtOrder, not grouped by account
   std::vector<BlockReference> prev_blocks;
 };
 
@@ -573,6 +588,7 @@ struct MasterchainBlockDataState {
   std::vector<BlockDataState> shard_blocks_diff_;  // blocks corresponding to mc_block.
 
   std::shared_ptr<block::ConfigInfo> config_;
+  GetMethodContext get_method_context_;
 };
 
 using BlockchainEvent = std::variant<JettonTransfer, 
@@ -621,6 +637,44 @@ struct ParsedBlock {
   std::vector<BlockchainInterface> interfaces_; // deprecated in favour of account_interfaces_
 
   std::unordered_map<block::StdAddress, std::vector<BlockchainInterfaceV2>, AddressHasher> account_interfaces_;
+
+  // Rough memory footprint. A message body or init state is counted as its boc string plus the cell tree
+  // it was serialized from (about twice the boc), code and data of accounts as a few loaded cells each.
+  // mc_block_ is not counted: it is dropped after interfaces detection, before the block is queued to insert.
+  std::int64_t estimated_bytes() const {
+    constexpr std::int64_t cell_bytes = 256;
+    auto message_bytes = [](const schema::Message& msg) -> std::int64_t {
+      std::int64_t bytes = sizeof(schema::Message) + 3 * static_cast<std::int64_t>(msg.body_boc.size());
+      if (msg.init_state_boc) {
+        bytes += 3 * static_cast<std::int64_t>(msg.init_state_boc->size());
+      }
+      return bytes;
+    };
+
+    std::int64_t bytes = sizeof(ParsedBlock);
+    for (const auto& blk : blocks_) {
+      bytes += sizeof(schema::Block) + sizeof(schema::BlockReference) * blk.prev_blocks.size();
+      for (const auto& tx : blk.transactions) {
+        bytes += sizeof(schema::Transaction);
+        if (tx.in_msg) {
+          bytes += message_bytes(tx.in_msg.value());
+        }
+        for (const auto& msg : tx.out_msgs) {
+          bytes += message_bytes(msg);
+        }
+      }
+    }
+    bytes += (sizeof(schema::AccountState) + 2 * cell_bytes) * account_states_.size();
+    bytes += sizeof(schema::MasterchainBlockShard) * shard_state_.size();
+    for (const auto& trace : traces_) {
+      bytes += sizeof(schema::Trace) + sizeof(schema::TraceEdge) * trace.edges.size();
+    }
+    bytes += sizeof(BlockchainEvent) * events_.size();
+    for (const auto& [_, interfaces] : account_interfaces_) {
+      bytes += sizeof(block::StdAddress) + sizeof(BlockchainInterfaceV2) * interfaces.size();
+    }
+    return bytes;
+  }
   
   template <class T>
   std::vector<T> get_events() {
@@ -11,6 +11,7 @@ enum ErrorCode {
   GET_METHOD_WRONG_RESULT = 503,
   ADDITIONAL_CHECKS_FAILED = 504,
   EVENT_PARSING_ERROR = 505,
+  INTERFACE_NOT_IMPLEMENTED = 506,
 
   CODE_HASH_NOT_FOUND = 600,
   ENTITY_NOT_FOUND = 601
@@ -23,6 +24,19 @@ public:
   virtual void get_insert_queue_state(td::Promise<QueueState> promise) = 0;
   virtual void get_existing_seqnos(td::Promise<std::vector<std::uint32_t>> promise, std::int32_t from_seqno = 0, std::int32_t to_seqno = 0) = 0;
 
+  // Durable "all mc seqnos of the range from_seqno..to_seqno are committed up to" mark, lets startup skip
+  // get_existing_seqnos. Kept per range, workers indexing different ranges into one storage don't share it.
+  // Not every storage keeps it.
+  virtual void get_commit_watermark(td::Promise<std::uint32_t> promise, std::int32_t from_seqno = 0, std::int32_t to_seqno = 0) {
+    promise.set_error(td::Status::Error("commit watermark is not supported"));
+  }
+  // everything of the range up to seqno is already committed, the watermark of the range advances from it
+  virtual void init_commit_watermark(std::uint32_t seqno, std::int32_t from_seqno = 0, std::int32_t to_seqno = 0) {}
+  // resolves once everything queued so far is committed, including the watermark. Used on shutdown.
+  virtual void drain(td::Promise<td::Unit> promise) {
+    promise.set_value(td::Unit());
+  }
+
   // // helper template functions
   // template <class T>
   // void upsert_entity(T entity, td::Promise<td::Unit> promise);
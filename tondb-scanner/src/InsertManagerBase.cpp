@@ -1,18 +1,25 @@
+#include <algorithm>
 #include "td/utils/StringBuilder.h"
+#include "td/utils/Time.h"
 #include "InsertManagerBase.h"
 
 
-QueueState InsertTaskStruct::get_queue_state() {
-    QueueState status = {1, static_cast<std::int32_t>(parsed_block_->blocks_.size()), 0, 0, static_cast<std::int32_t>(parsed_block_->traces_.size())};
-    for(const auto& blk : parsed_block_->blocks_) {
+QueueState get_block_queue_state(const ParsedBlock& block) {
+    QueueState status = {1, static_cast<std::int32_t>(block.blocks_.size()), 0, 0, static_cast<std::int32_t>(block.traces_.size())};
+    for(const auto& blk : block.blocks_) {
         status.txs_ += blk.transactions.size();
         for(const auto& tx : blk.transactions) {
             status.msgs_ += tx.out_msgs.size() + (tx.in_msg ? 1 : 0);
         }
     }
+    status.bytes_ = block.estimated_bytes();
     return status;
 }
 
+QueueState InsertTaskStruct::get_queue_state() {
+    return get_block_queue_state(*parsed_block_);
+}
+
 
 void InsertManagerBase::start_up() {
     LOG(INFO) << "InsertManagerBase::start_up called";
@@ -22,6 +29,10 @@ void InsertManagerBase::start_up() {
 void InsertManagerBase::alarm() {
     alarm_timestamp() = td::Timestamp::in(1.0);
     td::actor::send_closure(actor_id(this), &InsertManagerBase::schedule_next_insert_batches, false);
+    td::actor::send_closure(actor_id(this), &InsertManagerBase::flush_commit_watermark);
+    if (draining_) {
+        td::actor::send_closure(actor_id(this), &InsertManagerBase::check_drained);
+    }
 }
 
 void InsertManagerBase::print_info() {
@@ -30,16 +41,31 @@ void InsertManagerBase::print_info() {
             << ", max_batch_blocks=" << batch_size_.blocks_
             << ", max_batch_txs=" << batch_size_.txs_
             << ", max_batch_msgs=" << batch_size_.msgs_
+            << ", max_queue_bytes=" << max_queue_bytes_
             << ")";
+  if (adaptive_batch_) {
+    LOG(INFO) << "Adaptive batch size(target_latency=" << target_batch_latency_ << "s, min_scale=" << min_batch_scale_ << ")";
+  }
+}
+
+void InsertManagerBase::set_adaptive_batch(double target_latency, double min_scale) {
+    adaptive_batch_ = true;
+    target_batch_latency_ = target_latency;
+    min_batch_scale_ = std::clamp(min_scale, 0.001, 1.0);
+    batch_scale_ = 1.0;
 }
 
 
 void InsertManagerBase::insert(std::uint32_t mc_seqno, ParsedBlockPtr block_ds, td::Promise<QueueState> queued_promise, td::Promise<td::Unit> inserted_promise) {
     auto task = InsertTaskStruct{mc_seqno, std::move(block_ds), std::move(inserted_promise)};
     auto status_delta = task.get_queue_state();
+    task.queue_state_ = status_delta;
     insert_queue_.push(std::move(task));
     queue_state_ += status_delta;
     queued_promise.set_result(queue_state_);
+    if (is_over_memory_budget()) {
+        schedule_next_insert_batches(true);
+    }
 }
 
 
@@ -50,13 +76,53 @@ void InsertManagerBase::get_insert_queue_state(td::Promise<QueueState> promise)
 
 bool InsertManagerBase::check_batch_size(QueueState &batch_state)
 {
-    return batch_state < batch_size_;
+    return batch_state < current_batch_size();
+}
+
+QueueState InsertManagerBase::current_batch_size() const
+{
+    if (!adaptive_batch_) {
+        return batch_size_;
+    }
+    auto scaled = [&](std::int32_t value) {
+        return std::max<std::int32_t>(1, static_cast<std::int32_t>(value * batch_scale_));
+    };
+    return QueueState{scaled(batch_size_.mc_blocks_), scaled(batch_size_.blocks_), scaled(batch_size_.txs_), 
+                      scaled(batch_size_.msgs_), batch_size_.traces_, batch_size_.bytes_};
+}
+
+// AIMD: halve batches when a commit is slower than the target, grow them while a backlog of
+// full batches is waiting (catch-up), slowly shrink them near the tip where the queue is short.
+void InsertManagerBase::adjust_batch_scale(double latency)
+{
+    if (!adaptive_batch_) {
+        return;
+    }
+    constexpr double step = 0.05;
+    auto prev_scale = batch_scale_;
+    if (latency > target_batch_latency_) {
+        batch_scale_ /= 2;
+    } else if (!check_batch_size(queue_state_)) {
+        batch_scale_ += step;
+    } else {
+        batch_scale_ -= step / 4;
+    }
+    batch_scale_ = std::clamp(batch_scale_, min_batch_scale_, 1.0);
+    if (batch_scale_ != prev_scale) {
+        LOG(DEBUG) << "Batch scale " << prev_scale << " -> " << batch_scale_ << " (latency " << latency << "s)";
+    }
+}
+
+bool InsertManagerBase::is_over_memory_budget() const
+{
+    return max_queue_bytes_ > 0 && queue_state_.bytes_ > max_queue_bytes_;
 }
 
 void InsertManagerBase::schedule_next_insert_batches(bool full_batch = false)
 {
     while(!insert_queue_.empty() && (parallel_insert_actors_ < max_parallel_insert_actors_)) {
-        if (check_batch_size(queue_state_) && full_batch)
+        // over the memory budget partial batches are flushed right away instead of waiting for the alarm
+        if (check_batch_size(queue_state_) && full_batch && !is_over_memory_budget())
             break;
 
         std::vector<InsertTaskStruct> batch;
@@ -65,16 +131,24 @@ void InsertManagerBase::schedule_next_insert_batches(bool full_batch = false)
             auto task = std::move(insert_queue_.front());
             insert_queue_.pop();
 
-            QueueState loc_state = task.get_queue_state();
+            QueueState loc_state = task.queue_state_;
             batch_state += loc_state;
             queue_state_ -= loc_state;
             batch.push_back(std::move(task));
         }
-        auto P = td::PromiseCreator::lambda([SelfId = actor_id(this)](td::Result<td::Unit> R){
+        std::vector<std::uint32_t> batch_seqnos;
+        for (const auto& task : batch) {
+            batch_seqnos.push_back(task.mc_seqno_);
+        }
+        auto batch_watermark = batch_commit_watermark(batch_seqnos);
+        auto P = td::PromiseCreator::lambda([SelfId = actor_id(this), started_at = td::Time::now(), batch_seqnos = std::move(batch_seqnos), 
+                                             batch_watermark](td::Result<td::Unit> R) mutable {
             if(R.is_error()) {
                 LOG(ERROR) << "Failed to insert batch: " << R.move_as_error();
+            } else {
+                td::actor::send_closure(SelfId, &InsertManagerBase::batch_committed, std::move(batch_seqnos), batch_watermark);
             }
-            td::actor::send_closure(SelfId, &InsertManagerBase::insert_batch_finished);
+            td::actor::send_closure(SelfId, &InsertManagerBase::insert_batch_finished, td::Time::now() - started_at);
         });
         
         ++parallel_insert_actors_;
@@ -82,12 +156,114 @@ void InsertManagerBase::schedule_next_insert_batches(bool full_batch = false)
                   << ", b=" << batch_state.blocks_ 
                   << ", txs=" << batch_state.txs_
                   << ", msgs=" << batch_state.msgs_ 
-                  << ", traces=" << batch_state.traces_ << "]";
-        create_insert_actor(std::move(batch), std::move(P));
+                  << ", traces=" << batch_state.traces_
+                  << ", bytes=" << batch_state.bytes_ << "]";
+        create_insert_actor(std::move(batch), batch_watermark, std::move(P));
     }
 }
 
-void InsertManagerBase::insert_batch_finished() {
+void InsertManagerBase::insert_batch_finished(double latency) {
     --parallel_insert_actors_;
-    td::actor::send_closure(actor_id(this), &InsertManagerBase::schedule_next_insert_batches, true);
+    adjust_batch_scale(latency);
+    td::actor::send_closure(actor_id(this), &InsertManagerBase::schedule_next_insert_batches, !draining_);
+    if (draining_) {
+        td::actor::send_closure(actor_id(this), &InsertManagerBase::check_drained);
+    }
+}
+
+void InsertManagerBase::init_commit_watermark(std::uint32_t seqno, std::int32_t from_seqno, std::int32_t to_seqno) {
+    track_commit_watermark_ = true;
+    watermark_from_seqno_ = from_seqno;
+    watermark_to_seqno_ = to_seqno;
+    commit_watermark_ = seqno;
+    written_commit_watermark_ = seqno;
+    committed_seqnos_.clear();
+}
+
+// watermark the batch transaction may write: committing it together with everything committed
+// before makes all seqnos up to it present, whatever other batches in flight do
+std::optional<std::uint32_t> InsertManagerBase::batch_commit_watermark(const std::vector<std::uint32_t>& batch_seqnos) const {
+    if (!track_commit_watermark_) {
+        return std::nullopt;
+    }
+    std::set<std::uint32_t> batch_set(batch_seqnos.begin(), batch_seqnos.end());
+    auto watermark = commit_watermark_;
+    while (committed_seqnos_.count(watermark + 1) || batch_set.count(watermark + 1)) {
+        ++watermark;
+    }
+    if (watermark <= written_commit_watermark_) {
+        return std::nullopt;
+    }
+    return watermark;
+}
+
+void InsertManagerBase::batch_committed(std::vector<std::uint32_t> batch_seqnos, std::optional<std::uint32_t> batch_watermark) {
+    if (!track_commit_watermark_) {
+        return;
+    }
+    for (auto seqno : batch_seqnos) {
+        if (seqno > commit_watermark_) {
+            committed_seqnos_.insert(seqno);
+        }
+    }
+    while (!committed_seqnos_.empty() && *committed_seqnos_.begin() == commit_watermark_ + 1) {
+        committed_seqnos_.erase(committed_seqnos_.begin());
+        ++commit_watermark_;
+    }
+    if (batch_watermark && batch_watermark.value() > written_commit_watermark_) {
+        written_commit_watermark_ = batch_watermark.value();
+    }
+}
+
+// batches that closed a gap don't write the part of the watermark committed by others,
+// when nothing is queued it is written by a batch without tasks
+void InsertManagerBase::flush_commit_watermark() {
+    if (!track_commit_watermark_ || flushing_commit_watermark_ || commit_watermark_ <= written_commit_watermark_ 
+        || !insert_queue_.empty() || parallel_insert_actors_ > 0) {
+        return;
+    }
+    auto watermark = commit_watermark_;
+    auto P = td::PromiseCreator::lambda([SelfId = actor_id(this), watermark](td::Result<td::Unit> R) {
+        if (R.is_error()) {
+            LOG(ERROR) << "Failed to write commit watermark " << watermark << ": " << R.move_as_error();
+        }
+        td::actor::send_closure(SelfId, &InsertManagerBase::commit_watermark_flushed, R.is_ok() ? std::optional<std::uint32_t>(watermark) : std::nullopt);
+    });
+    flushing_commit_watermark_ = true;
+    create_insert_actor({}, watermark, std::move(P));
+}
+
+void InsertManagerBase::commit_watermark_flushed(std::optional<std::uint32_t> watermark) {
+    flushing_commit_watermark_ = false;
+    if (watermark) {
+        batch_committed({}, watermark);
+    }
+    if (draining_) {
+        check_drained();
+    }
+}
+
+void InsertManagerBase::drain(td::Promise<td::Unit> promise) {
+    LOG(INFO) << "Draining insert queue: " << insert_queue_.size() << " tasks queued, " << parallel_insert_actors_ << " batches in flight";
+    draining_ = true;
+    drain_promises_.push_back(std::move(promise));
+    schedule_next_insert_batches(false);
+    flush_commit_watermark();
+    check_drained();
+}
+
+// the watermark left unwritten by the last batches is flushed by the alarm, which also retries a failed flush
+void InsertManagerBase::check_drained() {
+    if (!draining_ || !insert_queue_.empty() || parallel_insert_actors_ > 0 || flushing_commit_watermark_) {
+        return;
+    }
+    if (track_commit_watermark_ && commit_watermark_ > written_commit_watermark_) {
+        return;
+    }
+    LOG(INFO) << "Insert queue drained, commit watermark " << written_commit_watermark_;
+    draining_ = false;
+    for (auto& promise : drain_promises_) {
+        promise.set_value(td::Unit());
+    }
+    drain_promises_.clear();
 }
@@ -1,13 +1,18 @@
 #pragma once
 #include <string>
 #include <queue>
+#include <set>
 #include "InsertManager.h"
 
 
+// what a parsed block adds to an insert queue
+QueueState get_block_queue_state(const ParsedBlock& block);
+
 struct InsertTaskStruct{
     std::uint32_t mc_seqno_;
     ParsedBlockPtr parsed_block_;
     td::Promise<td::Unit> promise_;
+    QueueState queue_state_{};  // computed once when queued
 
     QueueState get_queue_state();
 };
@@ -19,6 +24,9 @@ public:
     void set_insert_blocks(int value) { batch_size_.blocks_ = value; }
     void set_insert_txs(int value) { batch_size_.txs_ = value; }
     void set_insert_msgs(int value) { batch_size_.msgs_ = value; }
+    void set_max_queue_bytes(std::int64_t value) { max_queue_bytes_ = value; }
+    // batch limits are scaled between min_scale and 1 to keep commit latency around target_latency
+    void set_adaptive_batch(double target_latency, double min_scale);
     
     void print_info();
 
@@ -27,7 +35,23 @@ public:
     void insert(std::uint32_t mc_seqno, ParsedBlockPtr block_ds, td::Promise<QueueState> queued_promise, td::Promise<td::Unit> inserted_promise) override;
     void get_insert_queue_state(td::Promise<QueueState> promise) override;
 
+    void init_commit_watermark(std::uint32_t seqno, std::int32_t from_seqno = 0, std::int32_t to_seqno = 0) override;
+    void drain(td::Promise<td::Unit> promise) override;
+
     virtual void create_insert_actor(std::vector<InsertTaskStruct> insert_tasks, td::Promise<td::Unit> promise) = 0;
+    // commit_watermark is set when committing the batch makes the watermark advance, storages keeping it
+    // write it in the batch transaction. Batch without tasks only updates the watermark.
+    virtual void create_insert_actor(std::vector<InsertTaskStruct> insert_tasks, std::optional<std::uint32_t> commit_watermark, td::Promise<td::Unit> promise) {
+        if (insert_tasks.empty()) {
+            promise.set_value(td::Unit());
+            return;
+        }
+        create_insert_actor(std::move(insert_tasks), std::move(promise));
+    }
+protected:
+    // range the written watermark belongs to
+    std::int32_t watermark_from_seqno_{0};
+    std::int32_t watermark_to_seqno_{0};
 private:
     std::queue<InsertTaskStruct> insert_queue_;
     QueueState queue_state_{0, 0, 0, 0};
@@ -36,8 +60,33 @@ private:
     td::int32 parallel_insert_actors_{0};
 
     QueueState batch_size_{10000, 10000, 100000, 100000};
+    std::int64_t max_queue_bytes_{0};
+
+    bool adaptive_batch_{false};
+    double target_batch_latency_{0};
+    double min_batch_scale_{1.0};
+    double batch_scale_{1.0};
+
+    // batches commit out of order, seqnos above the watermark wait in committed_seqnos_ for the gap to close
+    bool track_commit_watermark_{false};
+    std::uint32_t commit_watermark_{0};
+    std::uint32_t written_commit_watermark_{0};
+    bool flushing_commit_watermark_{false};
+    std::set<std::uint32_t> committed_seqnos_;
+
+    // while draining partial batches are not held back and the watermark is flushed right away
+    bool draining_{false};
+    std::vector<td::Promise<td::Unit>> drain_promises_;
 
     bool check_batch_size(QueueState& batch_state);
+    bool is_over_memory_budget() const;
+    std::optional<std::uint32_t> batch_commit_watermark(const std::vector<std::uint32_t>& batch_seqnos) const;
+    void batch_committed(std::vector<std::uint32_t> batch_seqnos, std::optional<std::uint32_t> batch_watermark);
+    QueueState current_batch_size() const;
+    void adjust_batch_scale(double latency);
     void schedule_next_insert_batches(bool full_batch);
-    void insert_batch_finished();
+    void insert_batch_finished(double latency);
+    void flush_commit_watermark();
+    void commit_watermark_flushed(std::optional<std::uint32_t> watermark);
+    void check_drained();
 };
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+#include "InsertManagerComposite.h"
+
+
+namespace {
+
+// Gathers one result per sink. Sinks answer from their own threads, hence the mutex.
+template <class T>
+class SinkResults {
+public:
+  static std::shared_ptr<SinkResults> create(size_t count, td::Promise<std::vector<T>> promise) {
+    auto results = std::make_shared<SinkResults>();
+    results->results_.resize(count);
+    results->left_ = count;
+    results->promise_ = std::move(promise);
+    if (count == 0) {
+      results->promise_.set_value({});
+    }
+    return results;
+  }
+
+  static td::Promise<T> get_promise(std::shared_ptr<SinkResults> self, size_t index) {
+    return td::PromiseCreator::lambda([self = std::move(self), index](td::Result<T> R) {
+      self->set_result(index, std::move(R));
+    });
+  }
+
+private:
+  std::mutex mutex_;
+  std::vector<T> results_;
+  size_t left_{0};
+  td::Status error_;
+  td::Promise<std::vector<T>> promise_;
+
+  void set_result(size_t index, td::Result<T> R) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (R.is_error()) {
+      if (error_.is_ok()) {
+        error_ = R.move_as_error();
+      }
+    } else {
+      results_[index] = R.move_as_ok();
+    }
+    if (--left_ > 0) {
+      return;
+    }
+    if (error_.is_error()) {
+      promise_.set_error(std::move(error_));
+    } else {
+      promise_.set_value(std::move(results_));
+    }
+  }
+};
+
+QueueState max_queue_state(const std::vector<QueueState>& states) {
+  QueueState result;
+  for (const auto& state : states) {
+    result.mc_blocks_ = std::max(result.mc_blocks_, state.mc_blocks_);
+    result.blocks_ = std::max(result.blocks_, state.blocks_);
+    result.txs_ = std::max(result.txs_, state.txs_);
+    result.msgs_ = std::max(result.msgs_, state.msgs_);
+    result.traces_ = std::max(result.traces_, state.traces_);
+    result.bytes_ = std::max(result.bytes_, state.bytes_);
+  }
+  return result;
+}
+
+}  // namespace
+
+void InsertManagerComposite::insert(std::uint32_t mc_seqno, ParsedBlockPtr block_ds, td::Promise<QueueState> queued_promise, td::Promise<td::Unit> inserted_promise) {
+  auto queued = SinkResults<QueueState>::create(sinks_.size(), td::PromiseCreator::lambda(
+    [queued_promise = std::move(queued_promise)](td::Result<std::vector<QueueState>> R) mutable {
+      if (R.is_error()) {
+        queued_promise.set_error(R.move_as_error());
+        return;
+      }
+      queued_promise.set_value(max_queue_state(R.ok()));
+  }));
+  auto inserted = SinkResults<td::Unit>::create(sinks_.size(), td::PromiseCreator::lambda(
+    [inserted_promise = std::move(inserted_promise)](td::Result<std::vector<td::Unit>> R) mutable {
+      if (R.is_error()) {
+        inserted_promise.set_error(R.move_as_error());
+        return;
+      }
+      inserted_promise.set_value(td::Unit());
+  }));
+  // sinks only read the block, so they share it
+  for (size_t i = 0; i < sinks_.size(); ++i) {
+    td::actor::send_closure(sinks_[i], &InsertManagerInterface::insert, mc_seqno, block_ds,
+                            SinkResults<QueueState>::get_promise(queued, i), SinkResults<td::Unit>::get_promise(inserted, i));
+  }
+}
+
+void InsertManagerComposite::get_insert_queue_state(td::Promise<QueueState> promise) {
+  auto states = SinkResults<QueueState>::create(sinks_.size(), td::PromiseCreator::lambda(
+    [promise = std::move(promise)](td::Result<std::vector<QueueState>> R) mutable {
+      if (R.is_error()) {
+        promise.set_error(R.move_as_error());
+        return;
+      }
+      promise.set_value(max_queue_state(R.ok()));
+  }));
+  for (size_t i = 0; i < sinks_.size(); ++i) {
+    td::actor::send_closure(sinks_[i], &InsertManagerInterface::get_insert_queue_state, SinkResults<QueueState>::get_promise(states, i));
+  }
+}
+
+void InsertManagerComposite::get_existing_seqnos(td::Promise<std::vector<std::uint32_t>> promise, std::int32_t from_seqno, std::int32_t to_seqno) {
+  auto existing = SinkResults<std::vector<std::uint32_t>>::create(sinks_.size(), td::PromiseCreator::lambda(
+    [promise = std::move(promise)](td::Result<std::vector<std::vector<std::uint32_t>>> R) mutable {
+      if (R.is_error()) {
+        promise.set_error(R.move_as_error());
+        return;
+      }
+      auto sink_seqnos = R.move_as_ok();
+      if (sink_seqnos.empty()) {
+        promise.set_value({});
+        return;
+      }
+      std::vector<std::uint32_t> result = std::move(sink_seqnos[0]);
+      std::sort(result.begin(), result.end());
+      for (size_t i = 1; i < sink_seqnos.size(); ++i) {
+        auto& seqnos = sink_seqnos[i];
+        std::sort(seqnos.begin(), seqnos.end());
+        std::vector<std::uint32_t> common;
+        std::set_intersection(result.begin(), result.end(), seqnos.begin(), seqnos.end(), std::back_inserter(common));
+        result = std::move(common);
+      }
+      promise.set_value(std::move(result));
+  }));
+  for (size_t i = 0; i < sinks_.size(); ++i) {
+    td::actor::send_closure(sinks_[i], &InsertManagerInterface::get_existing_seqnos,
+                            SinkResults<std::vector<std::uint32_t>>::get_promise(existing, i), from_seqno, to_seqno);
+  }
+}
+
+void InsertManagerComposite::get_commit_watermark(td::Promise<std::uint32_t> promise, std::int32_t from_seqno, std::int32_t to_seqno) {
+  // a sink without watermark fails the whole request, startup then falls back to existing seqnos
+  auto watermarks = SinkResults<std::uint32_t>::create(sinks_.size(), td::PromiseCreator::lambda(
+    [promise = std::move(promise)](td::Result<std::vector<std::uint32_t>> R) mutable {
+      if (R.is_error()) {
+        promise.set_error(R.move_as_error());
+        return;
+      }
+      auto values = R.move_as_ok();
+      if (values.empty()) {
+        promise.set_error(td::Status::Error("no insert sinks"));
+        return;
+      }
+      promise.set_value(*std::min_element(values.begin(), values.end()));
+  }));
+  for (size_t i = 0; i < sinks_.size(); ++i) {
+    td::actor::send_closure(sinks_[i], &InsertManagerInterface::get_commit_watermark, SinkResults<std::uint32_t>::get_promise(watermarks, i), 
+                            from_seqno, to_seqno);
+  }
+}
+
+void InsertManagerComposite::init_commit_watermark(std::uint32_t seqno, std::int32_t from_seqno, std::int32_t to_seqno) {
+  for (auto& sink : sinks_) {
+    td::actor::send_closure(sink, &InsertManagerInterface::init_commit_watermark, seqno, from_seqno, to_seqno);
+  }
+}
+
+void InsertManagerComposite::drain(td::Promise<td::Unit> promise) {
+  auto drained = SinkResults<td::Unit>::create(sinks_.size(), td::PromiseCreator::lambda(
+    [promise = std::move(promise)](td::Result<std::vector<td::Unit>> R) mutable {
+      if (R.is_error()) {
+        promise.set_error(R.move_as_error());
+        return;
+      }
+      promise.set_value(td::Unit());
+  }));
+  for (size_t i = 0; i < sinks_.size(); ++i) {
+    td::actor::send_closure(sinks_[i], &InsertManagerInterface::drain, SinkResults<td::Unit>::get_promise(drained, i));
+  }
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <vector>
+#include "InsertManager.h"
+
+
+// Fans every parsed block out to several insert managers, each keeping its own queue, batching and backpressure.
+// Queue state and commit watermark follow the slowest sink.
+class InsertManagerComposite: public InsertManagerInterface {
+public:
+  explicit InsertManagerComposite(std::vector<td::actor::ActorId<InsertManagerInterface>> sinks) : sinks_(std::move(sinks)) {}
+
+  void insert(std::uint32_t mc_seqno, ParsedBlockPtr block_ds, td::Promise<QueueState> queued_promise, td::Promise<td::Unit> inserted_promise) override;
+  void get_insert_queue_state(td::Promise<QueueState> promise) override;
+  // seqnos present in every sink
+  void get_existing_seqnos(td::Promise<std::vector<std::uint32_t>> promise, std::int32_t from_seqno = 0, std::int32_t to_seqno = 0) override;
+  void get_commit_watermark(td::Promise<std::uint32_t> promise, std::int32_t from_seqno = 0, std::int32_t to_seqno = 0) override;
+  void init_commit_watermark(std::uint32_t seqno, std::int32_t from_seqno = 0, std::int32_t to_seqno = 0) override;
+  void drain(td::Promise<td::Unit> promise) override;
+private:
+  std::vector<td::actor::ActorId<InsertManagerInterface>> sinks_;
+};
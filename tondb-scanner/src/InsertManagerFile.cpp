@@ -0,0 +1,767 @@
+#include <algorithm>
+#include <filesystem>
+#include <mutex>
+#include <sstream>
+#include "InsertManagerFile.h"
+#include "msgpack-utils.h"
+#include "convert-utils.h"
+#include "td/utils/base64.h"
+#include "td/utils/filesystem.h"
+#include "td/utils/port/path.h"
+
+namespace fs = std::filesystem;
+
+
+namespace {
+
+// One column of a .tcol file. Hashes are stored as a single binary blob of 32 bytes per row, addresses as
+// a per-file dictionary plus row indices, everything else as a msgpack array with nil for missing values.
+class ColumnBuilder {
+public:
+  enum class Type { Hash, Address, Number, Bool, String, Decimal };
+
+  ColumnBuilder(std::string name, Type type) : name_(std::move(name)), type_(type) {}
+
+  void add_null() {
+    if (type_ == Type::Hash) {
+      nulls_.push_back(rows_);
+      hashes_.append(32, '\0');
+    } else {
+      msgpack::pack(values_, msgpack::type::nil_t());
+    }
+    ++rows_;
+  }
+
+  void add(const td::Bits256& value) {
+    CHECK(type_ == Type::Hash);
+    hashes_.append(value.as_slice().str());
+    ++rows_;
+  }
+
+  void add(const std::string& value) {
+    if (type_ == Type::Address) {
+      auto it = dictionary_.find(value);
+      if (it == dictionary_.end()) {
+        it = dictionary_.emplace(value, static_cast<std::uint32_t>(dictionary_values_.size())).first;
+        dictionary_values_.push_back(value);
+      }
+      msgpack::pack(values_, it->second);
+    } else {
+      CHECK(type_ == Type::String);
+      msgpack::pack(values_, value);
+    }
+    ++rows_;
+  }
+
+  void add(const char* value) {
+    add(std::string(value));
+  }
+
+  void add(const block::StdAddress& value) {
+    add(convert::to_raw_address(value));
+  }
+
+  void add(const td::RefInt256& value) {
+    CHECK(type_ == Type::Decimal);
+    if (value.is_null()) {
+      add_null();
+      return;
+    }
+    msgpack::pack(values_, value->to_dec_string());
+    ++rows_;
+  }
+
+  template <class T>
+  std::enable_if_t<std::is_arithmetic_v<T>> add(T value) {
+    CHECK(type_ == Type::Number || type_ == Type::Bool);
+    msgpack::pack(values_, value);
+    ++rows_;
+  }
+
+  template <class T>
+  void add(const std::optional<T>& value) {
+    if (value) {
+      add(value.value());
+    } else {
+      add_null();
+    }
+  }
+
+  void write(std::stringstream& out) const {
+    msgpack::packer<std::stringstream> packer(out);
+    packer.pack_map(type_ == Type::Address ? 5 : 4);
+    packer.pack(std::string("name"));
+    packer.pack(name_);
+    packer.pack(std::string("type"));
+    packer.pack(type_name());
+    packer.pack(std::string("values"));
+    if (type_ == Type::Hash) {
+      packer.pack_bin(hashes_.size());
+      packer.pack_bin_body(hashes_.data(), hashes_.size());
+    } else {
+      packer.pack_array(rows_);
+      auto values = values_.str();
+      out.write(values.data(), values.size());
+    }
+    packer.pack(std::string("nulls"));
+    packer.pack(nulls_);
+    if (type_ == Type::Address) {
+      packer.pack(std::string("dictionary"));
+      packer.pack(dictionary_values_);
+    }
+  }
+
+private:
+  std::string name_;
+  Type type_;
+  std::uint32_t rows_{0};
+  std::stringstream values_;
+  std::string hashes_;
+  std::vector<std::uint32_t> nulls_;
+  std::unordered_map<std::string, std::uint32_t> dictionary_;
+  std::vector<std::string> dictionary_values_;
+
+  std::string type_name() const {
+    switch (type_) {
+      case Type::Hash: return "hash";
+      case Type::Address: return "address";
+      case Type::Number: return "number";
+      case Type::Bool: return "bool";
+      case Type::String: return "string";
+      case Type::Decimal: return "decimal";
+    }
+    UNREACHABLE();
+  }
+};
+
+class ColumnarTable {
+public:
+  using Type = ColumnBuilder::Type;
+
+  ColumnarTable(std::string name, std::initializer_list<std::pair<std::string, Type>> columns) : name_(std::move(name)) {
+    for (const auto& [column_name, type] : columns) {
+      columns_.emplace_back(column_name, type);
+    }
+  }
+
+  template <class... T>
+  void add_row(const T&... values) {
+    CHECK(sizeof...(T) == columns_.size());
+    size_t i = 0;
+    (columns_[i++].add(values), ...);
+    ++rows_;
+  }
+
+  td::Status write(const std::string& dir) const {
+    std::stringstream out;
+    msgpack::packer<std::stringstream> packer(out);
+    packer.pack_map(4);
+    packer.pack(std::string("format"));
+    packer.pack(std::string("tcol/1"));
+    packer.pack(std::string("table"));
+    packer.pack(name_);
+    packer.pack(std::string("rows"));
+    packer.pack(rows_);
+    packer.pack(std::string("columns"));
+    packer.pack_array(columns_.size());
+    for (const auto& column : columns_) {
+      column.write(out);
+    }
+    return td::write_file(dir + "/" + name_ + ".tcol", out.str());
+  }
+
+private:
+  std::string name_;
+  std::uint32_t rows_{0};
+  std::vector<ColumnBuilder> columns_;
+};
+
+std::optional<td::Bits256> hash_from_base64(const std::string& value) {
+  auto decoded = td::base64_decode(value);
+  if (decoded.is_error() || decoded.ok().size() != 32) {
+    return std::nullopt;
+  }
+  td::Bits256 result;
+  result.as_slice().copy_from(decoded.ok());
+  return result;
+}
+
+std::string stringify(schema::AccountStatus status) {
+  switch (status) {
+    case schema::AccountStatus::frozen: return "frozen";
+    case schema::AccountStatus::uninit: return "uninit";
+    case schema::AccountStatus::active: return "active";
+    case schema::AccountStatus::nonexist: return "nonexist";
+  }
+  UNREACHABLE();
+}
+
+std::string partition_name(std::uint32_t first_seqno, std::uint32_t last_seqno) {
+  return std::to_string(first_seqno) + "-" + std::to_string(last_seqno);
+}
+
+std::string staging_dir(const std::string& dir) {
+  return dir + "/.staging";
+}
+
+// one watermark per indexed range, workers of different ranges may share the directory
+std::string watermark_path(const std::string& dir, std::int32_t from_seqno, std::int32_t to_seqno) {
+  return dir + "/commit_watermark." + std::to_string(from_seqno) + "-" + std::to_string(to_seqno);
+}
+
+const char* const table_names[] = {"blocks", "transactions", "messages", "account_states", "traces", 
+                                   "jetton_transfers", "jetton_burns", "nft_transfers"};
+
+// batches finish out of order
+std::mutex commit_watermark_mutex;
+
+// the seqnos file is written last, directories without it are incomplete
+td::Result<std::vector<std::uint32_t>> read_seqnos(const std::string& dir) {
+  TRY_RESULT(buffer, td::read_file_str(dir + "/seqnos"));
+  std::vector<std::uint32_t> seqnos;
+  try {
+    msgpack::unpacked res;
+    msgpack::unpack(res, buffer.data(), buffer.size());
+    res.get().convert(seqnos);
+  } catch (const std::exception& e) {
+    return td::Status::Error(ErrorCode::DB_ERROR, PSLICE() << "Bad seqnos file in " << dir << ": " << e.what());
+  }
+  return seqnos;
+}
+
+const msgpack::object& get_field(const msgpack::object& map, td::Slice key) {
+  if (map.type != msgpack::type::MAP) {
+    throw msgpack::type_error();
+  }
+  for (std::uint32_t i = 0; i < map.via.map.size; ++i) {
+    const auto& kv = map.via.map.ptr[i];
+    if (kv.key.type == msgpack::type::STR && td::Slice(kv.key.via.str.ptr, kv.key.via.str.size) == key) {
+      return kv.val;
+    }
+  }
+  throw msgpack::type_error();
+}
+
+// Concatenates .tcol files of one table written by ColumnarTable, rows keep the order of the files.
+// Null rows of hash columns are shifted by the rows before them, address dictionaries are merged.
+td::Status merge_table(const std::vector<std::string>& chunk_dirs, const std::string& table, const std::string& out_dir) {
+  if (chunk_dirs.empty()) {
+    return td::Status::Error(ErrorCode::DB_ERROR, PSLICE() << "No chunks of " << table << " to merge");
+  }
+  std::vector<std::string> buffers;
+  buffers.reserve(chunk_dirs.size());
+  std::vector<msgpack::unpacked> files(chunk_dirs.size());
+  try {
+    for (size_t i = 0; i < chunk_dirs.size(); ++i) {
+      TRY_RESULT(buffer, td::read_file_str(chunk_dirs[i] + "/" + table + ".tcol"));
+      buffers.push_back(std::move(buffer));
+      msgpack::unpack(files[i], buffers.back().data(), buffers.back().size());
+    }
+
+    std::vector<std::uint32_t> row_offsets;
+    std::uint32_t rows = 0;
+    for (const auto& file : files) {
+      row_offsets.push_back(rows);
+      rows += get_field(file.get(), "rows").as<std::uint32_t>();
+    }
+    const auto& first_columns = get_field(files[0].get(), "columns");
+    for (const auto& file : files) {
+      if (get_field(file.get(), "columns").via.array.size != first_columns.via.array.size) {
+        return td::Status::Error(ErrorCode::DB_ERROR, PSLICE() << "Columns of " << table << " differ between chunks");
+      }
+    }
+
+    std::stringstream out;
+    msgpack::packer<std::stringstream> packer(out);
+    packer.pack_map(4);
+    packer.pack(std::string("format"));
+    packer.pack(std::string("tcol/1"));
+    packer.pack(std::string("table"));
+    packer.pack(table);
+    packer.pack(std::string("rows"));
+    packer.pack(rows);
+    packer.pack(std::string("columns"));
+    packer.pack_array(first_columns.via.array.size);
+    for (std::uint32_t c = 0; c < first_columns.via.array.size; ++c) {
+      auto column = [&](size_t file) -> const msgpack::object& {
+        return get_field(files[file].get(), "columns").via.array.ptr[c];
+      };
+      auto name = get_field(column(0), "name").as<std::string>();
+      auto type = get_field(column(0), "type").as<std::string>();
+      bool is_address = type == "address";
+      packer.pack_map(is_address ? 5 : 4);
+      packer.pack(std::string("name"));
+      packer.pack(name);
+      packer.pack(std::string("type"));
+      packer.pack(type);
+      packer.pack(std::string("values"));
+      std::vector<std::uint32_t> nulls;
+      std::unordered_map<std::string, std::uint32_t> dictionary;
+      std::vector<std::string> dictionary_values;
+      if (type == "hash") {
+        std::uint32_t size = 0;
+        for (size_t f = 0; f < files.size(); ++f) {
+          size += get_field(column(f), "values").via.bin.size;
+        }
+        packer.pack_bin(size);
+        for (size_t f = 0; f < files.size(); ++f) {
+          const auto& values = get_field(column(f), "values");
+          packer.pack_bin_body(values.via.bin.ptr, values.via.bin.size);
+        }
+      } else {
+        packer.pack_array(rows);
+        for (size_t f = 0; f < files.size(); ++f) {
+          std::vector<std::string> file_dictionary;
+          if (is_address) {
+            get_field(column(f), "dictionary").convert(file_dictionary);
+          }
+          const auto& values = get_field(column(f), "values");
+          for (std::uint32_t i = 0; i < values.via.array.size; ++i) {
+            const auto& value = values.via.array.ptr[i];
+            if (!is_address || value.type == msgpack::type::NIL) {
+              packer.pack(value);
+              continue;
+            }
+            const auto& address = file_dictionary.at(value.as<std::uint32_t>());
+            auto it = dictionary.find(address);
+            if (it == dictionary.end()) {
+              it = dictionary.emplace(address, static_cast<std::uint32_t>(dictionary_values.size())).first;
+              dictionary_values.push_back(address);
+            }
+            packer.pack(it->second);
+          }
+        }
+      }
+      for (size_t f = 0; f < files.size(); ++f) {
+        std::vector<std::uint32_t> file_nulls;
+        get_field(column(f), "nulls").convert(file_nulls);
+        for (auto row : file_nulls) {
+          nulls.push_back(row_offsets[f] + row);
+        }
+      }
+      packer.pack(std::string("nulls"));
+      packer.pack(nulls);
+      if (is_address) {
+        packer.pack(std::string("dictionary"));
+        packer.pack(dictionary_values);
+      }
+    }
+    return td::write_file(out_dir + "/" + table + ".tcol", out.str());
+  } catch (const std::exception& e) {
+    return td::Status::Error(ErrorCode::DB_ERROR, PSLICE() << "Failed to merge " << table << " chunks: " << e.what());
+  }
+}
+
+}  // namespace
+
+//
+// InsertManagerFile
+//
+void InsertManagerFile::start_up() {
+  td::mkdir(dir_).ensure();
+  td::mkdir(staging_dir(dir_)).ensure();
+  try {
+    for (const auto& partition_entry : fs::directory_iterator(staging_dir(dir_))) {
+      if (!partition_entry.is_directory()) {
+        continue;
+      }
+      auto name = partition_entry.path().filename().string();
+      // published but not yet cleaned up when the process stopped
+      if (read_seqnos(dir_ + "/" + name).is_ok()) {
+        fs::remove_all(partition_entry.path());
+        continue;
+      }
+      for (const auto& chunk_entry : fs::directory_iterator(partition_entry.path())) {
+        if (!chunk_entry.is_directory() || chunk_entry.path().filename().string()[0] == '.') {
+          continue;
+        }
+        auto seqnos = read_seqnos(chunk_entry.path().string());
+        if (seqnos.is_error()) {
+          continue;
+        }
+        for (auto seqno : seqnos.ok()) {
+          auto partition = seqno / partition_size_;
+          // staged with another partition size, these seqnos are indexed again
+          if (partition_name(partition * partition_size_, partition * partition_size_ + partition_size_ - 1) != name) {
+            LOG(WARNING) << "Ignoring chunk " << chunk_entry.path().string() << " staged with another partition size";
+            break;
+          }
+          staged_seqnos_[partition].insert(seqno);
+        }
+      }
+    }
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "Error reading staged chunks of " << dir_ << ": " << e.what();
+  }
+  publish_complete_partitions();
+  InsertManagerBase::start_up();
+}
+
+void InsertManagerFile::alarm() {
+  publish_complete_partitions();
+  InsertManagerBase::alarm();
+}
+
+void InsertManagerFile::create_insert_actor(std::vector<InsertTaskStruct> insert_tasks, td::Promise<td::Unit> promise) {
+  create_insert_actor(std::move(insert_tasks), std::nullopt, std::move(promise));
+}
+
+void InsertManagerFile::create_insert_actor(std::vector<InsertTaskStruct> insert_tasks, std::optional<std::uint32_t> commit_watermark, td::Promise<td::Unit> promise) {
+  std::vector<std::uint32_t> seqnos;
+  for (const auto& task : insert_tasks) {
+    seqnos.push_back(task.mc_seqno_);
+  }
+  auto P = td::PromiseCreator::lambda([SelfId = actor_id(this), seqnos = std::move(seqnos), promise = std::move(promise)](td::Result<td::Unit> R) mutable {
+    if (R.is_error()) {
+      promise.set_error(R.move_as_error());
+      return;
+    }
+    td::actor::send_closure(SelfId, &InsertManagerFile::chunks_staged, std::move(seqnos));
+    promise.set_value(td::Unit());
+  });
+  td::actor::create_actor<InsertBatchFile>("insert_batch_file", dir_, partition_size_, std::move(insert_tasks), 
+                                          watermark_path(dir_, watermark_from_seqno_, watermark_to_seqno_), commit_watermark, std::move(P)).release();
+}
+
+bool InsertManagerFile::is_complete(std::uint32_t partition) const {
+  auto it = staged_seqnos_.find(partition);
+  if (it == staged_seqnos_.end()) {
+    return false;
+  }
+  std::uint32_t first = std::max(partition * partition_size_, from_seqno_);
+  std::uint32_t last = partition * partition_size_ + partition_size_ - 1;
+  if (to_seqno_ > 0) {
+    last = std::min(last, to_seqno_);
+  }
+  if (first > last) {
+    return false;
+  }
+  const auto& seqnos = it->second;
+  return static_cast<std::uint32_t>(std::distance(seqnos.lower_bound(first), seqnos.upper_bound(last))) == last - first + 1;
+}
+
+void InsertManagerFile::chunks_staged(std::vector<std::uint32_t> seqnos) {
+  for (auto seqno : seqnos) {
+    staged_seqnos_[seqno / partition_size_].insert(seqno);
+  }
+  publish_complete_partitions();
+}
+
+void InsertManagerFile::publish_complete_partitions() {
+  for (const auto& [partition, _] : staged_seqnos_) {
+    if (publishing_.count(partition) || !is_complete(partition)) {
+      continue;
+    }
+    publishing_.insert(partition);
+    auto P = td::PromiseCreator::lambda([SelfId = actor_id(this), partition = partition](td::Result<td::Unit> R) {
+      td::actor::send_closure(SelfId, &InsertManagerFile::partition_published, partition, R.is_ok() ? td::Status::OK() : R.move_as_error());
+    });
+    td::actor::create_actor<PublishPartitionFile>("publish_partition_file", dir_, partition * partition_size_, 
+                                                  partition * partition_size_ + partition_size_ - 1, std::move(P)).release();
+  }
+}
+
+// a failed partition is retried by the alarm
+void InsertManagerFile::partition_published(std::uint32_t partition, td::Status status) {
+  publishing_.erase(partition);
+  if (status.is_error()) {
+    LOG(ERROR) << "Failed to publish partition " << partition_name(partition * partition_size_, partition * partition_size_ + partition_size_ - 1) 
+               << " in " << dir_ << ": " << status;
+    return;
+  }
+  staged_seqnos_.erase(partition);
+}
+
+void InsertManagerFile::get_existing_seqnos(td::Promise<std::vector<std::uint32_t>> promise, std::int32_t from_seqno, std::int32_t to_seqno) {
+  std::set<std::uint32_t> seqnos;
+  try {
+    for (const auto& entry : fs::directory_iterator(dir_)) {
+      if (!entry.is_directory() || entry.path().filename().string()[0] == '.') {
+        continue;
+      }
+      auto partition_seqnos = read_seqnos(entry.path().string());
+      if (partition_seqnos.is_ok()) {
+        seqnos.insert(partition_seqnos.ok().begin(), partition_seqnos.ok().end());
+      }
+    }
+  } catch (const std::exception& e) {
+    promise.set_error(td::Status::Error(ErrorCode::DB_ERROR, PSLICE() << "Error reading partitions of " << dir_ << ": " << e.what()));
+    return;
+  }
+  // staged chunks are durable, they only wait for the rest of their partition
+  for (const auto& [_, staged] : staged_seqnos_) {
+    seqnos.insert(staged.begin(), staged.end());
+  }
+  std::vector<std::uint32_t> result;
+  for (auto seqno : seqnos) {
+    if ((from_seqno <= 0 || seqno >= static_cast<std::uint32_t>(from_seqno)) && (to_seqno <= 0 || seqno <= static_cast<std::uint32_t>(to_seqno))) {
+      result.push_back(seqno);
+    }
+  }
+  promise.set_value(std::move(result));
+}
+
+void InsertManagerFile::get_commit_watermark(td::Promise<std::uint32_t> promise, std::int32_t from_seqno, std::int32_t to_seqno) {
+  auto buffer = td::read_file_str(watermark_path(dir_, from_seqno, to_seqno));
+  if (buffer.is_error()) {
+    promise.set_error(td::Status::Error(ErrorCode::ENTITY_NOT_FOUND, "commit watermark is not written yet"));
+    return;
+  }
+  try {
+    promise.set_value(static_cast<std::uint32_t>(std::stoul(buffer.ok())));
+  } catch (...) {
+    promise.set_error(td::Status::Error(ErrorCode::DB_ERROR, "bad commit watermark file"));
+  }
+}
+
+//
+// InsertBatchFile
+//
+void InsertBatchFile::start_up() {
+  td::Status S;
+  auto begin = insert_tasks_.cbegin();
+  while (S.is_ok() && begin != insert_tasks_.cend()) {
+    auto partition = begin->mc_seqno_ / partition_size_;
+    auto end = std::find_if(begin, insert_tasks_.cend(), [&](const auto& task) {
+      return task.mc_seqno_ / partition_size_ != partition;
+    });
+    S = write_chunk(begin, end);
+    begin = end;
+  }
+  if (S.is_ok()) {
+    S = write_commit_watermark();
+  }
+  if (S.is_error()) {
+    LOG(ERROR) << "Error writing chunk to " << dir_ << ": " << S;
+    for (auto& task : insert_tasks_) {
+      task.promise_.set_error(S.clone());
+    }
+    promise_.set_error(std::move(S));
+    stop();
+    return;
+  }
+  for (auto& task : insert_tasks_) {
+    task.promise_.set_value(td::Unit());
+  }
+  promise_.set_value(td::Unit());
+  stop();
+}
+
+td::Status InsertBatchFile::write_chunk(std::vector<InsertTaskStruct>::const_iterator begin, std::vector<InsertTaskStruct>::const_iterator end) {
+  using Type = ColumnarTable::Type;
+  ColumnarTable blocks("blocks", {
+    {"workchain", Type::Number}, {"shard", Type::Number}, {"seqno", Type::Number}, {"root_hash", Type::Hash}, {"file_hash", Type::Hash},
+    {"mc_block_seqno", Type::Number}, {"global_id", Type::Number}, {"version", Type::Number}, {"key_block", Type::Bool},
+    {"gen_utime", Type::Number}, {"start_lt", Type::Number}, {"end_lt", Type::Number}, {"tx_count", Type::Number}
+  });
+  ColumnarTable transactions("transactions", {
+    {"hash", Type::Hash}, {"account", Type::Address}, {"lt", Type::Number}, {"block_workchain", Type::Number}, {"block_shard", Type::Number},
+    {"block_seqno", Type::Number}, {"mc_block_seqno", Type::Number}, {"trace_id", Type::Hash}, {"prev_trans_hash", Type::Hash},
+    {"prev_trans_lt", Type::Number}, {"now", Type::Number}, {"orig_status", Type::String}, {"end_status", Type::String},
+    {"total_fees", Type::Decimal}, {"account_state_hash_before", Type::Hash}, {"account_state_hash_after", Type::Hash}
+  });
+  ColumnarTable messages("messages", {
+    {"tx_hash", Type::Hash}, {"tx_lt", Type::Number}, {"msg_hash", Type::Hash}, {"direction", Type::String}, {"trace_id", Type::Hash},
+    {"source", Type::Address}, {"destination", Type::Address}, {"value", Type::Decimal}, {"fwd_fee", Type::Decimal}, {"ihr_fee", Type::Decimal},
+    {"created_lt", Type::Number}, {"created_at", Type::Number}, {"opcode", Type::Number}, {"bounce", Type::Bool}, {"bounced", Type::Bool},
+    {"body_hash", Type::Hash}, {"body_boc", Type::String}, {"init_state_hash", Type::Hash}, {"init_state_boc", Type::String}
+  });
+  ColumnarTable account_states("account_states", {
+    {"hash", Type::Hash}, {"account", Type::Address}, {"timestamp", Type::Number}, {"balance", Type::Decimal}, {"account_status", Type::String},
+    {"frozen_hash", Type::Hash}, {"code_hash", Type::Hash}, {"data_hash", Type::Hash}, {"last_trans_hash", Type::Hash}, {"last_trans_lt", Type::Number}
+  });
+  ColumnarTable traces("traces", {
+    {"trace_id", Type::Hash}, {"external_hash", Type::Hash}, {"mc_seqno_start", Type::Number}, {"mc_seqno_end", Type::Number},
+    {"start_lt", Type::Number}, {"start_utime", Type::Number}, {"end_lt", Type::Number}, {"end_utime", Type::Number},
+    {"state", Type::String}, {"edges", Type::Number}, {"nodes", Type::Number}
+  });
+  ColumnarTable jetton_transfers("jetton_transfers", {
+    {"tx_hash", Type::Hash}, {"tx_lt", Type::Number}, {"tx_now", Type::Number}, {"tx_aborted", Type::Bool}, {"trace_id", Type::Hash},
+    {"query_id", Type::Number}, {"amount", Type::Decimal}, {"source", Type::Address}, {"destination", Type::Address},
+    {"jetton_wallet", Type::Address}, {"response_destination", Type::Address}, {"forward_ton_amount", Type::Decimal}
+  });
+  ColumnarTable jetton_burns("jetton_burns", {
+    {"tx_hash", Type::Hash}, {"tx_lt", Type::Number}, {"tx_now", Type::Number}, {"tx_aborted", Type::Bool}, {"trace_id", Type::Hash},
+    {"query_id", Type::Number}, {"owner", Type::Address}, {"jetton_wallet", Type::Address}, {"amount", Type::Decimal},
+    {"response_destination", Type::Address}
+  });
+  ColumnarTable nft_transfers("nft_transfers", {
+    {"tx_hash", Type::Hash}, {"tx_lt", Type::Number}, {"tx_now", Type::Number}, {"tx_aborted", Type::Bool}, {"trace_id", Type::Hash},
+    {"query_id", Type::Number}, {"nft_item", Type::Address}, {"old_owner", Type::Address}, {"new_owner", Type::Address},
+    {"response_destination", Type::Address}, {"forward_amount", Type::Decimal}
+  });
+
+  auto add_message = [&](const schema::Transaction& tx, const schema::Message& msg, const char* direction) {
+    messages.add_row(tx.hash, tx.lt, msg.hash, direction, msg.trace_id, msg.source, msg.destination,
+      msg.value ? std::make_optional(msg.value->grams) : std::nullopt, msg.fwd_fee, msg.ihr_fee, msg.created_lt, msg.created_at,
+      msg.opcode, msg.bounce, msg.bounced,
+      msg.body.not_null() ? std::make_optional(td::Bits256(msg.body->get_hash().bits())) : std::nullopt, msg.body_boc,
+      msg.init_state.not_null() ? std::make_optional(td::Bits256(msg.init_state->get_hash().bits())) : std::nullopt, msg.init_state_boc);
+  };
+
+  std::vector<std::uint32_t> seqnos;
+  for (auto it = begin; it != end; ++it) {
+    const auto& task = *it;
+    seqnos.push_back(task.mc_seqno_);
+    const auto& parsed_block = *task.parsed_block_;
+    for (const auto& blk : parsed_block.blocks_) {
+      blocks.add_row(blk.workchain, blk.shard, blk.seqno, hash_from_base64(blk.root_hash), hash_from_base64(blk.file_hash),
+        blk.mc_block_seqno, blk.global_id, blk.version, blk.key_block, blk.gen_utime, blk.start_lt, blk.end_lt,
+        static_cast<std::uint32_t>(blk.transactions.size()));
+      for (const auto& tx : blk.transactions) {
+        transactions.add_row(tx.hash, tx.account, tx.lt, blk.workchain, blk.shard, blk.seqno, task.mc_seqno_, tx.trace_id,
+          tx.prev_trans_hash, tx.prev_trans_lt, tx.now, stringify(tx.orig_status), stringify(tx.end_status), tx.total_fees.grams,
+          tx.account_state_hash_before, tx.account_state_hash_after);
+        if (tx.in_msg) {
+          add_message(tx, tx.in_msg.value(), "in");
+        }
+        for (const auto& msg : tx.out_msgs) {
+          add_message(tx, msg, "out");
+        }
+      }
+    }
+    for (const auto& state : parsed_block.account_states_) {
+      account_states.add_row(state.hash, state.account, state.timestamp, state.balance.grams, state.account_status,
+        state.frozen_hash, state.code_hash, state.data_hash, state.last_trans_hash, state.last_trans_lt);
+    }
+    // same as the database: only complete traces
+    for (const auto& trace : parsed_block.traces_) {
+      if (trace.state != schema::Trace::State::complete) {
+        continue;
+      }
+      traces.add_row(trace.trace_id, trace.external_hash, trace.mc_seqno_start, trace.mc_seqno_end, trace.start_lt, trace.start_utime,
+        trace.end_lt, trace.end_utime, "complete", trace.edges_, trace.nodes_);
+    }
+    for (const auto& event : parsed_block.events_) {
+      if (auto transfer = std::get_if<JettonTransfer>(&event)) {
+        jetton_transfers.add_row(transfer->transaction_hash, transfer->transaction_lt, transfer->transaction_now, transfer->transaction_aborted,
+          transfer->trace_id, transfer->query_id, transfer->amount, transfer->source, transfer->destination, transfer->jetton_wallet,
+          transfer->response_destination, transfer->forward_ton_amount);
+      } else if (auto burn = std::get_if<JettonBurn>(&event)) {
+        jetton_burns.add_row(burn->transaction_hash, burn->transaction_lt, burn->transaction_now, burn->transaction_aborted,
+          burn->trace_id, burn->query_id, burn->owner, burn->jetton_wallet, burn->amount, burn->response_destination);
+      } else if (auto transfer = std::get_if<NFTTransfer>(&event)) {
+        nft_transfers.add_row(transfer->transaction_hash, transfer->transaction_lt, transfer->transaction_now, transfer->transaction_aborted,
+          transfer->trace_id, transfer->query_id, transfer->nft_item, transfer->old_owner, transfer->new_owner,
+          transfer->response_destination, transfer->forward_amount);
+      }
+    }
+  }
+
+  auto partition = seqnos.front() / partition_size_;
+  auto partition_dir = staging_dir(dir_) + "/" + partition_name(partition * partition_size_, partition * partition_size_ + partition_size_ - 1);
+  auto name = partition_name(seqnos.front(), seqnos.back());
+  auto tmp_dir = partition_dir + "/.tmp-" + name;
+  auto chunk_dir = partition_dir + "/" + name;
+  try {
+    // seqnos of a failed batch are retried in other batches, chunks it managed to stage are replaced
+    if (fs::exists(partition_dir)) {
+      for (const auto& entry : fs::directory_iterator(partition_dir)) {
+        if (!entry.is_directory() || entry.path().filename().string()[0] == '.') {
+          continue;
+        }
+        auto staged = read_seqnos(entry.path().string());
+        if (staged.is_ok() && std::any_of(staged.ok().begin(), staged.ok().end(), [&](std::uint32_t seqno) {
+              return std::binary_search(seqnos.begin(), seqnos.end(), seqno);
+            })) {
+          fs::remove_all(entry.path());
+        }
+      }
+    }
+    fs::remove_all(tmp_dir);
+    fs::create_directories(tmp_dir);
+  } catch (const std::exception& e) {
+    return td::Status::Error(ErrorCode::DB_ERROR, PSLICE() << "Failed to create " << tmp_dir << ": " << e.what());
+  }
+  for (const auto* table : {&blocks, &transactions, &messages, &account_states, &traces, &jetton_transfers, &jetton_burns, &nft_transfers}) {
+    TRY_STATUS(table->write(tmp_dir));
+  }
+  std::stringstream seqnos_buffer;
+  msgpack::pack(seqnos_buffer, seqnos);
+  TRY_STATUS(td::write_file(tmp_dir + "/seqnos", seqnos_buffer.str()));
+  try {
+    // a batch retried after a crash replaces its previous attempt
+    fs::remove_all(chunk_dir);
+    fs::rename(tmp_dir, chunk_dir);
+  } catch (const std::exception& e) {
+    return td::Status::Error(ErrorCode::DB_ERROR, PSLICE() << "Failed to stage chunk " << chunk_dir << ": " << e.what());
+  }
+  return td::Status::OK();
+}
+
+td::Status InsertBatchFile::write_commit_watermark() {
+  if (commit_watermark_) {
+    std::lock_guard<std::mutex> guard(commit_watermark_mutex);
+    auto current = td::read_file_str(watermark_path_);
+    if (current.is_ok()) {
+      try {
+        if (std::stoul(current.ok()) >= commit_watermark_.value()) {
+          return td::Status::OK();
+        }
+      } catch (...) {
+      }
+    }
+    TRY_STATUS(td::atomic_write_file(watermark_path_, std::to_string(commit_watermark_.value())));
+  }
+  return td::Status::OK();
+}
+
+//
+// PublishPartitionFile
+//
+void PublishPartitionFile::start_up() {
+  auto S = publish();
+  if (S.is_error()) {
+    promise_.set_error(std::move(S));
+  } else {
+    promise_.set_value(td::Unit());
+  }
+  stop();
+}
+
+td::Status PublishPartitionFile::publish() {
+  auto name = partition_name(first_seqno_, last_seqno_);
+  auto staged_dir = staging_dir(dir_) + "/" + name;
+  auto tmp_dir = dir_ + "/.tmp-" + name;
+  auto partition_dir = dir_ + "/" + name;
+  // chunks are merged in seqno order
+  std::map<std::uint32_t, std::string> chunk_dirs;
+  std::vector<std::uint32_t> seqnos;
+  try {
+    for (const auto& entry : fs::directory_iterator(staged_dir)) {
+      if (!entry.is_directory() || entry.path().filename().string()[0] == '.') {
+        continue;
+      }
+      auto chunk_seqnos = read_seqnos(entry.path().string());
+      if (chunk_seqnos.is_error() || chunk_seqnos.ok().empty()) {
+        continue;
+      }
+      chunk_dirs[chunk_seqnos.ok().front()] = entry.path().string();
+      seqnos.insert(seqnos.end(), chunk_seqnos.ok().begin(), chunk_seqnos.ok().end());
+    }
+    fs::remove_all(tmp_dir);
+    fs::create_directories(tmp_dir);
+  } catch (const std::exception& e) {
+    return td::Status::Error(ErrorCode::DB_ERROR, PSLICE() << "Failed to read chunks of " << staged_dir << ": " << e.what());
+  }
+  std::sort(seqnos.begin(), seqnos.end());
+  std::vector<std::string> dirs;
+  for (auto& [_, dir] : chunk_dirs) {
+    dirs.push_back(std::move(dir));
+  }
+  for (const auto* table : table_names) {
+    TRY_STATUS(merge_table(dirs, table, tmp_dir));
+  }
+  std::stringstream seqnos_buffer;
+  msgpack::pack(seqnos_buffer, seqnos);
+  TRY_STATUS(td::write_file(tmp_dir + "/seqnos", seqnos_buffer.str()));
+  try {
+    fs::remove_all(partition_dir);
+    fs::rename(tmp_dir, partition_dir);
+    fs::remove_all(staged_dir);
+  } catch (const std::exception& e) {
+    return td::Status::Error(ErrorCode::DB_ERROR, PSLICE() << "Failed to publish partition " << partition_dir << ": " << e.what());
+  }
+  LOG(INFO) << "Published partition " << partition_dir << " of " << seqnos.size() << " mc blocks";
+  return td::Status::OK();
+}
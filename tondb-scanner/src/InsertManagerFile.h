@@ -0,0 +1,82 @@
+#pragma once
+#include <map>
+#include <set>
+#include "InsertManagerBase.h"
+
+
+// Writes fixed partitions of partition_size mc seqnos: partition <dir>/<first mc seqno>-<last mc seqno>/ holds
+// mc seqnos from mc_seqno / partition_size * partition_size, with one columnar .tcol file per table. Insert batches
+// are staged as chunks in <dir>/.staging/<partition>/, a partition is merged from its chunks and published once all
+// of its seqnos are staged, so partitions never overlap and never change after they appear.
+class InsertManagerFile: public InsertManagerBase {
+public:
+  InsertManagerFile(std::string dir, std::uint32_t partition_size) : dir_(std::move(dir)), partition_size_(partition_size) {}
+
+  // seqnos outside of the indexed range never come, the first and the last partitions are complete without them
+  void set_seqno_range(std::uint32_t from_seqno, std::uint32_t to_seqno) { from_seqno_ = from_seqno; to_seqno_ = to_seqno; }
+
+  void start_up() override;
+  void alarm() override;
+
+  void create_insert_actor(std::vector<InsertTaskStruct> insert_tasks, td::Promise<td::Unit> promise) override;
+  void create_insert_actor(std::vector<InsertTaskStruct> insert_tasks, std::optional<std::uint32_t> commit_watermark, td::Promise<td::Unit> promise) override;
+  void get_existing_seqnos(td::Promise<std::vector<std::uint32_t>> promise, std::int32_t from_seqno = 0, std::int32_t to_seqno = 0) override;
+  void get_commit_watermark(td::Promise<std::uint32_t> promise, std::int32_t from_seqno = 0, std::int32_t to_seqno = 0) override;
+private:
+  std::string dir_;
+  std::uint32_t partition_size_;
+  std::uint32_t from_seqno_{0};
+  std::uint32_t to_seqno_{0};
+
+  // staged seqnos of unpublished partitions by partition index
+  std::map<std::uint32_t, std::set<std::uint32_t>> staged_seqnos_;
+  std::set<std::uint32_t> publishing_;
+
+  bool is_complete(std::uint32_t partition) const;
+  void chunks_staged(std::vector<std::uint32_t> seqnos);
+  void publish_complete_partitions();
+  void partition_published(std::uint32_t partition, td::Status status);
+};
+
+
+// Stages the batch as one chunk per partition it touches.
+class InsertBatchFile: public td::actor::Actor {
+public:
+  InsertBatchFile(std::string dir, std::uint32_t partition_size, std::vector<InsertTaskStruct> insert_tasks, 
+                  std::string watermark_path, std::optional<std::uint32_t> commit_watermark, td::Promise<td::Unit> promise) :
+    dir_(std::move(dir)), partition_size_(partition_size), insert_tasks_(std::move(insert_tasks)), 
+    watermark_path_(std::move(watermark_path)), commit_watermark_(commit_watermark), promise_(std::move(promise)) {
+      std::sort(insert_tasks_.begin(), insert_tasks_.end(), [](const auto& a, const auto& b) {
+        return a.mc_seqno_ < b.mc_seqno_;
+      });
+  }
+
+  void start_up() override;
+private:
+  std::string dir_;
+  std::uint32_t partition_size_;
+  std::vector<InsertTaskStruct> insert_tasks_;
+  std::string watermark_path_;
+  std::optional<std::uint32_t> commit_watermark_;
+  td::Promise<td::Unit> promise_;
+
+  td::Status write_chunk(std::vector<InsertTaskStruct>::const_iterator begin, std::vector<InsertTaskStruct>::const_iterator end);
+  td::Status write_commit_watermark();
+};
+
+
+// Merges staged chunks of a complete partition into the partition directory.
+class PublishPartitionFile: public td::actor::Actor {
+public:
+  PublishPartitionFile(std::string dir, std::uint32_t first_seqno, std::uint32_t last_seqno, td::Promise<td::Unit> promise) :
+    dir_(std::move(dir)), first_seqno_(first_seqno), last_seqno_(last_seqno), promise_(std::move(promise)) {}
+
+  void start_up() override;
+private:
+  std::string dir_;
+  std::uint32_t first_seqno_;
+  std::uint32_t last_seqno_;
+  td::Promise<td::Unit> promise_;
+
+  td::Status publish();
+};
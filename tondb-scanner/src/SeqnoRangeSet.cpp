@@ -0,0 +1,69 @@
+#include <algorithm>
+#include <iterator>
+#include "SeqnoRangeSet.h"
+
+
+void SeqnoRangeSet::insert_range(std::uint32_t from, std::uint32_t to) {
+  if (from > to) {
+    return;
+  }
+  // merge with ranges that overlap or touch [from, to]
+  auto it = ranges_.upper_bound(from);
+  if (it != ranges_.begin()) {
+    auto prev = std::prev(it);
+    if (static_cast<std::uint64_t>(prev->second) + 1 >= from) {
+      it = prev;
+    }
+  }
+  while (it != ranges_.end() && it->first <= static_cast<std::uint64_t>(to) + 1) {
+    from = std::min(from, it->first);
+    to = std::max(to, it->second);
+    size_ -= static_cast<std::uint64_t>(it->second) - it->first + 1;
+    it = ranges_.erase(it);
+  }
+  ranges_.emplace(from, to);
+  size_ += static_cast<std::uint64_t>(to) - from + 1;
+}
+
+void SeqnoRangeSet::erase(std::uint32_t seqno) {
+  auto it = ranges_.upper_bound(seqno);
+  if (it == ranges_.begin()) {
+    return;
+  }
+  --it;
+  auto [first, last] = *it;
+  if (seqno > last) {
+    return;
+  }
+  ranges_.erase(it);
+  if (first < seqno) {
+    ranges_.emplace(first, seqno - 1);
+  }
+  if (seqno < last) {
+    ranges_.emplace(seqno + 1, last);
+  }
+  --size_;
+}
+
+bool SeqnoRangeSet::contains(std::uint32_t seqno) const {
+  auto it = ranges_.upper_bound(seqno);
+  if (it == ranges_.begin()) {
+    return false;
+  }
+  return seqno <= std::prev(it)->second;
+}
+
+std::uint32_t SeqnoRangeSet::contiguous_end(std::uint32_t from) const {
+  auto it = ranges_.upper_bound(from);
+  if (it == ranges_.begin() || from > std::prev(it)->second) {
+    return from - 1;
+  }
+  return std::prev(it)->second;
+}
+
+std::optional<std::uint32_t> SeqnoRangeSet::min() const {
+  if (ranges_.empty()) {
+    return std::nullopt;
+  }
+  return ranges_.begin()->first;
+}
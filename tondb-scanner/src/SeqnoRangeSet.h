@@ -0,0 +1,27 @@
+#pragma once
+#include <map>
+#include <optional>
+#include <cstdint>
+
+
+// Set of mc seqnos stored as disjoint closed intervals. Indexed seqnos are mostly one long run,
+// so memory is proportional to the number of gaps rather than to the number of seqnos.
+class SeqnoRangeSet {
+public:
+  void insert(std::uint32_t seqno) { insert_range(seqno, seqno); }
+  void insert_range(std::uint32_t from, std::uint32_t to);
+  void erase(std::uint32_t seqno);
+  bool contains(std::uint32_t seqno) const;
+
+  std::uint64_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  void clear() { ranges_.clear(); size_ = 0; }
+
+  // last seqno of the run starting at from, from - 1 if from is not in the set
+  std::uint32_t contiguous_end(std::uint32_t from) const;
+  std::optional<std::uint32_t> min() const;
+  size_t ranges_count() const { return ranges_.size(); }
+private:
+  std::map<std::uint32_t, std::uint32_t> ranges_;  // first -> last
+  std::uint64_t size_{0};
+};
@@ -1,6 +1,8 @@
 #include <map>
+#include <queue>
 #include <filesystem>
 #include "TraceAssembler.h"
+#include "TraceStitcher.h"
 #include "td/utils/JsonBuilder.h"
 #include "td/utils/filesystem.h"
 #include "td/utils/port/path.h"
@@ -22,6 +24,19 @@ schema::TraceEdge TraceEdgeImpl::to_schema() const {
     return result;
 }
 
+TraceEdgeImpl TraceEdgeImpl::from_schema(const schema::TraceEdge& edge) {
+    TraceEdgeImpl result;
+    result.trace_id = edge.trace_id;
+    result.msg_hash = edge.msg_hash;
+    result.msg_lt = edge.msg_lt;
+    result.left_tx = edge.left_tx;
+    result.right_tx = edge.right_tx;
+    result.type = edge.type;
+    result.incomplete = edge.incomplete;
+    result.broken = edge.broken;
+    return result;
+}
+
 schema::Trace TraceImpl::to_schema() const {
     schema::Trace result;
     result.trace_id = trace_id;
@@ -45,53 +60,115 @@ TraceAssembler::TraceAssembler(std::string db_path, size_t gc_distance) :
 }
 
 void TraceAssembler::start_up() {
+    load_manifest();
     alarm_timestamp() = td::Timestamp::in(10.0);
 }
 
-td::Status gc_states(std::string db_path, ton::BlockSeqno current_seqno, size_t keep_last) {
-    std::map<int, fs::path, std::greater<int>> fileMap;
+std::string manifest_path(const std::string& db_path) {
+    return db_path + "/states.manifest";
+}
 
-    for (const auto& entry : fs::directory_iterator(db_path)) {
-        if (fs::is_regular_file(entry.status())) {
-            auto filename = entry.path().stem().string();
-            auto extension = entry.path().extension().string();
+std::string state_path(const std::string& db_path, ton::BlockSeqno seqno) {
+    return db_path + "/" + std::to_string(seqno) + ".tastate";
+}
+
+void TraceAssembler::load_manifest() {
+    auto buffer_r = td::read_file(manifest_path(db_path_));
+    if (buffer_r.is_ok()) {
+        auto buffer = buffer_r.move_as_ok();
+        try {
+            std::vector<TraceAssemblerStateInfo> states;
+            msgpack::unpacked states_res;
+            msgpack::unpack(states_res, buffer.data(), buffer.size());
+            states_res.get().convert(states);
+            for (const auto& info : states) {
+                saved_states_[info.seqno] = info;
+            }
+            LOG(INFO) << "Loaded TraceAssembler manifest with " << saved_states_.size() << " states";
+            return;
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "Failed to unpack TraceAssembler manifest: " << e.what();
+        }
+    }
 
-            if (extension == ".tastate") {
+    // no manifest yet (first start after upgrade or corrupted manifest): scan directory once
+    try {
+        for (const auto& entry : fs::directory_iterator(db_path_)) {
+            if (fs::is_regular_file(entry.status()) && entry.path().extension().string() == ".tastate") {
                 try {
-                    int seqno = std::stoi(filename);
-                    fileMap[seqno] = entry.path();
+                    auto seqno = static_cast<ton::BlockSeqno>(std::stoul(entry.path().stem().string()));
+                    saved_states_[seqno] = TraceAssemblerStateInfo{seqno, static_cast<std::uint64_t>(fs::file_size(entry.path()))};
                 } catch (const std::exception& e) {
                     LOG(ERROR) << "Error reading seqno of trace assembler state " << entry.path().string();
                 }
             }
         }
+    } catch (const std::exception& e) {
+        LOG(ERROR) << "Error while searching for TraceAssembler states: " << e.what();
     }
+    LOG(INFO) << "Built TraceAssembler manifest from " << saved_states_.size() << " state files";
 
-    int count = 0;
-    for (const auto& [seqno, filepath] : fileMap) {
-        if (seqno > current_seqno) {
-            LOG(WARNING) << "Deleting state " << filepath.string() << " that is higher than currently processing seqno " << current_seqno;
-            fs::remove(filepath);
-        } else if (count >= keep_last) {
-            fs::remove(filepath);
-            LOG(DEBUG) << "Deleting old state: " << filepath.string();
-        } else {
-            LOG(DEBUG) << "Keeping state: " << filepath.string();
-            count++;
-        }
+    auto S = write_manifest();
+    if (S.is_error()) {
+        LOG(ERROR) << "Failed to write TraceAssembler manifest: " << S.move_as_error();
     }
-    return td::Status::OK();
 }
 
-td::Status save_state(std::string db_path, ton::BlockSeqno seqno, 
+td::Status TraceAssembler::write_manifest() {
+    std::vector<TraceAssemblerStateInfo> states;
+    states.reserve(saved_states_.size());
+    for (const auto& [_, info] : saved_states_) {
+        states.push_back(info);
+    }
+    std::stringstream buffer;
+    msgpack::pack(buffer, states);
+    return td::atomic_write_file(manifest_path(db_path_), buffer.str());
+}
+
+td::Result<TraceAssemblerStateInfo> save_state(std::string db_path, ton::BlockSeqno seqno, 
                       std::unordered_map<td::Bits256, TraceImplPtr, Bits256Hasher> pending_traces,
                       std::unordered_map<td::Bits256, TraceEdgeImpl, Bits256Hasher> pending_edges) {
     std::stringstream buffer;
     msgpack::pack(buffer, pending_traces);
     msgpack::pack(buffer, pending_edges);
  
-    auto path = db_path + "/" + std::to_string(seqno) + ".tastate";
-    return td::atomic_write_file(path, buffer.str());
+    auto data = buffer.str();
+    TRY_STATUS(td::atomic_write_file(state_path(db_path, seqno), data));
+    return TraceAssemblerStateInfo{seqno, data.size()};
+}
+
+void TraceAssembler::state_saved(TraceAssemblerStateInfo info) {
+    saved_states_[info.seqno] = info;
+    gc_states();
+}
+
+void TraceAssembler::gc_states() {
+    std::vector<ton::BlockSeqno> to_delete;
+    size_t count = 0;
+    for (auto it = saved_states_.rbegin(); it != saved_states_.rend(); ++it) {
+        if (it->first > expected_seqno_) {
+            LOG(WARNING) << "Deleting state " << it->first << " that is higher than currently processing seqno " << expected_seqno_;
+            to_delete.push_back(it->first);
+        } else if (count >= keep_states_) {
+            LOG(DEBUG) << "Deleting old state: " << it->first;
+            to_delete.push_back(it->first);
+        } else {
+            count++;
+        }
+    }
+    for (auto seqno : to_delete) {
+        saved_states_.erase(seqno);
+    }
+
+    // manifest goes first: a crash in between leaves only unreferenced files behind
+    auto S = write_manifest();
+    if (S.is_error()) {
+        LOG(ERROR) << "Failed to write TraceAssembler manifest: " << S.move_as_error();
+        return;
+    }
+    for (auto seqno : to_delete) {
+        td::unlink(state_path(db_path_, seqno)).ignore();
+    }
 }
 
 void TraceAssembler::alarm() {
@@ -101,18 +178,13 @@ void TraceAssembler::alarm() {
         return;
     }
 
-    ton::delay_action([db_path = this->db_path_, seqno = expected_seqno_ - 1, pending_traces = pending_traces_, pending_edges = pending_edges_]() {
-        auto S = save_state(db_path, seqno, pending_traces, pending_edges);
-        if (S.is_error()) {
-            LOG(ERROR) << "Error while saving Trace Assembler state: " << S.move_as_error();
-        }
-    }, td::Timestamp::now());
-
-    ton::delay_action([this]() {
-        auto S = gc_states(this->db_path_, this->expected_seqno_, 100);
-        if (S.is_error()) {
-            LOG(ERROR) << "Error while garbage collecting Trace Assembler states: " << S.move_as_error();
+    ton::delay_action([SelfId = actor_id(this), db_path = this->db_path_, seqno = expected_seqno_ - 1, pending_traces = pending_traces_, pending_edges = pending_edges_]() {
+        auto R = save_state(db_path, seqno, pending_traces, pending_edges);
+        if (R.is_error()) {
+            LOG(ERROR) << "Error while saving Trace Assembler state: " << R.move_as_error();
+            return;
         }
+        td::actor::send_closure(SelfId, &TraceAssembler::state_saved, R.move_as_ok());
     }, td::Timestamp::now());
 
     LOG(INFO) << "Expected seqno: " << expected_seqno_
@@ -136,39 +208,23 @@ void TraceAssembler::set_expected_seqno(ton::BlockSeqno new_expected_seqno) {
 }
 
 td::Result<ton::BlockSeqno> TraceAssembler::restore_state(ton::BlockSeqno seqno) {
-    std::map<int, fs::path, std::greater<int>> fileMap;
-    try {
-        for (const auto& entry : fs::directory_iterator(db_path_)) {
-            if (fs::is_regular_file(entry.status())) {
-                auto filename = entry.path().stem().string();  // Get filename without extension
-                auto extension = entry.path().extension().string();  // Get file extension
-
-                if (extension == ".tastate") {
-                    try {
-                        int seqno = std::stoi(filename);
-                        fileMap[seqno] = entry.path();
-                    } catch (const std::exception& e) {
-                        LOG(ERROR) << "Error reading seqno of trace assembler state " << entry.path().string();
-                    }
-                }
-            }
-        }
-    } catch (const std::exception& e) {
-        return td::Status::Error(PSLICE() << "Error while searching for TraceAssembler states: " << e.what());
-    }
-
-    for (const auto& [state_seqno, path] : fileMap) {
-        LOG(INFO) << "Found TA state seqno: " << state_seqno << " - path: " << path.string() << '\n';
-        if (state_seqno > seqno) {
-            LOG(WARNING) << "Found trace assembler state " << state_seqno << " newer than requested " << seqno;
-            continue;
-        }
-        auto buffer_r = td::read_file(path.string());
+    // nearest snapshot not newer than requested seqno; older ones only if it turns out to be unreadable
+    for (auto it = saved_states_.upper_bound(seqno); it != saved_states_.begin();) {
+        --it;
+        auto [state_seqno, info] = *it;
+        auto path = state_path(db_path_, state_seqno);
+        LOG(INFO) << "Found TA state seqno: " << state_seqno << " - path: " << path;
+
+        auto buffer_r = td::read_file(path);
         if (buffer_r.is_error()) {
-            LOG(ERROR) << "Failed to read trace assembler state file " << path.string() << ": " << buffer_r.move_as_error();
+            LOG(ERROR) << "Failed to read trace assembler state file " << path << ": " << buffer_r.move_as_error();
             continue;
         }
         auto buffer = buffer_r.move_as_ok();
+        if (buffer.size() != info.size) {
+            LOG(ERROR) << "Trace assembler state file " << path << " has size " << buffer.size() << ", expected " << info.size;
+            continue;
+        }
 
         std::unordered_map<td::Bits256, TraceImplPtr, Bits256Hasher> pending_traces;
         std::unordered_map<td::Bits256, TraceEdgeImpl, Bits256Hasher> pending_edges;    
@@ -199,10 +255,42 @@ td::Result<ton::BlockSeqno> TraceAssembler::restore_state(ton::BlockSeqno seqno)
 }
 
 
+void TraceAssembler::set_trace_stream(td::actor::ActorId<TraceStream> trace_stream) {
+    trace_stream_ = std::move(trace_stream);
+}
+
+void TraceAssembler::export_boundary(std::string path, ton::BlockSeqno from_seqno, td::Promise<td::Unit> promise) {
+    if (expected_seqno_ == 0) {
+        promise.set_error(td::Status::Error("TraceAssembler has not started yet"));
+        return;
+    }
+    TraceBoundaryState state{from_seqno, expected_seqno_ - 1, pending_traces_, pending_edges_};
+    ton::delay_action([path = std::move(path), state = std::move(state), promise = std::move(promise)]() mutable {
+        promise.set_result(write_trace_boundary(path, state));
+    }, td::Timestamp::now());
+}
+
+void TraceAssembler::flush_state(td::Promise<ton::BlockSeqno> promise) {
+    if (expected_seqno_ == 0) {
+        promise.set_error(td::Status::Error("TraceAssembler has not started yet"));
+        return;
+    }
+    auto R = save_state(db_path_, expected_seqno_ - 1, pending_traces_, pending_edges_);
+    if (R.is_error()) {
+        promise.set_error(R.move_as_error_prefix("Error while saving Trace Assembler state: "));
+        return;
+    }
+    state_saved(R.move_as_ok());
+    promise.set_value(expected_seqno_ - 1);
+}
+
 void TraceAssembler::process_queue() {
     auto it = queue_.find(expected_seqno_);
     while(it != queue_.end()) {
         process_block(it->second.seqno_, it->second.block_);
+        if (!trace_stream_.empty()) {
+            td::actor::send_closure(trace_stream_, &TraceStream::publish, it->second.seqno_, it->second.block_->traces_);
+        }
         it->second.promise_.set_result(it->second.block_);
 
         // block processed
@@ -214,29 +302,29 @@ void TraceAssembler::process_queue() {
 }
 
 void TraceAssembler::process_block(ton::BlockSeqno seqno, ParsedBlockPtr block) {
-    // sort transactions by lt
-    std::vector<std::reference_wrapper<schema::Transaction>> sorted_txs;
+    // transactions of every block are already in TransactionLtOrder, so k-way merge the blocks
+    using Cursor = std::pair<std::vector<schema::Transaction>::iterator, std::vector<schema::Transaction>::iterator>;
+    auto cursor_greater = [](const Cursor& lhs, const Cursor& rhs) {
+        return schema::TransactionLtOrder{}(*rhs.first, *lhs.first);
+    };
+    std::priority_queue<Cursor, std::vector<Cursor>, decltype(cursor_greater)> heads(cursor_greater);
     for(auto& blk: block->blocks_) {
-        for(auto& tx: blk.transactions) {
-            sorted_txs.push_back(tx);
+        if (!blk.transactions.empty()) {
+            heads.push({blk.transactions.begin(), blk.transactions.end()});
         }
     }
-    std::sort(sorted_txs.begin(), sorted_txs.end(), [](auto& lhs, auto& rhs){
-        if (lhs.get().lt != rhs.get().lt) {
-            return lhs.get().lt < rhs.get().lt;
-        }
-        if (lhs.get().account.workchain != rhs.get().account.workchain) {
-            return (lhs.get().account.workchain < rhs.get().account.workchain);
-        }
-        return (lhs.get().account.addr < rhs.get().account.addr);
-    });
 
     // process transactions
     std::vector<TraceEdgeImpl> completed_edges;
     std::unordered_set<td::Bits256, Bits256Hasher> updated_traces;
     std::unordered_set<td::Bits256, Bits256Hasher> pending_edges_added;
-    for(auto &tx : sorted_txs) {
-        process_transaction(seqno, tx.get(), completed_edges, updated_traces, pending_edges_added);
+    while (!heads.empty()) {
+        auto [tx_it, tx_end] = heads.top();
+        heads.pop();
+        process_transaction(seqno, *tx_it, completed_edges, updated_traces, pending_edges_added);
+        if (++tx_it != tx_end) {
+            heads.push({tx_it, tx_end});
+        }
     }
     std::unordered_map<td::Bits256, schema::Trace, Bits256Hasher> trace_map;
     for (auto &trace_id : updated_traces) {
@@ -1,6 +1,7 @@
 #pragma once
 #include "msgpack-utils.h"
 #include "IndexData.h"
+#include "TraceStream.h"
 
 
 struct Bits256Hasher {
@@ -72,6 +73,14 @@ struct TraceImpl {
 };
 MSGPACK_ADD_ENUM(TraceImpl::State);
 
+// Entry of the state manifest: one saved .tastate snapshot
+struct TraceAssemblerStateInfo {
+    ton::BlockSeqno seqno;
+    std::uint64_t size;
+
+    MSGPACK_DEFINE(seqno, size);
+};
+
 
 class TraceAssembler: public td::actor::Actor {
     struct Task {
@@ -88,6 +97,12 @@ class TraceAssembler: public td::actor::Actor {
 
     std::unordered_map<td::Bits256, TraceImplPtr, Bits256Hasher> pending_traces_;
     std::unordered_map<td::Bits256, TraceEdgeImpl, Bits256Hasher> pending_edges_;
+
+    // snapshots listed in the manifest file, so GC and restore never scan db_path_
+    std::map<ton::BlockSeqno, TraceAssemblerStateInfo> saved_states_;
+    size_t keep_states_{100};
+
+    td::actor::ActorId<TraceStream> trace_stream_;
 public:
     TraceAssembler(std::string db_path, size_t gc_distance);
     
@@ -95,9 +110,19 @@ public:
     
     td::Result<ton::BlockSeqno> restore_state(ton::BlockSeqno expected_seqno);
     void set_expected_seqno(ton::BlockSeqno expected_seqno);
+    void set_trace_stream(td::actor::ActorId<TraceStream> trace_stream);
+    // writes pending state after the last assembled seqno, used to stitch traces across worker ranges
+    void export_boundary(std::string path, ton::BlockSeqno from_seqno, td::Promise<td::Unit> promise);
+    // snapshot of the state after the last assembled seqno, written before returning. Used on shutdown.
+    void flush_state(td::Promise<ton::BlockSeqno> promise);
     void start_up() override;
     void alarm() override;
 private:
+    void load_manifest();
+    td::Status write_manifest();
+    void state_saved(TraceAssemblerStateInfo info);
+    void gc_states();
+
     void process_queue();
     void process_block(ton::BlockSeqno seqno, ParsedBlockPtr block);
     void process_transaction(ton::BlockSeqno seqno, schema::Transaction& tx, std::vector<TraceEdgeImpl>& edges_found_, 
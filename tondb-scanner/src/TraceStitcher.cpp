@@ -0,0 +1,188 @@
+#include <filesystem>
+#include <utility>
+#include "TraceStitcher.h"
+#include "td/utils/filesystem.h"
+
+namespace fs = std::filesystem;
+
+std::string trace_boundary_path(const std::string& dir, ton::BlockSeqno from_seqno, ton::BlockSeqno to_seqno) {
+    return dir + "/" + std::to_string(from_seqno) + "-" + std::to_string(to_seqno) + ".taboundary";
+}
+
+td::Status write_trace_boundary(const std::string& path, const TraceBoundaryState& state) {
+    std::stringstream buffer;
+    msgpack::pack(buffer, state.from_seqno);
+    msgpack::pack(buffer, state.to_seqno);
+    msgpack::pack(buffer, state.pending_traces);
+    msgpack::pack(buffer, state.pending_edges);
+    return td::atomic_write_file(path, buffer.str());
+}
+
+td::Result<TraceBoundaryState> read_trace_boundary(const std::string& path) {
+    TRY_RESULT(buffer, td::read_file(path));
+    TraceBoundaryState state;
+    try {
+        size_t offset = 0;
+        msgpack::unpacked res;
+        msgpack::unpack(res, buffer.data(), buffer.size(), offset);
+        res.get().convert(state.from_seqno);
+        msgpack::unpack(res, buffer.data(), buffer.size(), offset);
+        res.get().convert(state.to_seqno);
+        msgpack::unpack(res, buffer.data(), buffer.size(), offset);
+        res.get().convert(state.pending_traces);
+        msgpack::unpack(res, buffer.data(), buffer.size(), offset);
+        res.get().convert(state.pending_edges);
+    } catch (const std::exception& e) {
+        return td::Status::Error(PSLICE() << "Failed to unpack trace boundary " << path << ": " << e.what());
+    }
+    return state;
+}
+
+td::Result<std::vector<TraceBoundaryState>> read_trace_boundaries(const std::string& dir) {
+    std::vector<TraceBoundaryState> states;
+    try {
+        for (const auto& entry : fs::directory_iterator(dir)) {
+            if (fs::is_regular_file(entry.status()) && entry.path().extension().string() == ".taboundary") {
+                TRY_RESULT(state, read_trace_boundary(entry.path().string()));
+                states.push_back(std::move(state));
+            }
+        }
+    } catch (const std::exception& e) {
+        return td::Status::Error(PSLICE() << "Error while reading trace boundaries from " << dir << ": " << e.what());
+    }
+    std::sort(states.begin(), states.end(), [](const auto& a, const auto& b) {
+        return a.from_seqno < b.from_seqno;
+    });
+    return states;
+}
+
+namespace {
+
+struct TraceGroup {
+    TraceImplPtr root;
+    std::int64_t nodes{0};
+    std::int64_t edges{0};
+    std::int64_t pending_edges{0};
+    ton::BlockSeqno mc_seqno_end{0};
+    std::uint64_t end_lt{0};
+    std::uint32_t end_utime{0};
+    bool broken{false};
+};
+
+}  // namespace
+
+td::Result<TraceStitchResult> stitch_trace_boundaries(const std::vector<TraceBoundaryState>& states) {
+    for (size_t i = 1; i < states.size(); ++i) {
+        if (states[i].from_seqno != states[i - 1].to_seqno + 1) {
+            return td::Status::Error(PSLICE() << "Trace boundaries are not consecutive: range " << states[i - 1].from_seqno << "-"
+                                              << states[i - 1].to_seqno << " is followed by " << states[i].from_seqno << "-" << states[i].to_seqno);
+        }
+    }
+
+    std::unordered_map<td::Bits256, td::Bits256, Bits256Hasher> parent;
+    auto find_root = [&](td::Bits256 trace_id) {
+        auto root = trace_id;
+        for (auto it = parent.find(root); it != parent.end(); it = parent.find(root)) {
+            root = it->second;
+        }
+        for (auto it = parent.find(trace_id); it != parent.end() && it->second != root; it = parent.find(trace_id)) {
+            trace_id = std::exchange(it->second, root);
+        }
+        return root;
+    };
+
+    TraceStitchResult result;
+    // edges left pending by previous ranges: msg hash -> trace id
+    std::unordered_map<td::Bits256, td::Bits256, Bits256Hasher> open_edges;
+    std::unordered_map<td::Bits256, TraceImplPtr, Bits256Hasher> traces;
+    // broken edges per trace and how many of them were joined
+    std::unordered_map<td::Bits256, std::pair<size_t, size_t>, Bits256Hasher> broken_edges;
+    for (const auto& state : states) {
+        for (const auto& [trace_id, trace] : state.pending_traces) {
+            traces[trace_id] = trace;
+        }
+        for (const auto& [msg_hash, edge] : state.pending_edges) {
+            if (!edge.broken) {
+                continue;
+            }
+            auto& counters = broken_edges[edge.trace_id];
+            ++counters.first;
+            auto it = open_edges.find(msg_hash);
+            if (it == open_edges.end()) {
+                continue;
+            }
+            auto root = find_root(it->second);
+            auto child_root = find_root(edge.trace_id);
+            if (root != child_root) {
+                parent[child_root] = root;
+            }
+            ++counters.second;
+            ++result.stitched_edges;
+            open_edges.erase(it);
+        }
+        for (const auto& [msg_hash, edge] : state.pending_edges) {
+            if (!edge.broken) {
+                open_edges[msg_hash] = edge.trace_id;
+            }
+        }
+    }
+
+    std::unordered_map<td::Bits256, TraceGroup, Bits256Hasher> groups;
+    for (const auto& [trace_id, _] : parent) {
+        auto root = find_root(trace_id);
+        result.remap.emplace_back(trace_id, root);
+        groups.try_emplace(root);
+    }
+    for (const auto& [trace_id, trace] : traces) {
+        auto root = find_root(trace_id);
+        auto group_it = groups.find(root);
+        if (group_it == groups.end()) {
+            continue;
+        }
+        auto& group = group_it->second;
+        if (trace_id == root) {
+            group.root = trace;
+        }
+        std::int64_t joined = 0;
+        bool has_unjoined_broken_edges = false;
+        auto broken_it = broken_edges.find(trace_id);
+        if (broken_it != broken_edges.end()) {
+            joined = broken_it->second.second;
+            has_unjoined_broken_edges = broken_it->second.first > broken_it->second.second;
+        }
+        // a joined broken edge was counted as pending on both sides of the boundary
+        group.nodes += trace->nodes;
+        group.edges += trace->edges + joined;
+        group.pending_edges += static_cast<std::int64_t>(trace->pending_edges) - 2 * joined;
+        group.mc_seqno_end = std::max(group.mc_seqno_end, trace->mc_seqno_end);
+        group.end_lt = std::max(group.end_lt, trace->end_lt);
+        group.end_utime = std::max(group.end_utime, trace->end_utime);
+        if (has_unjoined_broken_edges || (trace->state == TraceImpl::State::broken && broken_it == broken_edges.end())) {
+            group.broken = true;
+        }
+    }
+
+    for (auto& [root, group] : groups) {
+        if (!group.root) {
+            return td::Status::Error(PSLICE() << "Stitched trace " << root.to_hex() << " is missing in trace boundaries");
+        }
+        if (group.broken) {
+            ++result.broken_traces;
+            continue;
+        }
+        if (group.pending_edges != 0) {
+            ++result.pending_traces;
+            continue;
+        }
+        TraceImpl merged = *group.root;
+        merged.nodes = group.nodes;
+        merged.edges = group.edges;
+        merged.pending_edges = 0;
+        merged.mc_seqno_end = group.mc_seqno_end;
+        merged.end_lt = group.end_lt;
+        merged.end_utime = group.end_utime;
+        merged.state = TraceImpl::State::complete;
+        result.completed.push_back(merged.to_schema());
+    }
+    return result;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "TraceAssembler.h"
+
+// TraceAssembler state left at the end of a worker's mc seqno range. Traces crossing the range end stay pending
+// here, and their continuation in the next range starts as a broken trace whose broken edge is still pending.
+struct TraceBoundaryState {
+    ton::BlockSeqno from_seqno{0};
+    ton::BlockSeqno to_seqno{0};
+    std::unordered_map<td::Bits256, TraceImplPtr, Bits256Hasher> pending_traces;
+    std::unordered_map<td::Bits256, TraceEdgeImpl, Bits256Hasher> pending_edges;
+};
+
+std::string trace_boundary_path(const std::string& dir, ton::BlockSeqno from_seqno, ton::BlockSeqno to_seqno);
+td::Status write_trace_boundary(const std::string& path, const TraceBoundaryState& state);
+td::Result<TraceBoundaryState> read_trace_boundary(const std::string& path);
+// all .taboundary files of the directory, sorted by range
+td::Result<std::vector<TraceBoundaryState>> read_trace_boundaries(const std::string& dir);
+
+struct TraceStitchResult {
+    // trace id assigned by a later range -> id of the trace it continues
+    std::vector<std::pair<td::Bits256, td::Bits256>> remap;
+    // stitched traces that have no pending edges left
+    std::vector<schema::Trace> completed;
+    size_t stitched_edges{0};
+    size_t pending_traces{0};
+    size_t broken_traces{0};
+};
+
+// Joins broken edges at the start of every range with edges left pending by the previous ranges.
+// Ranges have to be consecutive.
+td::Result<TraceStitchResult> stitch_trace_boundaries(const std::vector<TraceBoundaryState>& states);
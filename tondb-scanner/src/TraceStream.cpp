@@ -0,0 +1,44 @@
+#include "TraceStream.h"
+
+
+void TraceStream::add_sink(td::actor::ActorOwn<TraceStreamSink> sink) {
+    sinks_.push_back(Sink{std::move(sink)});
+}
+
+void TraceStream::publish(ton::BlockSeqno mc_seqno, std::vector<schema::Trace> traces) {
+    auto batch = std::make_shared<const TraceStreamBatch>(TraceStreamBatch{next_seq_++, mc_seqno, std::move(traces)});
+    for (size_t i = 0; i < sinks_.size(); ++i) {
+        auto& sink = sinks_[i];
+        sink.pending.push_back(batch);
+        if (sink.pending.size() > capacity_) {
+            sink.pending.pop_front();
+            if (sink.lost++ % 1000 == 0) {
+                LOG(WARNING) << "Trace stream sink falls behind, " << sink.lost << " batches dropped";
+            }
+        }
+        send_next(i);
+    }
+}
+
+void TraceStream::send_next(size_t sink_index) {
+    auto& sink = sinks_[sink_index];
+    if (sink.busy || sink.pending.empty()) {
+        return;
+    }
+    auto batch = std::move(sink.pending.front());
+    sink.pending.pop_front();
+    sink.busy = true;
+    auto P = td::PromiseCreator::lambda([SelfId = actor_id(this), sink_index, seq = batch->seq](td::Result<td::Unit> R) {
+        td::actor::send_closure(SelfId, &TraceStream::batch_published, sink_index, seq, std::move(R));
+    });
+    td::actor::send_closure(sink.actor, &TraceStreamSink::publish, std::move(batch), std::move(P));
+}
+
+void TraceStream::batch_published(size_t sink_index, std::uint64_t seq, td::Result<td::Unit> result) {
+    if (result.is_error()) {
+        // the stream is best effort, the database stays the source of truth
+        LOG(ERROR) << "Failed to publish trace stream batch " << seq << ": " << result.move_as_error();
+    }
+    sinks_[sink_index].busy = false;
+    send_next(sink_index);
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <deque>
+#include "td/actor/actor.h"
+#include "IndexData.h"
+
+
+// Traces touched by one mc block, published by TraceAssembler as soon as the block is assembled
+struct TraceStreamBatch {
+    std::uint64_t seq;
+    ton::BlockSeqno mc_seqno;
+    std::vector<schema::Trace> traces;  // each trace carries edges added or completed in this block
+};
+using TraceStreamBatchPtr = std::shared_ptr<const TraceStreamBatch>;
+
+// Adapter forwarding published batches out of process. A sink may block, so it runs on its own
+// scheduler and gets one batch at a time, the promise reports the outcome.
+class TraceStreamSink: public td::actor::Actor {
+public:
+    virtual void publish(TraceStreamBatchPtr batch, td::Promise<td::Unit> promise) = 0;
+};
+
+// Fans batches out to the registered sinks. Every sink has a queue of at most capacity batches waiting
+// for it, a sink falling behind loses the oldest ones instead of holding back trace assembly.
+class TraceStream: public td::actor::Actor {
+    struct Sink {
+        td::actor::ActorOwn<TraceStreamSink> actor;
+        std::deque<TraceStreamBatchPtr> pending;
+        bool busy{false};
+        std::uint64_t lost{0};
+    };
+
+    size_t capacity_;
+    std::uint64_t next_seq_{0};
+    std::vector<Sink> sinks_;
+
+    void send_next(size_t sink_index);
+    void batch_published(size_t sink_index, std::uint64_t seq, td::Result<td::Unit> result);
+public:
+    TraceStream(size_t capacity) : capacity_(capacity) {}
+
+    void add_sink(td::actor::ActorOwn<TraceStreamSink> sink);
+    void publish(ton::BlockSeqno mc_seqno, std::vector<schema::Trace> traces);
+};
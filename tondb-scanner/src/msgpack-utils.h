@@ -1,3 +1,4 @@
+#pragma once
 #include <msgpack.hpp>
 #include "crypto/block/block-auto.h"
 #include "crypto/block/block-parse.h"
@@ -57,7 +58,9 @@ namespace msgpack {
     template <>
     struct convert<td::RefInt256> {
       msgpack::object const& operator()(msgpack::object const& o, td::RefInt256& v) const {
-        throw std::runtime_error("Deserializion of td::RefInt256 is not implemented");
+        if (o.type != msgpack::type::STR) throw msgpack::type_error();
+        v = td::dec_string_to_int256(o.as<std::string>());
+        if (v.is_null()) throw std::runtime_error("Failed to deserialize td::RefInt256");
         return o;
       }
     };
@@ -2,11 +2,11 @@
 
 
 QueueState operator+(QueueState l, const QueueState &r) {
-  return QueueState{l.mc_blocks_ + r.mc_blocks_, l.blocks_ + r.blocks_, l.txs_ + r.txs_, l.msgs_ + r.msgs_, l.traces_ + r.traces_};
+  return QueueState{l.mc_blocks_ + r.mc_blocks_, l.blocks_ + r.blocks_, l.txs_ + r.txs_, l.msgs_ + r.msgs_, l.traces_ + r.traces_, l.bytes_ + r.bytes_};
 }
 
 QueueState operator-(QueueState l, const QueueState &r) {
-  return QueueState{l.mc_blocks_ - r.mc_blocks_, l.blocks_ - r.blocks_, l.txs_ - r.txs_, l.msgs_ - r.msgs_, l.traces_ - r.traces_};
+  return QueueState{l.mc_blocks_ - r.mc_blocks_, l.blocks_ - r.blocks_, l.txs_ - r.txs_, l.msgs_ - r.msgs_, l.traces_ - r.traces_, l.bytes_ - r.bytes_};
 }
 
 QueueState& QueueState::operator+=(const QueueState& r) {
@@ -15,6 +15,7 @@ QueueState& QueueState::operator+=(const QueueState& r) {
   txs_ += r.txs_;
   msgs_ += r.msgs_;
   traces_ += r.traces_;
+  bytes_ += r.bytes_;
   return *this;
 }
 
@@ -24,5 +25,6 @@ QueueState& QueueState::operator-=(const QueueState& r) {
   txs_ -= r.txs_;
   msgs_ -= r.msgs_;
   traces_ -= r.traces_;
+  bytes_ -= r.bytes_;
   return *this;
 }
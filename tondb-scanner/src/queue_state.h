@@ -7,6 +7,7 @@ struct QueueState {
   std::int32_t txs_{0};
   std::int32_t msgs_{0};
   std::int32_t traces_{0};
+  std::int64_t bytes_{0};  // estimated memory footprint, 0 in limits means no limit
 
   QueueState& operator+=(const QueueState& r);
   QueueState& operator-=(const QueueState& r);
@@ -15,9 +16,10 @@ struct QueueState {
   friend QueueState operator-(QueueState l, const QueueState& r);
 
   friend inline bool operator==(const QueueState& l, const QueueState& r) {
-    return (l.mc_blocks_ == r.mc_blocks_) && (l.blocks_ == r.blocks_) && (l.txs_ == r.txs_) && (l.msgs_ == r.msgs_);
+    return (l.mc_blocks_ == r.mc_blocks_) && (l.blocks_ == r.blocks_) && (l.txs_ == r.txs_) && (l.msgs_ == r.msgs_) && (l.bytes_ == r.bytes_);
   }
   friend inline bool operator<(const QueueState& l, const QueueState& r) {
-    return (l.mc_blocks_ <= r.mc_blocks_) && (l.blocks_ <= r.blocks_) && (l.txs_ <= r.txs_) && (l.msgs_ <= r.msgs_);
+    return (l.mc_blocks_ <= r.mc_blocks_) && (l.blocks_ <= r.blocks_) && (l.txs_ <= r.txs_) && (l.msgs_ <= r.msgs_)
+        && (r.bytes_ == 0 || l.bytes_ <= r.bytes_);
   }
 };
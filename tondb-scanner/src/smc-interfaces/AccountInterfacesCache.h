@@ -0,0 +1,51 @@
+#pragma once
+#include <array>
+#include <mutex>
+#include "IndexData.h"
+
+
+// Last detected interfaces of an account together with code and data hashes they were detected for.
+// Account states with the same code and data (e.g. only the balance changed) reuse them without running TVM.
+// Only results of detectors depending on nothing but code and data belong here, the others run every time.
+// Sharded by address, a shard is dropped as a whole once it overflows.
+template<typename DetectedInterface>
+class AccountInterfacesCache {
+public:
+  std::optional<std::vector<DetectedInterface>> get(const block::StdAddress& address, const td::Bits256& code_hash, const td::Bits256& data_hash) {
+    auto& shard = shard_for(address);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(address);
+    if (it == shard.entries.end() || it->second.code_hash != code_hash || it->second.data_hash != data_hash) {
+      return std::nullopt;
+    }
+    return it->second.interfaces;
+  }
+
+  void put(const block::StdAddress& address, const td::Bits256& code_hash, const td::Bits256& data_hash, std::vector<DetectedInterface> interfaces) {
+    auto& shard = shard_for(address);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.entries.size() >= max_shard_size && shard.entries.find(address) == shard.entries.end()) {
+      shard.entries.clear();
+    }
+    shard.entries[address] = Entry{code_hash, data_hash, std::move(interfaces)};
+  }
+private:
+  static constexpr size_t shards_count = 64;
+  static constexpr size_t max_shard_size = 8192;
+
+  struct Entry {
+    td::Bits256 code_hash;
+    td::Bits256 data_hash;
+    std::vector<DetectedInterface> interfaces;
+  };
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<block::StdAddress, Entry, AddressHasher> entries;
+  };
+
+  Shard& shard_for(const block::StdAddress& address) {
+    return shards_[AddressHasher()(address) % shards_count];
+  }
+
+  std::array<Shard, shards_count> shards_;
+};
@@ -0,0 +1,211 @@
+#include "DetectionCache.h"
+#include "InterfaceVerdictCache.h"
+
+
+namespace {
+const std::string jetton_master_prefix = "jetton_master:";
+const std::string nft_collection_prefix = "nft_collection:";
+// v1 verdicts counted data-dependent failures too, v2 were keyed by a 64-bit prefix of code hash and
+// detector type names of the compiler, both are dropped
+const std::string interface_verdicts_key = "interface_verdicts_v3";
+
+std::string address_key(const block::StdAddress& address) {
+  return std::to_string(address.workchain) + ":" + address.addr.to_hex();
+}
+
+template <class T>
+std::string pack_entry(const T& entry) {
+  std::stringstream buffer;
+  msgpack::pack(buffer, entry);
+  return buffer.str();
+}
+
+template <class T>
+td::Result<T> unpack_entry(td::Slice value) {
+  try {
+    msgpack::unpacked unpacked;
+    msgpack::unpack(unpacked, value.data(), value.size());
+    T entry;
+    unpacked.get().convert(entry);
+    return entry;
+  } catch (const std::exception& e) {
+    return td::Status::Error(PSLICE() << "Failed to unpack detection cache entry: " << e.what());
+  }
+}
+}
+
+DetectionCache& DetectionCache::instance() {
+  static DetectionCache cache;
+  return cache;
+}
+
+td::Status DetectionCache::open(std::string path) {
+  TRY_RESULT(db, td::RocksDb::open(std::move(path)));
+  auto db_ptr = std::make_unique<td::RocksDb>(std::move(db));
+
+  std::string verdicts;
+  TRY_RESULT(status, db_ptr->get(interface_verdicts_key, verdicts));
+  if (status == td::KeyValue::GetStatus::Ok) {
+    auto S = InterfaceVerdictCache::instance().deserialize(verdicts);
+    if (S.is_error()) {
+      LOG(WARNING) << "Failed to load interface verdicts: " << S;
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  db_ = std::move(db_ptr);
+  return td::Status::OK();
+}
+
+td::Status DetectionCache::flush() {
+  if (!db_) {
+    return td::Status::OK();
+  }
+  std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+  // dirty entries are taken out for the write and put back if it fails, unless updated meanwhile
+  std::map<std::string, JettonMasterEntry> jetton_masters;
+  std::map<std::string, NftCollectionEntry> nft_collections;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::swap(jetton_masters, jetton_masters_.dirty);
+    std::swap(nft_collections, nft_collections_.dirty);
+  }
+  std::vector<std::pair<std::string, std::string>> values;
+  for (const auto& [key, entry] : jetton_masters) {
+    values.emplace_back(jetton_master_prefix + key, pack_entry(entry));
+  }
+  for (const auto& [key, entry] : nft_collections) {
+    values.emplace_back(nft_collection_prefix + key, pack_entry(entry));
+  }
+  values.emplace_back(interface_verdicts_key, InterfaceVerdictCache::instance().serialize());
+
+  auto S = [&]() -> td::Status {
+    TRY_STATUS(db_->begin_write_batch());
+    for (const auto& [key, value] : values) {
+      auto S = db_->set(key, value);
+      if (S.is_error()) {
+        db_->abort_write_batch().ignore();
+        return S;
+      }
+    }
+    return db_->commit_write_batch();
+  }();
+  if (S.is_error()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jetton_masters_.dirty.insert(std::make_move_iterator(jetton_masters.begin()), std::make_move_iterator(jetton_masters.end()));
+    nft_collections_.dirty.insert(std::make_move_iterator(nft_collections.begin()), std::make_move_iterator(nft_collections.end()));
+  }
+  return S;
+}
+
+template <class Entry>
+std::optional<Entry> DetectionCache::get_entry(Entries<Entry>& entries, const std::string& prefix, const std::string& key) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto dirty_it = entries.dirty.find(key);
+    if (dirty_it != entries.dirty.end()) {
+      return dirty_it->second;
+    }
+    auto it = entries.index.find(key);
+    if (it != entries.index.end()) {
+      entries.lru.splice(entries.lru.begin(), entries.lru, it->second);
+      return it->second->second;
+    }
+  }
+  // RocksDB reads are thread-safe, detectors don't wait for each other on a miss
+  std::string value;
+  auto status = db_->get(prefix + key, value);
+  if (status.is_error()) {
+    LOG(WARNING) << "Failed to read detection cache: " << status.move_as_error();
+    return std::nullopt;
+  }
+  if (status.ok() == td::KeyValue::GetStatus::NotFound) {
+    return std::nullopt;
+  }
+  auto entry = unpack_entry<Entry>(value);
+  if (entry.is_error()) {
+    return std::nullopt;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  remember(entries, key, entry.ok());
+  return entry.move_as_ok();
+}
+
+template <class Entry>
+void DetectionCache::remember(Entries<Entry>& entries, const std::string& key, Entry entry) {
+  auto it = entries.index.find(key);
+  if (it != entries.index.end()) {
+    it->second->second = std::move(entry);
+    entries.lru.splice(entries.lru.begin(), entries.lru, it->second);
+    return;
+  }
+  if (capacity == 0) {
+    return;
+  }
+  entries.lru.emplace_front(key, std::move(entry));
+  entries.index[key] = entries.lru.begin();
+  while (entries.lru.size() > capacity) {
+    entries.index.erase(entries.lru.back().first);
+    entries.lru.pop_back();
+  }
+}
+
+std::optional<JettonMasterDetectorR::Result> DetectionCache::get_jetton_master(const block::StdAddress& address, 
+    const td::Bits256& code_hash, const td::Bits256& data_hash) {
+  if (!db_) {
+    return std::nullopt;
+  }
+  auto cached = get_entry(jetton_masters_, jetton_master_prefix, address_key(address));
+  if (!cached || cached->code_hash != code_hash || cached->data_hash != data_hash) {
+    return std::nullopt;
+  }
+  const auto& entry = *cached;
+  JettonMasterDetectorR::Result result;
+  result.address = address;
+  result.total_supply = entry.total_supply;
+  result.mintable = entry.mintable;
+  result.admin_address = entry.admin_address;
+  result.jetton_content = entry.jetton_content;
+  result.jetton_wallet_code_hash = vm::CellHash::from_slice(entry.jetton_wallet_code_hash.as_slice());
+  return result;
+}
+
+void DetectionCache::put_jetton_master(const JettonMasterDetectorR::Result& result, const td::Bits256& code_hash, const td::Bits256& data_hash) {
+  if (!db_) {
+    return;
+  }
+  JettonMasterEntry entry{code_hash, data_hash, result.total_supply, result.mintable, result.admin_address, 
+                          result.jetton_content, td::Bits256(result.jetton_wallet_code_hash.bits())};
+  auto key = address_key(result.address);
+  std::lock_guard<std::mutex> lock(mutex_);
+  remember(jetton_masters_, key, entry);
+  jetton_masters_.dirty[key] = std::move(entry);
+}
+
+std::optional<NftCollectionDetectorR::Result> DetectionCache::get_nft_collection(const block::StdAddress& address, 
+    const td::Bits256& code_hash, const td::Bits256& data_hash) {
+  if (!db_) {
+    return std::nullopt;
+  }
+  auto cached = get_entry(nft_collections_, nft_collection_prefix, address_key(address));
+  if (!cached || cached->code_hash != code_hash || cached->data_hash != data_hash) {
+    return std::nullopt;
+  }
+  const auto& entry = *cached;
+  NftCollectionDetectorR::Result result;
+  result.address = address;
+  result.next_item_index = entry.next_item_index;
+  result.owner_address = entry.owner_address;
+  result.collection_content = entry.collection_content;
+  return result;
+}
+
+void DetectionCache::put_nft_collection(const NftCollectionDetectorR::Result& result, const td::Bits256& code_hash, const td::Bits256& data_hash) {
+  if (!db_) {
+    return;
+  }
+  NftCollectionEntry entry{code_hash, data_hash, result.next_item_index, result.owner_address, result.collection_content};
+  auto key = address_key(result.address);
+  std::lock_guard<std::mutex> lock(mutex_);
+  remember(nft_collections_, key, entry);
+  nft_collections_.dirty[key] = std::move(entry);
+}
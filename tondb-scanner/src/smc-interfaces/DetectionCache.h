@@ -0,0 +1,73 @@
+#pragma once
+#include <list>
+#include <mutex>
+#include "td/db/RocksDb.h"
+#include "msgpack-utils.h"
+#include "Tokens.h"
+
+
+// Detection results that only depend on account code and data, persisted in RocksDB, so a restart doesn't rerun
+// get-methods of every popular master and collection. The last capacity entries of each kind are kept in memory,
+// a miss reads through to RocksDB. Entries not flushed yet stay in memory until the next flush().
+// Interface verdicts of InterfaceVerdictCache are stored in the same database.
+// Disabled until open() is called: get_* return nullopt, put_* are no-op.
+class DetectionCache {
+public:
+  struct JettonMasterEntry {
+    td::Bits256 code_hash;
+    td::Bits256 data_hash;
+    td::RefInt256 total_supply;
+    bool mintable;
+    std::optional<block::StdAddress> admin_address;
+    std::optional<std::map<std::string, std::string>> jetton_content;
+    td::Bits256 jetton_wallet_code_hash;
+
+    MSGPACK_DEFINE(code_hash, data_hash, total_supply, mintable, admin_address, jetton_content, jetton_wallet_code_hash);
+  };
+
+  struct NftCollectionEntry {
+    td::Bits256 code_hash;
+    td::Bits256 data_hash;
+    td::RefInt256 next_item_index;
+    std::optional<block::StdAddress> owner_address;
+    std::optional<std::map<std::string, std::string>> collection_content;
+
+    MSGPACK_DEFINE(code_hash, data_hash, next_item_index, owner_address, collection_content);
+  };
+
+  inline static size_t capacity = 100000;
+
+  static DetectionCache& instance();
+
+  td::Status open(std::string path);
+  td::Status flush();
+  bool is_open() const { return db_ != nullptr; }
+
+  std::optional<JettonMasterDetectorR::Result> get_jetton_master(const block::StdAddress& address, 
+                                                                 const td::Bits256& code_hash, const td::Bits256& data_hash);
+  void put_jetton_master(const JettonMasterDetectorR::Result& result, const td::Bits256& code_hash, const td::Bits256& data_hash);
+
+  std::optional<NftCollectionDetectorR::Result> get_nft_collection(const block::StdAddress& address, 
+                                                                   const td::Bits256& code_hash, const td::Bits256& data_hash);
+  void put_nft_collection(const NftCollectionDetectorR::Result& result, const td::Bits256& code_hash, const td::Bits256& data_hash);
+private:
+  template <class Entry>
+  struct Entries {
+    std::list<std::pair<std::string, Entry>> lru;  // most recent first
+    std::unordered_map<std::string, typename std::list<std::pair<std::string, Entry>>::iterator> index;
+    std::map<std::string, Entry> dirty;
+  };
+
+  DetectionCache() = default;
+
+  template <class Entry>
+  std::optional<Entry> get_entry(Entries<Entry>& entries, const std::string& prefix, const std::string& key);
+  template <class Entry>
+  void remember(Entries<Entry>& entries, const std::string& key, Entry entry);
+
+  std::unique_ptr<td::RocksDb> db_;
+  std::mutex mutex_;
+  std::mutex flush_mutex_;
+  Entries<JettonMasterEntry> jetton_masters_;
+  Entries<NftCollectionEntry> nft_collections_;
+};
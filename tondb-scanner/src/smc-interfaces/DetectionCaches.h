@@ -0,0 +1,9 @@
+#pragma once
+
+
+// Switch of all process-wide caches reusing detection results across accounts and blocks: account interfaces,
+// fast decoders, jetton master fetches, wallet address memo, NFT content, verdicts and the detection cache.
+// Turned off in detection replay, so detected interfaces depend on the block alone and digests are reproducible.
+struct DetectionCaches {
+  inline static bool enabled = true;
+};
@@ -0,0 +1,193 @@
+#include "FastDecoders.h"
+#include "DetectionCaches.h"
+#include "block/block-parse.h"
+
+
+namespace {
+enum JettonWalletLayout {
+  jetton_wallet_standard = 0,    // balance:Coins owner:MsgAddress jetton:MsgAddress wallet_code:^Cell
+  jetton_wallet_stablecoin = 1,  // status:uint4 balance:Coins owner:MsgAddress jetton:MsgAddress
+};
+
+enum NftItemLayout {
+  nft_item_standard = 0,  // index:uint64 collection:MsgAddress owner:MsgAddress content:^Cell
+};
+
+struct KnownCode {
+  const char* code_hash;
+  int layout;
+};
+
+// A code is listed only together with a test in test/tests.cpp checking its decoder against the get-method
+// on a real account state, codes without one go through TVM.
+const std::vector<KnownCode> known_jetton_wallets = {
+  {"c12275085ec7dd21925c33a919680186022c6f2a4ced45dbce3d3e14d438dc0f", jetton_wallet_standard},   // token-contract jetton-wallet.fc
+};
+
+const std::vector<KnownCode> known_nft_items = {};
+
+std::unordered_map<td::Bits256, int, BitArrayHasher> make_layouts(const std::vector<KnownCode>& known) {
+  std::unordered_map<td::Bits256, int, BitArrayHasher> layouts;
+  for (const auto& entry : known) {
+    td::Bits256 code_hash;
+    CHECK(code_hash.from_hex(td::Slice(entry.code_hash)) == 256);
+    layouts.emplace(code_hash, entry.layout);
+  }
+  return layouts;
+}
+
+const std::unordered_map<td::Bits256, int, BitArrayHasher>& jetton_wallet_layouts() {
+  static const auto layouts = make_layouts(known_jetton_wallets);
+  return layouts;
+}
+
+const std::unordered_map<td::Bits256, int, BitArrayHasher>& nft_item_layouts() {
+  static const auto layouts = make_layouts(known_nft_items);
+  return layouts;
+}
+
+td::Result<std::optional<block::StdAddress>> fetch_msg_address(vm::CellSlice& cs) {
+  if (cs.size() >= 2 && cs.prefetch_ulong(2) == 0) {
+    cs.advance(2);
+    return std::nullopt;
+  }
+  ton::WorkchainId workchain;
+  ton::StdSmcAddress addr;
+  if (!block::tlb::t_MsgAddressInt.extract_std_address(cs, workchain, addr)) {
+    return td::Status::Error("Failed to fetch MsgAddressInt");
+  }
+  return block::StdAddress(workchain, addr);
+}
+
+td::Result<block::StdAddress> fetch_std_address(vm::CellSlice& cs) {
+  TRY_RESULT(address, fetch_msg_address(cs));
+  if (!address) {
+    return td::Status::Error("Unexpected addr_none");
+  }
+  return address.value();
+}
+
+td::Result<JettonWalletDataFields> decode_jetton_wallet_layout(int layout, const td::Ref<vm::Cell>& data) {
+  auto cs = vm::load_cell_slice(data);
+  if (layout == jetton_wallet_stablecoin && !cs.advance(4)) {
+    return td::Status::Error("Failed to skip status");
+  }
+  JettonWalletDataFields fields;
+  fields.balance = block::tlb::t_Grams.as_integer_skip(cs);
+  if (fields.balance.is_null()) {
+    return td::Status::Error("Failed to fetch balance");
+  }
+  TRY_RESULT_ASSIGN(fields.owner, fetch_std_address(cs));
+  TRY_RESULT_ASSIGN(fields.jetton, fetch_std_address(cs));
+  if (layout == jetton_wallet_standard && !cs.advance_refs(1)) {
+    return td::Status::Error("Failed to skip wallet code");
+  }
+  if (!cs.empty_ext()) {
+    return td::Status::Error("Unexpected trailing data");
+  }
+  return fields;
+}
+
+td::Result<NftItemDataFields> decode_nft_item_layout(int layout, const td::Ref<vm::Cell>& data) {
+  auto cs = vm::load_cell_slice(data);
+  NftItemDataFields fields;
+  td::uint64 index;
+  if (!cs.fetch_uint_to(64, index)) {
+    return td::Status::Error("Failed to fetch index");
+  }
+  fields.index = td::make_refint(index);
+  TRY_RESULT_ASSIGN(fields.collection_address, fetch_msg_address(cs));
+  TRY_RESULT_ASSIGN(fields.owner_address, fetch_msg_address(cs));
+  if (!cs.fetch_ref_to(fields.content)) {
+    return td::Status::Error("Failed to fetch content");
+  }
+  if (!cs.empty_ext()) {
+    return td::Status::Error("Unexpected trailing data");
+  }
+  return fields;
+}
+
+bool same_fields(const JettonWalletDataFields& lhs, const JettonWalletDataFields& rhs) {
+  return td::cmp(lhs.balance, rhs.balance) == 0 && lhs.owner == rhs.owner && lhs.jetton == rhs.jetton;
+}
+
+bool same_fields(const NftItemDataFields& lhs, const NftItemDataFields& rhs) {
+  return td::cmp(lhs.index, rhs.index) == 0 && lhs.collection_address == rhs.collection_address 
+      && lhs.owner_address == rhs.owner_address && lhs.content->get_hash() == rhs.content->get_hash();
+}
+
+}
+
+FastDecoderRegistry& FastDecoderRegistry::instance() {
+  static FastDecoderRegistry registry;
+  return registry;
+}
+
+std::optional<JettonWalletDataFields> FastDecoderRegistry::decode_jetton_wallet(const td::Bits256& code_hash, const td::Ref<vm::Cell>& data) {
+  if (!DetectionCaches::enabled) {
+    return std::nullopt;
+  }
+  auto it = jetton_wallet_layouts().find(code_hash);
+  if (it == jetton_wallet_layouts().end()) {
+    return std::nullopt;
+  }
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    if (disabled_.count(code_hash)) {
+      return std::nullopt;
+    }
+  }
+  auto fields = decode_jetton_wallet_layout(it->second, data);
+  if (fields.is_error()) {
+    return std::nullopt;
+  }
+  return fields.move_as_ok();
+}
+
+std::optional<NftItemDataFields> FastDecoderRegistry::decode_nft_item(const td::Bits256& code_hash, const td::Ref<vm::Cell>& data) {
+  if (!DetectionCaches::enabled) {
+    return std::nullopt;
+  }
+  auto it = nft_item_layouts().find(code_hash);
+  if (it == nft_item_layouts().end()) {
+    return std::nullopt;
+  }
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    if (disabled_.count(code_hash)) {
+      return std::nullopt;
+    }
+  }
+  auto fields = decode_nft_item_layout(it->second, data);
+  if (fields.is_error()) {
+    return std::nullopt;
+  }
+  return fields.move_as_ok();
+}
+
+bool FastDecoderRegistry::sample_validation() {
+  if (validate_every == 0) {
+    return false;
+  }
+  return decoded_count_.fetch_add(1, std::memory_order_relaxed) % validate_every == 0;
+}
+
+void FastDecoderRegistry::validate_jetton_wallet(const td::Bits256& code_hash, const JettonWalletDataFields& fast_fields, 
+                                                 const JettonWalletDataFields& tvm_fields) {
+  if (same_fields(fast_fields, tvm_fields)) {
+    return;
+  }
+  LOG(ERROR) << "Jetton wallet fast decoder disagrees with get_wallet_data for code " << code_hash.to_hex() << ", disabled";
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  disabled_.insert(code_hash);
+}
+
+void FastDecoderRegistry::validate_nft_item(const td::Bits256& code_hash, const NftItemDataFields& fast_fields, 
+                                            const NftItemDataFields& tvm_fields) {
+  if (same_fields(fast_fields, tvm_fields)) {
+    return;
+  }
+  LOG(ERROR) << "NFT item fast decoder disagrees with get_nft_data for code " << code_hash.to_hex() << ", disabled";
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  disabled_.insert(code_hash);
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <atomic>
+#include <shared_mutex>
+#include <unordered_set>
+#include <block/block.h>
+#include "IndexData.h"
+
+
+struct JettonWalletDataFields {
+  td::RefInt256 balance;
+  block::StdAddress owner;
+  block::StdAddress jetton;
+};
+
+struct NftItemDataFields {
+  td::RefInt256 index;
+  std::optional<block::StdAddress> collection_address;
+  std::optional<block::StdAddress> owner_address;
+  td::Ref<vm::Cell> content;
+};
+
+// Native decoders of data of the reference jetton wallet and NFT item contracts. Only a fixed list of code 
+// hashes is decoded natively, any other code goes through get-methods. With validate_every set, every n-th 
+// natively decoded account is also run in TVM, and a code whose decoder disagrees with it is disabled.
+class FastDecoderRegistry {
+public:
+  inline static std::uint32_t validate_every = 0;
+
+  static FastDecoderRegistry& instance();
+
+  std::optional<JettonWalletDataFields> decode_jetton_wallet(const td::Bits256& code_hash, const td::Ref<vm::Cell>& data);
+  // initialized items only, TVM handles the rest
+  std::optional<NftItemDataFields> decode_nft_item(const td::Bits256& code_hash, const td::Ref<vm::Cell>& data);
+
+  // tells whether a natively decoded account should also be run in TVM
+  bool sample_validation();
+  void validate_jetton_wallet(const td::Bits256& code_hash, const JettonWalletDataFields& fast_fields, const JettonWalletDataFields& tvm_fields);
+  void validate_nft_item(const td::Bits256& code_hash, const NftItemDataFields& fast_fields, const NftItemDataFields& tvm_fields);
+private:
+  FastDecoderRegistry() = default;
+
+  std::atomic<std::uint64_t> decoded_count_{0};
+  std::shared_mutex mutex_;
+  std::unordered_set<td::Bits256, BitArrayHasher> disabled_;
+};
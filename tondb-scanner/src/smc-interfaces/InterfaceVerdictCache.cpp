@@ -0,0 +1,187 @@
+#include <mutex>
+#include <thread>
+#include <msgpack.hpp>
+#include "td/utils/logging.h"
+#include "InterfaceVerdictCache.h"
+#include "InsertManager.h"
+
+
+namespace {
+std::mutex detector_names_mutex;
+std::vector<std::string> detector_names;
+}
+
+InterfaceVerdictCache& InterfaceVerdictCache::instance() {
+  static InterfaceVerdictCache cache;
+  return cache;
+}
+
+size_t InterfaceVerdictCache::detector_index(const char* detector_name) {
+  std::lock_guard<std::mutex> lock(detector_names_mutex);
+  for (size_t i = 0; i < detector_names.size(); ++i) {
+    if (detector_names[i] == detector_name) {
+      return i;
+    }
+  }
+  CHECK(detector_names.size() < max_detectors);
+  detector_names.emplace_back(detector_name);
+  return detector_names.size() - 1;
+}
+
+size_t InterfaceVerdictCache::home_index(const td::Bits256& code_hash) {
+  std::uint64_t prefix;
+  std::memcpy(&prefix, code_hash.data(), sizeof(prefix));
+  return prefix & (table_size - 1);
+}
+
+bool InterfaceVerdictCache::wait_ready(const Slot& slot) {
+  // the claiming thread only copies the hash, the wait is a few instructions long
+  std::uint8_t state;
+  while ((state = slot.state.load(std::memory_order_acquire)) == slot_writing) {
+    std::this_thread::yield();
+  }
+  return state == slot_ready;
+}
+
+const InterfaceVerdictCache::Slot* InterfaceVerdictCache::find(const td::Bits256& code_hash) const {
+  auto home = home_index(code_hash);
+  for (size_t i = 0; i < max_probes; ++i) {
+    const Slot& slot = slots_[(home + i) & (table_size - 1)];
+    if (!wait_ready(slot)) {
+      return nullptr;
+    }
+    if (slot.code_hash == code_hash) {
+      return &slot;
+    }
+  }
+  return nullptr;
+}
+
+InterfaceVerdictCache::Slot* InterfaceVerdictCache::find_or_insert(const td::Bits256& code_hash) {
+  auto home = home_index(code_hash);
+  for (size_t i = 0; i < max_probes; ++i) {
+    Slot& slot = slots_[(home + i) & (table_size - 1)];
+    auto state = slot_empty;
+    if (slot.state.compare_exchange_strong(state, slot_writing, std::memory_order_acq_rel)) {
+      slot.code_hash = code_hash;
+      slot.state.store(slot_ready, std::memory_order_release);
+      used_.fetch_add(1, std::memory_order_relaxed);
+      return &slot;
+    }
+    // claimed by another writer, possibly for the same code hash
+    wait_ready(slot);
+    if (slot.code_hash == code_hash) {
+      return &slot;
+    }
+  }
+  return nullptr;  // probe window is full, the code hash stays uncached
+}
+
+bool InterfaceVerdictCache::is_rejected(const td::Bits256& code_hash, size_t detector) const {
+  auto slot = find(code_hash);
+  if (!slot) {
+    return false;
+  }
+  auto verdict = static_cast<std::uint8_t>(slot->verdicts.load(std::memory_order_relaxed) >> (detector * 8));
+  if ((verdict & negative_bit) == 0) {
+    return false;
+  }
+  thread_local std::uint32_t rejected_checks = 0;
+  return ++rejected_checks % reprobe_interval != 0;
+}
+
+void InterfaceVerdictCache::record_match(const td::Bits256& code_hash, size_t detector) {
+  update(code_hash, detector, true);
+}
+
+void InterfaceVerdictCache::record_failure(const td::Bits256& code_hash, size_t detector, const td::Status& error) {
+  // only a missing get-method depends on the code alone
+  if (error.code() != ErrorCode::INTERFACE_NOT_IMPLEMENTED) {
+    return;
+  }
+  update(code_hash, detector, false);
+}
+
+void InterfaceVerdictCache::update(const td::Bits256& code_hash, size_t detector, bool matched) {
+  auto slot = find_or_insert(code_hash);
+  if (!slot) {
+    return;
+  }
+  auto shift = detector * 8;
+  auto threshold = failure_threshold_.load(std::memory_order_relaxed);
+  auto verdicts = slot->verdicts.load(std::memory_order_relaxed);
+  while (true) {
+    auto verdict = static_cast<std::uint8_t>(verdicts >> shift);
+    std::uint8_t new_verdict;
+    if (matched) {
+      new_verdict = positive_bit;
+    } else if (verdict & positive_bit) {
+      return;
+    } else {
+      std::uint8_t counter = verdict & counter_mask;
+      if (counter < counter_mask) {
+        ++counter;
+      }
+      new_verdict = counter | (counter >= threshold ? negative_bit : 0);
+    }
+    if (new_verdict == verdict) {
+      return;
+    }
+    auto new_verdicts = (verdicts & ~(std::uint64_t{0xff} << shift)) | (std::uint64_t{new_verdict} << shift);
+    if (slot->verdicts.compare_exchange_weak(verdicts, new_verdicts, std::memory_order_relaxed)) {
+      return;
+    }
+  }
+}
+
+std::string InterfaceVerdictCache::serialize() const {
+  std::map<std::string, std::vector<std::string>> rejected;
+  {
+    std::lock_guard<std::mutex> lock(detector_names_mutex);
+    for (size_t i = 0; i < table_size; ++i) {
+      if (slots_[i].state.load(std::memory_order_acquire) != slot_ready) {
+        continue;
+      }
+      auto verdicts = slots_[i].verdicts.load(std::memory_order_relaxed);
+      for (size_t detector = 0; detector < detector_names.size(); ++detector) {
+        if (static_cast<std::uint8_t>(verdicts >> (detector * 8)) & negative_bit) {
+          rejected[detector_names[detector]].push_back(slots_[i].code_hash.as_slice().str());
+        }
+      }
+    }
+  }
+  std::stringstream buffer;
+  msgpack::pack(buffer, rejected);
+  return buffer.str();
+}
+
+td::Status InterfaceVerdictCache::deserialize(td::Slice data) {
+  std::map<std::string, std::vector<std::string>> rejected;
+  try {
+    msgpack::unpacked unpacked;
+    msgpack::unpack(unpacked, data.data(), data.size());
+    unpacked.get().convert(rejected);
+  } catch (const std::exception& e) {
+    return td::Status::Error(PSLICE() << "Failed to unpack interface verdicts: " << e.what());
+  }
+
+  size_t count = 0;
+  for (const auto& [detector_name, keys] : rejected) {
+    auto shift = detector_index(detector_name.c_str()) * 8;
+    for (const auto& key : keys) {
+      if (key.size() != td::Bits256::size() / 8) {
+        continue;
+      }
+      td::Bits256 code_hash;
+      code_hash.as_slice().copy_from(key);
+      auto slot = find_or_insert(code_hash);
+      if (!slot) {
+        continue;
+      }
+      slot->verdicts.fetch_or(std::uint64_t{negative_bit | counter_mask} << shift, std::memory_order_relaxed);
+      ++count;
+    }
+  }
+  LOG(INFO) << "Loaded " << count << " rejected interface verdicts";
+  return td::Status::OK();
+}
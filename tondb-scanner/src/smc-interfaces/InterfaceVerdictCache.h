@@ -0,0 +1,70 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include "td/utils/Status.h"
+#include "crypto/common/bitstring.h"
+
+
+// Cache of interface detection verdicts keyed by code hash, shared by all detectors of the indexer.
+// Off unless enabled is set: only the indexer persists verdicts and turns it on, other tools detect every account.
+// Each slot keeps one byte per detector: positive flag, negative flag and a saturating counter of 
+// INTERFACE_NOT_IMPLEMENTED failures, i.e. get-methods missing from the code. Failures depending on the data
+// (TVM exceptions, out of gas, unexpected stack) are not counted. A code hash is rejected for a detector after
+// failure_threshold failures without a single match, so detection of plain wallets doesn't run get-methods that
+// can never succeed. Every reprobe_interval-th check of a rejected code runs the detector anyway, a match clears
+// the rejection. Slots are claimed and updated with CAS only, the table is never resized.
+// Detectors are identified by Detector::name, the name is persisted together with the verdicts.
+class InterfaceVerdictCache {
+public:
+  static constexpr size_t max_detectors = 8;
+  static constexpr std::uint32_t reprobe_interval = 1024;
+
+  inline static bool enabled = false;
+
+  static InterfaceVerdictCache& instance();
+
+  // index of a detector name in verdict bytes of this process, assigned on first use
+  static size_t detector_index(const char* detector_name);
+
+  bool is_rejected(const td::Bits256& code_hash, size_t detector) const;
+  void record_match(const td::Bits256& code_hash, size_t detector);
+  void record_failure(const td::Bits256& code_hash, size_t detector, const td::Status& error);
+
+  void set_failure_threshold(std::uint8_t threshold) { failure_threshold_ = threshold; }
+
+  // negative verdicts only, positive ones are cheap to relearn
+  std::string serialize() const;
+  td::Status deserialize(td::Slice data);
+
+  size_t size() const { return used_.load(std::memory_order_relaxed); }
+private:
+  static constexpr size_t table_size = 1 << 18;
+  static constexpr size_t max_probes = 32;
+
+  static constexpr std::uint8_t positive_bit = 0x80;
+  static constexpr std::uint8_t negative_bit = 0x40;
+  static constexpr std::uint8_t counter_mask = 0x3f;
+
+  static constexpr std::uint8_t slot_empty = 0;
+  static constexpr std::uint8_t slot_writing = 1;
+  static constexpr std::uint8_t slot_ready = 2;
+
+  // code_hash is written once by the thread claiming the slot and read only after state is slot_ready
+  struct Slot {
+    std::atomic<std::uint8_t> state{slot_empty};
+    td::Bits256 code_hash;
+    std::atomic<std::uint64_t> verdicts{0};
+  };
+
+  InterfaceVerdictCache() : slots_(new Slot[table_size]) {}
+
+  static size_t home_index(const td::Bits256& code_hash);
+  static bool wait_ready(const Slot& slot);
+  const Slot* find(const td::Bits256& code_hash) const;
+  Slot* find_or_insert(const td::Bits256& code_hash);
+  void update(const td::Bits256& code_hash, size_t detector, bool matched);
+
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<size_t> used_{0};
+  std::atomic<std::uint8_t> failure_threshold_{3};
+};
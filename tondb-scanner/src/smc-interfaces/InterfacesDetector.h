@@ -1,10 +1,13 @@
 #pragma once
 #include <block/block.h>
 #include <td/actor/actor.h>
-#include "td/actor/MultiPromise.h"
+#include <array>
 #include <mc-config.h>
 #include "Tokens.h"
 #include "NftSale.h"
+#include "InterfaceVerdictCache.h"
+#include "DetectionCaches.h"
+#include "execute-smc.h"
 
 template<typename... Detectors>
 class InterfacesDetector: public td::actor::Actor {
@@ -16,22 +19,25 @@ public:
                     td::Ref<vm::Cell> data_cell, 
                     AllShardStates shard_states,
                     std::shared_ptr<block::ConfigInfo> config,
-                    td::Promise<std::vector<DetectedInterface>> promise) :
+                    td::Promise<std::vector<DetectedInterface>> promise,
+                    GetMethodContext context = {},
+                    bool skip_code_and_data_only = false) :
       address_(std::move(address)), code_cell_(std::move(code_cell)), data_cell_(std::move(data_cell)), 
-      shard_states_(std::move(shard_states)), config_(std::move(config)), promise_(std::move(promise)) {
-  found_interfaces_ = std::make_shared<std::vector<DetectedInterface>>();
-}
+      shard_states_(std::move(shard_states)), config_(std::move(config)), context_(context), 
+      skip_code_and_data_only_(skip_code_and_data_only), promise_(std::move(promise)) {}
 
-  void start_up() override {
-    auto P = td::PromiseCreator::lambda([&, SelfId=actor_id(this)](td::Result<td::Unit> res) mutable {
-      td::actor::send_closure(SelfId, &InterfacesDetector::finish, std::move(res));
-    });
-
-    td::MultiPromise mp;
-    auto ig = mp.init_guard();
-    ig.add_promise(std::move(P));
+  // interfaces found by detectors depending only on code and data, they can be reused for the same code and data
+  static bool is_code_and_data_only(const DetectedInterface& interface) {
+    static constexpr std::array<bool, sizeof...(Detectors)> code_and_data_only{Detectors::code_and_data_only...};
+    return code_and_data_only[interface.index()];
+  }
 
-    start_detection<Detectors...>(ig);
+  void start_up() override {
+    GetMethodRunner::ContextScope context_scope(context_);
+    std::vector<DetectedInterface> found_interfaces;
+    (detect_interface<Detectors>(found_interfaces), ...);
+    promise_.set_value(std::move(found_interfaces));
+    stop();
   }
 private:
   block::StdAddress address_;
@@ -39,42 +45,40 @@ private:
   td::Ref<vm::Cell> data_cell_;
   AllShardStates shard_states_;
   std::shared_ptr<block::ConfigInfo> config_;
+  GetMethodContext context_;
+  // results of these detectors are already known, only the rest runs
+  bool skip_code_and_data_only_;
 
-  std::shared_ptr<std::vector<DetectedInterface>> found_interfaces_;
   td::Promise<std::vector<DetectedInterface>> promise_;
 
-  template<typename FirstDetector, typename... RemainingDetectors>
-  void start_detection(td::MultiPromise::InitGuard& ig) {
-    detect_interface<FirstDetector>(ig.get_promise());
-
-    if constexpr (sizeof...(RemainingDetectors) > 0) {
-        start_detection<RemainingDetectors...>(ig);
+  // detectors are plain synchronous calls, the whole account is detected in one actor run
+  template<typename Detector>
+  void detect_interface(std::vector<DetectedInterface>& found_interfaces) {
+    if (skip_code_and_data_only_ && Detector::code_and_data_only) {
+      return;
+    }
+    static const size_t detector_index = InterfaceVerdictCache::detector_index(Detector::name);
+    auto& verdict_cache = InterfaceVerdictCache::instance();
+    td::Bits256 code_hash;
+    bool use_verdicts = InterfaceVerdictCache::enabled && DetectionCaches::enabled && code_cell_.not_null();
+    if (use_verdicts) {
+      code_hash = code_cell_->get_hash().bits();
+      if (verdict_cache.is_rejected(code_hash, detector_index)) {
+        return;
+      }
     }
-  }
 
-  template<typename Detector>
-  void detect_interface(td::Promise<td::Unit> promise) {
-    auto P = td::PromiseCreator::lambda([&, SelfId = actor_id(this), promise = std::move(promise)](td::Result<typename Detector::Result> data) mutable {
+    auto data = Detector(address_, code_cell_, data_cell_, shard_states_, config_).detect();
+    if (use_verdicts) {
       if (data.is_ok()) {
-        LOG(DEBUG) << "Detected interface " << typeid(typename Detector::Result).name() << " for " << address_;
-        send_lambda(SelfId, [this, data = data.move_as_ok(), promise = std::move(promise)]() mutable {
-          found_interfaces_->push_back(data);
-          promise.set_value(td::Unit());
-        });
+        verdict_cache.record_match(code_hash, detector_index);
       } else {
-        promise.set_value(td::Unit());
+        verdict_cache.record_failure(code_hash, detector_index, data.error());
       }
-    });
-    td::actor::create_actor<Detector>(td::Slice(typeid(Detector).name()), address_, code_cell_, data_cell_, shard_states_, config_, std::move(P)).release();
-  }
-
-  void finish(td::Result<td::Unit> res) {
-    if (res.is_error()) {
-      promise_.set_error(res.move_as_error_prefix("Failed to detect interfaces: "));
-    } else {
-      promise_.set_value(std::move(*found_interfaces_));
     }
-    stop();
+    if (data.is_ok()) {
+      LOG(DEBUG) << "Detected interface " << typeid(typename Detector::Result).name() << " for " << address_;
+      found_interfaces.push_back(data.move_as_ok());
+    }
   }
 };
-
@@ -1,12 +1,14 @@
 #pragma once
 #include <block/block.h>
-#include <td/actor/actor.h>
 #include <mc-config.h>
 
 using AllShardStates = std::vector<td::Ref<vm::Cell>>;
 
-class GetGemsNftFixPriceSale: public td::actor::Actor {
+class GetGemsNftFixPriceSale {
 public:
+  static constexpr const char* name = "getgems_nft_fix_price_sale";
+  // result depends only on code and data of the account
+  static constexpr bool code_and_data_only = true;
   struct Result {
     block::StdAddress address;
     bool is_complete;
@@ -24,23 +26,24 @@ public:
   GetGemsNftFixPriceSale(block::StdAddress address, 
                        td::Ref<vm::Cell> code_cell,
                        td::Ref<vm::Cell> data_cell, 
-                       AllShardStates shard_states,
-                       std::shared_ptr<block::ConfigInfo> config,
-                       td::Promise<Result> promise);
+                       const AllShardStates& shard_states,
+                       std::shared_ptr<block::ConfigInfo> config);
 
-  void start_up() override;
+  td::Result<Result> detect();
 
 private:
   block::StdAddress address_;
   td::Ref<vm::Cell> code_cell_;
   td::Ref<vm::Cell> data_cell_;
-  AllShardStates shard_states_;
+  const AllShardStates& shard_states_;
   std::shared_ptr<block::ConfigInfo> config_;
-  td::Promise<Result> promise_;
 };
 
-class GetGemsNftAuction: public td::actor::Actor {
+class GetGemsNftAuction {
 public:
+  static constexpr const char* name = "getgems_nft_auction";
+  // auction state depends on block time, so results are not reused by code and data hashes
+  static constexpr bool code_and_data_only = false;
   struct Result {
     block::StdAddress address;
     bool end;
@@ -65,17 +68,15 @@ public:
   GetGemsNftAuction(block::StdAddress address, 
                        td::Ref<vm::Cell> code_cell,
                        td::Ref<vm::Cell> data_cell, 
-                       AllShardStates shard_states,
-                       std::shared_ptr<block::ConfigInfo> config,
-                       td::Promise<Result> promise);
+                       const AllShardStates& shard_states,
+                       std::shared_ptr<block::ConfigInfo> config);
 
-  void start_up() override;
+  td::Result<Result> detect();
 
 private:
   block::StdAddress address_;
   td::Ref<vm::Cell> code_cell_;
   td::Ref<vm::Cell> data_cell_;
-  AllShardStates shard_states_;
+  const AllShardStates& shard_states_;
   std::shared_ptr<block::ConfigInfo> config_;
-  td::Promise<Result> promise_;
 };
@@ -1,3 +1,6 @@
+#include <deque>
+#include <map>
+#include <mutex>
 #include "td/actor/actor.h"
 #include "vm/cells/Cell.h"
 #include "IndexData.h"
@@ -6,141 +9,297 @@
 #include "Tokens.h"
 #include "parse_token_data.h"
 #include "smc-interfaces/execute-smc.h"
+#include "InsertManager.h"
+#include "DetectionCache.h"
+#include "DetectionCaches.h"
+#include "FastDecoders.h"
 #include "tokens.h"
 #include "common/checksum.h"
 
 
-class FetchAccountFromShardV2: public td::actor::Actor {
-private:
-  AllShardStates shard_states_;
-  block::StdAddress address_;
-  td::Promise<schema::AccountState> promise_;
-public:
-  FetchAccountFromShardV2(AllShardStates shard_states, block::StdAddress address, td::Promise<schema::AccountState> promise) 
-    : shard_states_(shard_states), address_(address), promise_(std::move(promise)) {
-  }
+td::Result<schema::AccountState> fetch_account_from_shards(const AllShardStates& shard_states, const block::StdAddress& address) {
+  for (auto& root : shard_states) {
+    block::gen::ShardStateUnsplit::Record sstate;
+    if (!tlb::unpack_cell(root, sstate)) {
+      return td::Status::Error("Failed to unpack ShardStateUnsplit");
+    }
+    if (!ton::shard_contains(ton::ShardIdFull(block::ShardId(sstate.shard_id)), ton::extract_addr_prefix(address.workchain, address.addr))) {
+      continue;
+    }
 
-  void start_up() override {
-    for (auto& root : shard_states_) {
-      block::gen::ShardStateUnsplit::Record sstate;
-      if (!tlb::unpack_cell(root, sstate)) {
-        promise_.set_error(td::Status::Error("Failed to unpack ShardStateUnsplit"));
-        stop();
-        return;
-      }
-      if (!ton::shard_contains(ton::ShardIdFull(block::ShardId(sstate.shard_id)), ton::extract_addr_prefix(address_.workchain, address_.addr))) {
-        continue;
-      }
+    vm::AugmentedDictionary accounts_dict{vm::load_cell_slice_ref(sstate.accounts), 256, block::tlb::aug_ShardAccounts};
+    
+    auto shard_account_csr = accounts_dict.lookup(address.addr);
+    if (shard_account_csr.is_null()) {
+      return td::Status::Error("Account not found in accounts_dict");
+    } 
+    
+    block::gen::ShardAccount::Record acc_info;
+    if(!tlb::csr_unpack(std::move(shard_account_csr), acc_info)) {
+      LOG(ERROR) << "Failed to unpack ShardAccount " << address.addr;
+      return td::Status::Error("Failed to unpack ShardAccount");
+    }
+    int account_tag = block::gen::t_Account.get_tag(vm::load_cell_slice(acc_info.account));
+    switch (account_tag) {
+    case block::gen::Account::account_none:
+      return td::Status::Error("Account is empty");
+    case block::gen::Account::account:
+      return ParseQuery::parse_account(acc_info.account, sstate.gen_utime, acc_info.last_trans_hash, acc_info.last_trans_lt);
+    default:
+      return td::Status::Error("Unknown account tag");
+    }
+  }
+  return td::Status::Error("Account not found in shards");
+}
 
-      vm::AugmentedDictionary accounts_dict{vm::load_cell_slice_ref(sstate.accounts), 256, block::tlb::aug_ShardAccounts};
-      
-      auto shard_account_csr = accounts_dict.lookup(address_.addr);
-      if (shard_account_csr.is_null()) {
-        promise_.set_error(td::Status::Error("Account not found in accounts_dict"));
-        stop();
-        return;
-      } 
-      
-      block::gen::ShardAccount::Record acc_info;
-      if(!tlb::csr_unpack(std::move(shard_account_csr), acc_info)) {
-        LOG(ERROR) << "Failed to unpack ShardAccount " << address_.addr;
-        stop();
-        return;
-      }
-      int account_tag = block::gen::t_Account.get_tag(vm::load_cell_slice(acc_info.account));
-      switch (account_tag) {
-      case block::gen::Account::account_none:
-        promise_.set_error(td::Status::Error("Account is empty"));
-        stop();
-        return;
-      case block::gen::Account::account: {
-        auto account_r = ParseQuery::parse_account(acc_info.account, sstate.gen_utime, acc_info.last_trans_hash, acc_info.last_trans_lt);
-        if (account_r.is_error()) {
-          promise_.set_error(account_r.move_as_error());
-          stop();
-          return;
+// Code and data of jetton masters fetched per mc block. Wallets of the same master touched in one block
+// share a single shard lookup. Blocks are detected in parallel, so entries of the last max_blocks blocks are kept,
+// each keyed by the hash of its masterchain state (the first of shard_states, one per mc seqno).
+class JettonMasterFetchCache {
+public:
+  td::Result<std::pair<td::Ref<vm::Cell>, td::Ref<vm::Cell>>> get(const AllShardStates& shard_states, const block::StdAddress& master) {
+    if (shard_states.empty()) {
+      return td::Status::Error("No shard states");
+    }
+    if (!DetectionCaches::enabled) {
+      TRY_RESULT(account, fetch_account_from_shards(shard_states, master));
+      return std::make_pair(account.code, account.data);
+    }
+    td::Bits256 block_key(shard_states[0]->get_hash().bits());
+    auto key = std::to_string(master.workchain) + ":" + master.addr.to_hex();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto block_it = blocks_.find(block_key);
+      if (block_it != blocks_.end()) {
+        auto it = block_it->second.find(key);
+        if (it != block_it->second.end()) {
+          return it->second;
         }
-        promise_.set_value(account_r.move_as_ok());
-        stop();
-        return;
       }
-      default:
-        promise_.set_error(td::Status::Error("Unknown account tag"));
-        stop();
-        return;
+    }
+    TRY_RESULT(account, fetch_account_from_shards(shard_states, master));
+    auto value = std::make_pair(account.code, account.data);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto block_it = blocks_.find(block_key);
+    if (block_it == blocks_.end()) {
+      if (blocks_order_.size() >= max_blocks) {
+        blocks_.erase(blocks_order_.front());
+        blocks_order_.pop_front();
       }
+      block_it = blocks_.emplace(block_key, Masters{}).first;
+      blocks_order_.push_back(block_key);
+    }
+    if (block_it->second.size() < max_masters) {
+      block_it->second.emplace(std::move(key), value);
     }
-    promise_.set_error(td::Status::Error("Account not found in shards"));
-    stop();
+    return value;
   }
+private:
+  static constexpr size_t max_blocks = 16;
+  static constexpr size_t max_masters = 4096;
+
+  using Masters = std::unordered_map<std::string, std::pair<td::Ref<vm::Cell>, td::Ref<vm::Cell>>>;
+
+  std::mutex mutex_;
+  std::map<td::Bits256, Masters> blocks_;
+  std::deque<td::Bits256> blocks_order_;  // oldest first
 };
 
+// get_wallet_address results memoised across blocks by (master, master code hash, owner). Master data changes
+// with every mint and burn while the wallet address doesn't, so the data hash is not part of the key.
+// A memoised address equal to the wallet's one confirms the wallet without running the master's code.
+class JettonWalletAddressMemo {
+public:
+  std::optional<block::StdAddress> get(const block::StdAddress& master, const td::Bits256& master_code_hash,
+                                       const block::StdAddress& owner) {
+    if (!DetectionCaches::enabled) {
+      return std::nullopt;
+    }
+    auto key = make_key(master, master_code_hash, owner);
+    auto& shard = shards_[std::hash<std::string>{}(key) % shards_count];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.wallets.find(key);
+    if (it == shard.wallets.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  void put(const block::StdAddress& master, const td::Bits256& master_code_hash,
+           const block::StdAddress& owner, const block::StdAddress& wallet) {
+    if (!DetectionCaches::enabled) {
+      return;
+    }
+    auto key = make_key(master, master_code_hash, owner);
+    auto& shard = shards_[std::hash<std::string>{}(key) % shards_count];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.wallets.size() >= max_shard_size) {
+      shard.wallets.clear();
+    }
+    shard.wallets[std::move(key)] = wallet;
+  }
+private:
+  static constexpr size_t shards_count = 64;
+  static constexpr size_t max_shard_size = 4096;
+
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<std::string, block::StdAddress> wallets;
+  };
+
+  static std::string make_key(const block::StdAddress& master, const td::Bits256& master_code_hash,
+                              const block::StdAddress& owner) {
+    td::StringBuilder sb;
+    sb << master.workchain << ":" << master.addr.to_hex() << ":" << master_code_hash.to_hex() << ":"
+       << owner.workchain << ":" << owner.addr.to_hex();
+    return sb.as_cslice().str();
+  }
+
+  std::array<Shard, shards_count> shards_;
+};
+
+// Parsed get_nft_content results by (collection, collection code and data hashes, index, individual content hash).
+// Items change owner far more often than content, so transfer waves resolve the same metadata over and over.
+class NftContentCache {
+public:
+  using Content = std::map<std::string, std::string>;
+
+  std::optional<Content> get(const block::StdAddress& collection, const td::Ref<vm::Cell>& collection_code, const td::Ref<vm::Cell>& collection_data, 
+                             const td::RefInt256& index, const td::Ref<vm::Cell>& ind_content) {
+    if (!DetectionCaches::enabled) {
+      return std::nullopt;
+    }
+    auto key = make_key(collection, collection_code, collection_data, index, ind_content);
+    auto& shard = shards_[std::hash<std::string>{}(key) % shards_count];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.contents.find(key);
+    if (it == shard.contents.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  void put(const block::StdAddress& collection, const td::Ref<vm::Cell>& collection_code, const td::Ref<vm::Cell>& collection_data, 
+           const td::RefInt256& index, const td::Ref<vm::Cell>& ind_content, const Content& content) {
+    if (!DetectionCaches::enabled) {
+      return;
+    }
+    size_t content_size = 0;
+    for (const auto& [k, v] : content) {
+      content_size += k.size() + v.size();
+    }
+    if (content_size > max_content_size) {
+      return;
+    }
+    auto key = make_key(collection, collection_code, collection_data, index, ind_content);
+    auto& shard = shards_[std::hash<std::string>{}(key) % shards_count];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.contents.size() >= max_shard_size) {
+      shard.contents.clear();
+    }
+    shard.contents[std::move(key)] = content;
+  }
+private:
+  static constexpr size_t shards_count = 64;
+  static constexpr size_t max_shard_size = 1024;
+  static constexpr size_t max_content_size = 16 << 10;
+
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<std::string, Content> contents;
+  };
+
+  // index is a part of the key since get_nft_content takes it and collections are free to use it
+  static std::string make_key(const block::StdAddress& collection, const td::Ref<vm::Cell>& collection_code, const td::Ref<vm::Cell>& collection_data, 
+                              const td::RefInt256& index, const td::Ref<vm::Cell>& ind_content) {
+    td::StringBuilder sb;
+    sb << collection.workchain << ":" << collection.addr.to_hex() << ":" << collection_code->get_hash().to_hex() << ":" 
+       << collection_data->get_hash().to_hex() << ":" << index->to_dec_string() << ":" << ind_content->get_hash().to_hex();
+    return sb.as_cslice().str();
+  }
+
+  std::array<Shard, shards_count> shards_;
+};
+
+static JettonMasterFetchCache jetton_master_fetch_cache;
+static JettonWalletAddressMemo jetton_wallet_address_memo;
+static NftContentCache nft_content_cache;
 
 
 JettonWalletDetectorR::JettonWalletDetectorR(block::StdAddress address, 
                       td::Ref<vm::Cell> code_cell,
                       td::Ref<vm::Cell> data_cell, 
-                      AllShardStates shard_states,
-                      std::shared_ptr<block::ConfigInfo> config,
-                      td::Promise<Result> promise)
+                      const AllShardStates& shard_states,
+                      std::shared_ptr<block::ConfigInfo> config)
   : address_(std::move(address)), code_cell_(std::move(code_cell)), data_cell_(std::move(data_cell)),
-    shard_states_(std::move(shard_states)), config_(std::move(config)), promise_(std::move(promise)) {}
+    shard_states_(shard_states), config_(std::move(config)) {}
 
-void JettonWalletDetectorR::start_up() {
+td::Result<JettonWalletDetectorR::Result> JettonWalletDetectorR::detect() {
   if (code_cell_.is_null() || data_cell_.is_null()) {
-    promise_.set_error(td::Status::Error("Code or data null"));
-    stop();
-    return;
+    return td::Status::Error("Code or data null");
   }
 
-  auto stack_r = execute_smc_method<4>(address_, code_cell_, data_cell_, config_, "get_wallet_data", {},
-    {vm::StackEntry::Type::t_int, vm::StackEntry::Type::t_slice, vm::StackEntry::Type::t_slice, vm::StackEntry::Type::t_cell});
-  if (stack_r.is_error()) {
-    promise_.set_error(stack_r.move_as_error());
-    stop();
-    return;
-  }
-  auto stack = stack_r.move_as_ok();
   Result data;
   data.address = address_;
-  data.balance = stack[0].as_int();
-  auto owner = convert::to_std_address(stack[1].as_slice());
-  if (owner.is_error()) {
-    promise_.set_error(owner.move_as_error());
-    return;
-  }
-  data.owner = owner.move_as_ok();
-  auto jetton = convert::to_std_address(stack[2].as_slice());
-  if (jetton.is_error()) {
-    promise_.set_error(jetton.move_as_error());
-    return;
-  }
-  data.jetton = jetton.move_as_ok();
-  
-  auto is_claimed_stack_r = execute_smc_method<1>(address_, code_cell_, data_cell_, config_, "is_claimed", {},
-    {vm::StackEntry::Type::t_int});
-  if (is_claimed_stack_r.is_ok()) {
-    auto is_claimed_stack = is_claimed_stack_r.move_as_ok();
-    data.mintless_is_claimed = is_claimed_stack[0].as_int()->to_long() != 0;
+  td::Bits256 code_hash(code_cell_->get_hash().bits());
+  auto& fast_decoders = FastDecoderRegistry::instance();
+  auto fast_fields = fast_decoders.decode_jetton_wallet(code_hash, data_cell_);
+  if (fast_fields && !fast_decoders.sample_validation()) {
+    data.balance = std::move(fast_fields->balance);
+    data.owner = fast_fields->owner;
+    data.jetton = fast_fields->jetton;
   } else {
-    data.mintless_is_claimed = std::nullopt;
+    auto stack_r = execute_smc_method<4>(address_, code_cell_, data_cell_, config_, "get_wallet_data", {},
+      {vm::StackEntry::Type::t_int, vm::StackEntry::Type::t_slice, vm::StackEntry::Type::t_slice, vm::StackEntry::Type::t_cell});
+    if (stack_r.is_error()) {
+      return stack_r.move_as_error();
+    }
+    auto stack = stack_r.move_as_ok();
+    data.balance = stack[0].as_int();
+    auto owner = convert::to_std_address(stack[1].as_slice());
+    if (owner.is_error()) {
+      return owner.move_as_error();
+    }
+    data.owner = owner.move_as_ok();
+    auto jetton = convert::to_std_address(stack[2].as_slice());
+    if (jetton.is_error()) {
+      return jetton.move_as_error();
+    }
+    data.jetton = jetton.move_as_ok();
+    if (fast_fields) {
+      fast_decoders.validate_jetton_wallet(code_hash, fast_fields.value(), JettonWalletDataFields{data.balance, data.owner, data.jetton});
+    }
   }
 
-  auto R = td::PromiseCreator::lambda([=, SelfId = actor_id(this)](td::Result<schema::AccountState> account_state_r) mutable {
-    if (account_state_r.is_error()) {
-      promise_.set_error(account_state_r.move_as_error());
-      stop();
-      return;
+  // reference wallets have no is_claimed, mintless ones are never decoded natively
+  data.mintless_is_claimed = std::nullopt;
+  if (!fast_fields) {
+    auto is_claimed_stack_r = execute_smc_method<1>(address_, code_cell_, data_cell_, config_, "is_claimed", {},
+      {vm::StackEntry::Type::t_int});
+    if (is_claimed_stack_r.is_ok()) {
+      auto is_claimed_stack = is_claimed_stack_r.move_as_ok();
+      data.mintless_is_claimed = is_claimed_stack[0].as_int()->to_long() != 0;
     }
-    auto account_state = account_state_r.move_as_ok();
-    td::actor::send_closure(SelfId, &JettonWalletDetectorR::verify_with_master, account_state.code, account_state.data, data);
-  });
-  td::actor::create_actor<FetchAccountFromShardV2>("fetchaccountfromshard", shard_states_, data.jetton, std::move(R)).release();
+  }
+
+  auto master_r = jetton_master_fetch_cache.get(shard_states_, data.jetton);
+  if (master_r.is_error()) {
+    return master_r.move_as_error();
+  }
+  auto master = master_r.move_as_ok();
+  return verify_with_master(master.first, master.second, std::move(data));
 }
 
-void JettonWalletDetectorR::verify_with_master(td::Ref<vm::Cell> master_code, td::Ref<vm::Cell> master_data, Result jetton_wallet_data) {
-  ton::SmartContract smc({master_code, master_data});
-  ton::SmartContract::Args args;
+td::Result<JettonWalletDetectorR::Result> JettonWalletDetectorR::verify_with_master(td::Ref<vm::Cell> master_code, td::Ref<vm::Cell> master_data, Result jetton_wallet_data) {
+  if (master_code.is_null() || master_data.is_null()) {
+    return td::Status::Error("Jetton Master code or data null");
+  }
+  td::Bits256 master_code_hash(master_code->get_hash().bits());
+  auto memoised = jetton_wallet_address_memo.get(jetton_wallet_data.jetton, master_code_hash, jetton_wallet_data.owner);
+  if (memoised && memoised.value() == jetton_wallet_data.address) {
+    return jetton_wallet_data;
+  }
 
   vm::CellBuilder anycast_cb;
   anycast_cb.store_bool_bool(false);
@@ -154,51 +313,50 @@ void JettonWalletDetectorR::verify_with_master(td::Ref<vm::Cell> master_code, td
   auto stack_r = execute_smc_method<1>(jetton_wallet_data.jetton, master_code, master_data, config_, "get_wallet_address", 
     {vm::StackEntry(vm::load_cell_slice_ref(owner_address_cell))}, {vm::StackEntry::Type::t_slice});
   if (stack_r.is_error()) {
-    promise_.set_error(stack_r.move_as_error());
-    stop();
-    return;
+    // failures of the master's code say nothing about the wallet's code
+    return td::Status::Error(ErrorCode::ADDITIONAL_CHECKS_FAILED, stack_r.error().message());
   }
   auto stack = stack_r.move_as_ok();
 
   auto wallet_address = convert::to_std_address(stack[0].as_slice());
   if (wallet_address.is_error()) {
-    promise_.set_error(wallet_address.move_as_error());
-    stop();
-    return;
+    return wallet_address.move_as_error();
   }
 
   if (jetton_wallet_data.address == wallet_address.ok_ref()) {
-    promise_.set_value(std::move(jetton_wallet_data));
-  } else {
-    promise_.set_error(td::Status::Error("Jetton Master returned wrong address"));
+    jetton_wallet_address_memo.put(jetton_wallet_data.jetton, master_code_hash, jetton_wallet_data.owner, 
+                                   wallet_address.ok_ref());
+    return jetton_wallet_data;
   }
-  stop();
+  return td::Status::Error("Jetton Master returned wrong address");
 }
 
 
 JettonMasterDetectorR::JettonMasterDetectorR(block::StdAddress address, 
                       td::Ref<vm::Cell> code_cell,
                       td::Ref<vm::Cell> data_cell, 
-                      AllShardStates shard_states,
-                      std::shared_ptr<block::ConfigInfo> config,
-                      td::Promise<Result> promise)
+                      const AllShardStates& shard_states,
+                      std::shared_ptr<block::ConfigInfo> config)
   : address_(std::move(address)), code_cell_(std::move(code_cell)), data_cell_(std::move(data_cell)),
-    shard_states_(std::move(shard_states)), config_(std::move(config)), promise_(std::move(promise)) {}
+    shard_states_(shard_states), config_(std::move(config)) {}
 
 
-void JettonMasterDetectorR::start_up() {
+td::Result<JettonMasterDetectorR::Result> JettonMasterDetectorR::detect() {
   if (code_cell_.is_null() || data_cell_.is_null()) {
-    promise_.set_error(td::Status::Error("Code or data null"));
-    stop();
-    return;
+    return td::Status::Error("Code or data null");
+  }
+
+  td::Bits256 code_hash(code_cell_->get_hash().bits());
+  td::Bits256 data_hash(data_cell_->get_hash().bits());
+  auto cached = DetectionCache::instance().get_jetton_master(address_, code_hash, data_hash);
+  if (cached) {
+    return cached.value();
   }
 
   auto stack_r = execute_smc_method<5>(address_, code_cell_, data_cell_, config_, "get_jetton_data", {},
     {vm::StackEntry::Type::t_int, vm::StackEntry::Type::t_int, vm::StackEntry::Type::t_slice, vm::StackEntry::Type::t_cell, vm::StackEntry::Type::t_cell});
   if (stack_r.is_error()) {
-    promise_.set_error(stack_r.move_as_error());
-    stop();
-    return;
+    return stack_r.move_as_error();
   }
   auto stack = stack_r.move_as_ok();
   Result data;
@@ -212,107 +370,97 @@ void JettonMasterDetectorR::start_up() {
   } else {
     auto admin_address = convert::to_std_address(admin_addr_cs);
     if (admin_address.is_error()) {
-      promise_.set_error(admin_address.move_as_error_prefix("jetton master admin address parsing failed: "));
-      stop();
-      return;
+      return admin_address.move_as_error_prefix("jetton master admin address parsing failed: ");
     }
     data.admin_address = admin_address.move_as_ok();
   }
   
   auto jetton_content = parse_token_data(stack[3].as_cell());
   if (jetton_content.is_error()) {
-    promise_.set_error(jetton_content.move_as_error_prefix("get_jetton_data jetton_content parsing failed: "));
-    stop();
-    return;
+    return jetton_content.move_as_error_prefix("get_jetton_data jetton_content parsing failed: ");
   }
   data.jetton_content = jetton_content.move_as_ok();
   data.jetton_wallet_code_hash = stack[4].as_cell()->get_hash();
 
-  promise_.set_value(std::move(data));
-  stop();
+  DetectionCache::instance().put_jetton_master(data, code_hash, data_hash);
+  return data;
 }
 
 NftItemDetectorR::NftItemDetectorR(block::StdAddress address, 
                        td::Ref<vm::Cell> code_cell,
                        td::Ref<vm::Cell> data_cell, 
-                       AllShardStates shard_states,
-                       std::shared_ptr<block::ConfigInfo> config,
-                       td::Promise<Result> promise) :
+                       const AllShardStates& shard_states,
+                       std::shared_ptr<block::ConfigInfo> config) :
   address_(std::move(address)), code_cell_(std::move(code_cell)), data_cell_(std::move(data_cell)),
-  shard_states_(std::move(shard_states)), config_(std::move(config)), promise_(std::move(promise)) {}
+  shard_states_(shard_states), config_(std::move(config)) {}
 
-void NftItemDetectorR::start_up() {
+td::Result<NftItemDetectorR::Result> NftItemDetectorR::detect() {
   if (code_cell_.is_null() || data_cell_.is_null()) {
-    promise_.set_error(td::Status::Error("Code or data null"));
-    stop();
-    return;
-  }
-
-  auto stack_r = execute_smc_method<5>(address_, code_cell_, data_cell_, config_, "get_nft_data", {},
-        {vm::StackEntry::Type::t_int, vm::StackEntry::Type::t_int, vm::StackEntry::Type::t_slice, vm::StackEntry::Type::t_slice, vm::StackEntry::Type::t_cell});
-  if (stack_r.is_error()) {
-    promise_.set_error(stack_r.move_as_error());
-    stop();
-    return;
+    return td::Status::Error("Code or data null");
   }
-  auto stack = stack_r.move_as_ok();
 
   Result data;
   data.address = address_;
-  data.init = stack[0].as_int()->to_long() != 0;
-  data.index = stack[1].as_int();
-  
-  auto collection_addr_cs = stack[2].as_slice();
-  if (collection_addr_cs->size() == 2 && collection_addr_cs->prefetch_ulong(2) == 0) {
-    // addr_none case
-    data.collection_address = std::nullopt;
+  td::Ref<vm::Cell> ind_content;
+  td::Bits256 code_hash(code_cell_->get_hash().bits());
+  auto& fast_decoders = FastDecoderRegistry::instance();
+  auto fast_fields = fast_decoders.decode_nft_item(code_hash, data_cell_);
+  if (fast_fields && !fast_decoders.sample_validation()) {
+    data.init = true;
+    data.index = std::move(fast_fields->index);
+    data.collection_address = fast_fields->collection_address;
+    data.owner_address = fast_fields->owner_address;
+    ind_content = std::move(fast_fields->content);
   } else {
-    auto collection_address = convert::to_std_address(stack[2].as_slice());
-    if (collection_address.is_error()) {
-      promise_.set_error(collection_address.move_as_error_prefix("nft collection address parsing failed: "));
-      stop();
-      return;
+    auto stack_r = execute_smc_method<5>(address_, code_cell_, data_cell_, config_, "get_nft_data", {},
+          {vm::StackEntry::Type::t_int, vm::StackEntry::Type::t_int, vm::StackEntry::Type::t_slice, vm::StackEntry::Type::t_slice, vm::StackEntry::Type::t_cell});
+    if (stack_r.is_error()) {
+      return stack_r.move_as_error();
+    }
+    auto stack = stack_r.move_as_ok();
+
+    data.init = stack[0].as_int()->to_long() != 0;
+    data.index = stack[1].as_int();
+    
+    auto collection_addr_cs = stack[2].as_slice();
+    if (collection_addr_cs->size() == 2 && collection_addr_cs->prefetch_ulong(2) == 0) {
+      // addr_none case
+      data.collection_address = std::nullopt;
+    } else {
+      auto collection_address = convert::to_std_address(stack[2].as_slice());
+      if (collection_address.is_error()) {
+        return collection_address.move_as_error_prefix("nft collection address parsing failed: ");
+      }
+      data.collection_address = collection_address.move_as_ok();
     }
-    data.collection_address = collection_address.move_as_ok();
-  }
 
-  auto owner_addr_cs = stack[3].as_slice();
-  if (owner_addr_cs->size() == 2 && owner_addr_cs->prefetch_ulong(2) == 0) {
-    // addr_none case
-    data.owner_address = std::nullopt;
-  } else {
-    auto owner_address = convert::to_std_address(owner_addr_cs);
-    if (owner_address.is_error()) {
-      promise_.set_error(owner_address.move_as_error_prefix("nft owner address parsing failed: "));
-      stop();
-      return;
+    auto owner_addr_cs = stack[3].as_slice();
+    if (owner_addr_cs->size() == 2 && owner_addr_cs->prefetch_ulong(2) == 0) {
+      // addr_none case
+      data.owner_address = std::nullopt;
+    } else {
+      auto owner_address = convert::to_std_address(owner_addr_cs);
+      if (owner_address.is_error()) {
+        return owner_address.move_as_error_prefix("nft owner address parsing failed: ");
+      }
+      data.owner_address = owner_address.move_as_ok();
+    }
+    ind_content = stack[4].as_cell();
+    if (fast_fields && ind_content.not_null()) {
+      fast_decoders.validate_nft_item(code_hash, fast_fields.value(), NftItemDataFields{data.index, data.collection_address, data.owner_address, ind_content});
     }
-    data.owner_address = owner_address.move_as_ok();
   }
 
   if (!data.collection_address) {
-    auto content = parse_token_data(stack[4].as_cell());
+    auto content = parse_token_data(ind_content);
     if (content.is_error()) {
-      promise_.set_error(content.move_as_error_prefix("nft content parsing failed: "));
-      stop();
-      return;
+      return content.move_as_error_prefix("nft content parsing failed: ");
     }
     data.content = content.move_as_ok();
-    promise_.set_value(std::move(data));
-    stop();
-  } else {
-    auto ind_content = stack[4].as_cell();
-    auto R = td::PromiseCreator::lambda([=, SelfId = actor_id(this)](td::Result<schema::AccountState> account_state_r) mutable {
-      if (account_state_r.is_error()) {
-        promise_.set_error(account_state_r.move_as_error());
-        stop();
-        return;
-      }
-      auto account_state = account_state_r.move_as_ok();
-      td::actor::send_closure(SelfId, &NftItemDetectorR::got_collection, data, ind_content, account_state.code, account_state.data);
-    });
-    td::actor::create_actor<FetchAccountFromShardV2>("fetchaccountfromshard", shard_states_, data.collection_address.value(), std::move(R)).release();
+    return data;
   }
+  TRY_RESULT(collection_state, fetch_account_from_shards(shard_states_, data.collection_address.value()));
+  return got_collection(std::move(data), ind_content, collection_state.code, collection_state.data);
 }
 
 bool NftItemDetectorR::is_testnet = false;
@@ -335,19 +483,15 @@ std::optional<block::StdAddress> NftItemDetectorR::dot_t_dot_me_dns_root_addr()
   return dot_t_dot_me_dns_root_addr_mainnet;
 }
 
-void NftItemDetectorR::got_collection(Result item_data, td::Ref<vm::Cell> ind_content, td::Ref<vm::Cell> collection_code, td::Ref<vm::Cell> collection_data) {
+td::Result<NftItemDetectorR::Result> NftItemDetectorR::got_collection(Result item_data, td::Ref<vm::Cell> ind_content, td::Ref<vm::Cell> collection_code, td::Ref<vm::Cell> collection_data) {
   auto verify = verify_with_collection(item_data.collection_address.value(), collection_code, collection_data, item_data.index);
   if (verify.is_error()) {
-    promise_.set_error(verify.move_as_error());
-    stop();
-    return;
+    return verify.move_as_error();
   }
   
   auto content = get_content(item_data.index, ind_content, item_data.collection_address.value(), collection_code, collection_data);
   if (content.is_error()) {
-    promise_.set_error(content.move_as_error_prefix("failed to get nft item content: "));
-    stop();
-    return;
+    return content.move_as_error_prefix("failed to get nft item content: ");
   }
   item_data.content = content.move_as_ok();
 
@@ -357,8 +501,7 @@ void NftItemDetectorR::got_collection(Result item_data, td::Ref<vm::Cell> ind_co
       process_domain_and_dns_data(t_me_root.value(), [this](){ return this->get_t_me_domain(); }, item_data);
   }
 
-  promise_.set_value(std::move(item_data));
-  stop();
+  return item_data;
 }
 
 td::Status NftItemDetectorR::verify_with_collection(block::StdAddress collection_address, td::Ref<vm::Cell> collection_code, td::Ref<vm::Cell> collection_data, td::RefInt256 index) {
@@ -366,7 +509,7 @@ td::Status NftItemDetectorR::verify_with_collection(block::StdAddress collection
     {vm::StackEntry(index)}, {vm::StackEntry::Type::t_slice});
 
   if (stack_r.is_error()) {
-    return stack_r.move_as_error();
+    return td::Status::Error(ErrorCode::ADDITIONAL_CHECKS_FAILED, stack_r.error().message());
   }
   auto stack = stack_r.move_as_ok();
 
@@ -380,10 +523,26 @@ td::Status NftItemDetectorR::verify_with_collection(block::StdAddress collection
 
 td::Result<std::map<std::string, std::string>> NftItemDetectorR::get_content(td::RefInt256 index, td::Ref<vm::Cell> ind_content, block::StdAddress collection_address,
     td::Ref<vm::Cell> collection_code, td::Ref<vm::Cell> collection_data) {
-  TRY_RESULT(stack, execute_smc_method<1>(collection_address, collection_code, collection_data, config_, "get_nft_content", 
-    {vm::StackEntry(index), vm::StackEntry(ind_content)}, {vm::StackEntry::Type::t_cell}));
+  bool cacheable = ind_content.not_null() && collection_code.not_null() && collection_data.not_null();
+  if (cacheable) {
+    auto cached = nft_content_cache.get(collection_address, collection_code, collection_data, index, ind_content);
+    if (cached) {
+      return cached.value();
+    }
+  }
+
+  auto stack_r = execute_smc_method<1>(collection_address, collection_code, collection_data, config_, "get_nft_content", 
+    {vm::StackEntry(index), vm::StackEntry(ind_content)}, {vm::StackEntry::Type::t_cell});
+  if (stack_r.is_error()) {
+    return td::Status::Error(ErrorCode::ADDITIONAL_CHECKS_FAILED, stack_r.error().message());
+  }
+  auto stack = stack_r.move_as_ok();
 
-  return parse_token_data(stack[0].as_cell());
+  TRY_RESULT(content, parse_token_data(stack[0].as_cell()));
+  if (cacheable) {
+    nft_content_cache.put(collection_address, collection_code, collection_data, index, ind_content, content);
+  }
+  return content;
 }
 
 void NftItemDetectorR::process_domain_and_dns_data(const block::StdAddress& root_address, const std::function<td::Result<std::string>()>& get_domain_function, Result& item_data) {
@@ -544,19 +703,23 @@ td::Result<std::string> NftItemDetectorR::get_t_me_domain() {
 NftCollectionDetectorR::NftCollectionDetectorR(block::StdAddress address, 
                        td::Ref<vm::Cell> code_cell,
                        td::Ref<vm::Cell> data_cell, 
-                       AllShardStates shard_states,
-                       std::shared_ptr<block::ConfigInfo> config,
-                       td::Promise<Result> promise) :
+                       const AllShardStates& shard_states,
+                       std::shared_ptr<block::ConfigInfo> config) :
   address_(std::move(address)), code_cell_(std::move(code_cell)), data_cell_(std::move(data_cell)), 
-  shard_states_(std::move(shard_states)), config_(std::move(config)), promise_(std::move(promise)) {}
+  shard_states_(shard_states), config_(std::move(config)) {}
  
-void NftCollectionDetectorR::start_up() {
+td::Result<NftCollectionDetectorR::Result> NftCollectionDetectorR::detect() {
+  if (code_cell_.not_null() && data_cell_.not_null()) {
+    auto cached = DetectionCache::instance().get_nft_collection(address_, td::Bits256(code_cell_->get_hash().bits()), td::Bits256(data_cell_->get_hash().bits()));
+    if (cached) {
+      return cached.value();
+    }
+  }
+
   auto stack_r = execute_smc_method<3>(address_, code_cell_, data_cell_, config_, "get_collection_data", {},
     {vm::StackEntry::Type::t_int, vm::StackEntry::Type::t_cell, vm::StackEntry::Type::t_slice});
   if (stack_r.is_error()) {
-    promise_.set_error(stack_r.move_as_error());
-    stop();
-    return;
+    return stack_r.move_as_error();
   }
   auto stack = stack_r.move_as_ok();
   Result data;
@@ -569,19 +732,17 @@ void NftCollectionDetectorR::start_up() {
   } else {
     auto owner_address = convert::to_std_address(owner_addr_cs);
     if (owner_address.is_error()) {
-      promise_.set_error(owner_address.move_as_error());
-      stop();
-      return;
+      return owner_address.move_as_error();
     }
     data.owner_address = owner_address.move_as_ok();
   }
   auto collection_content = parse_token_data(stack[1].as_cell());
   if (collection_content.is_error()) {
-    promise_.set_error(collection_content.move_as_error_prefix("get_collection_data collection_content parsing failed: "));
-    stop();
-    return;
+    return collection_content.move_as_error_prefix("get_collection_data collection_content parsing failed: ");
   }
   data.collection_content = collection_content.move_as_ok();
-  promise_.set_value(std::move(data));
-  stop();
+  if (code_cell_.not_null() && data_cell_.not_null()) {
+    DetectionCache::instance().put_nft_collection(data, td::Bits256(code_cell_->get_hash().bits()), td::Bits256(data_cell_->get_hash().bits()));
+  }
+  return data;
 }
\ No newline at end of file
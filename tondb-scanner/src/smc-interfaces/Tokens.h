@@ -1,12 +1,14 @@
 #pragma once
 #include <block/block.h>
-#include <td/actor/actor.h>
 #include <mc-config.h>
 
 using AllShardStates = std::vector<td::Ref<vm::Cell>>;
 
-class JettonWalletDetectorR: public td::actor::Actor {
+class JettonWalletDetectorR {
 public:
+  static constexpr const char* name = "jetton_wallet";
+  // verified against the jetton master, so results are not reused by code and data hashes
+  static constexpr bool code_and_data_only = false;
   struct Result {
     td::RefInt256 balance;
     block::StdAddress address;
@@ -18,25 +20,26 @@ public:
   JettonWalletDetectorR(block::StdAddress address, 
                        td::Ref<vm::Cell> code_cell,
                        td::Ref<vm::Cell> data_cell, 
-                       AllShardStates shard_states,
-                       std::shared_ptr<block::ConfigInfo> config,
-                       td::Promise<Result> promise);
+                       const AllShardStates& shard_states,
+                       std::shared_ptr<block::ConfigInfo> config);
 
-  void start_up() override;
+  td::Result<Result> detect();
 
 private:
-  void verify_with_master(td::Ref<vm::Cell> master_code, td::Ref<vm::Cell> master_data, Result jetton_wallet_data);
+  td::Result<Result> verify_with_master(td::Ref<vm::Cell> master_code, td::Ref<vm::Cell> master_data, Result jetton_wallet_data);
 
   block::StdAddress address_;
   td::Ref<vm::Cell> code_cell_;
   td::Ref<vm::Cell> data_cell_;
-  AllShardStates shard_states_;
+  const AllShardStates& shard_states_;
   std::shared_ptr<block::ConfigInfo> config_;
-  td::Promise<Result> promise_;
 };
 
-class JettonMasterDetectorR: public td::actor::Actor {
+class JettonMasterDetectorR {
 public:
+  static constexpr const char* name = "jetton_master";
+  // result depends only on code and data of the account
+  static constexpr bool code_and_data_only = true;
   struct Result {
     block::StdAddress address;
     td::RefInt256 total_supply;
@@ -49,23 +52,24 @@ public:
   JettonMasterDetectorR(block::StdAddress address, 
                        td::Ref<vm::Cell> code_cell,
                        td::Ref<vm::Cell> data_cell, 
-                       AllShardStates shard_states,
-                       std::shared_ptr<block::ConfigInfo> config,
-                       td::Promise<Result> promise);
+                       const AllShardStates& shard_states,
+                       std::shared_ptr<block::ConfigInfo> config);
 
-  void start_up() override;
+  td::Result<Result> detect();
 
 private:
   block::StdAddress address_;
   td::Ref<vm::Cell> code_cell_;
   td::Ref<vm::Cell> data_cell_;
-  AllShardStates shard_states_;
+  const AllShardStates& shard_states_;
   std::shared_ptr<block::ConfigInfo> config_;
-  td::Promise<Result> promise_;
 };
 
-class NftItemDetectorR: public td::actor::Actor {
+class NftItemDetectorR {
 public:
+  static constexpr const char* name = "nft_item";
+  // content and verification come from the collection, so results are not reused by code and data hashes
+  static constexpr bool code_and_data_only = false;
   struct Result {
     struct DNSEntry {
       std::string domain;
@@ -88,14 +92,13 @@ public:
   NftItemDetectorR(block::StdAddress address, 
                        td::Ref<vm::Cell> code_cell,
                        td::Ref<vm::Cell> data_cell, 
-                       AllShardStates shard_states,
-                       std::shared_ptr<block::ConfigInfo> config,
-                       td::Promise<Result> promise);
+                       const AllShardStates& shard_states,
+                       std::shared_ptr<block::ConfigInfo> config);
 
-  void start_up() override;
+  td::Result<Result> detect();
 
 private:
-  void got_collection(Result item_data, td::Ref<vm::Cell> ind_content, td::Ref<vm::Cell> collection_code, td::Ref<vm::Cell> collection_data);
+  td::Result<Result> got_collection(Result item_data, td::Ref<vm::Cell> ind_content, td::Ref<vm::Cell> collection_code, td::Ref<vm::Cell> collection_data);
   td::Status verify_with_collection(block::StdAddress collection_address, td::Ref<vm::Cell> collection_code, td::Ref<vm::Cell> collection_data, td::RefInt256 index);
   td::Result<std::map<std::string, std::string>> get_content(td::RefInt256 index, td::Ref<vm::Cell> ind_content, block::StdAddress collection_address,
                                                             td::Ref<vm::Cell> collection_code, td::Ref<vm::Cell> collection_data);
@@ -109,15 +112,17 @@ private:
   block::StdAddress address_;
   td::Ref<vm::Cell> code_cell_;
   td::Ref<vm::Cell> data_cell_;
-  AllShardStates shard_states_;
+  const AllShardStates& shard_states_;
   std::shared_ptr<block::ConfigInfo> config_;
-  td::Promise<Result> promise_;
 
   td::Ref<vm::Cell> ind_content_;
 };
 
-class NftCollectionDetectorR: public td::actor::Actor {
+class NftCollectionDetectorR {
 public:
+  static constexpr const char* name = "nft_collection";
+  // result depends only on code and data of the account
+  static constexpr bool code_and_data_only = true;
   struct Result {
     block::StdAddress address;
     td::RefInt256 next_item_index;
@@ -128,17 +133,15 @@ public:
   NftCollectionDetectorR(block::StdAddress address, 
                        td::Ref<vm::Cell> code_cell,
                        td::Ref<vm::Cell> data_cell, 
-                       AllShardStates shard_states,
-                       std::shared_ptr<block::ConfigInfo> config,
-                       td::Promise<Result> promise);
+                       const AllShardStates& shard_states,
+                       std::shared_ptr<block::ConfigInfo> config);
 
-  void start_up() override;
+  td::Result<Result> detect();
 
 private:
   block::StdAddress address_;
   td::Ref<vm::Cell> code_cell_;
   td::Ref<vm::Cell> data_cell_;
-  AllShardStates shard_states_;
+  const AllShardStates& shard_states_;
   std::shared_ptr<block::ConfigInfo> config_;
-  td::Promise<Result> promise_;
 };
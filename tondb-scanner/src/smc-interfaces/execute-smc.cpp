@@ -1,26 +1,69 @@
 #include <td/utils/Time.h>
 #include "execute-smc.h"
+#include "InsertManager.h"
 
 
-td::Result<std::vector<vm::StackEntry>> execute_smc_method(const block::StdAddress& address, td::Ref<vm::Cell> code, td::Ref<vm::Cell> data, 
-                                        std::shared_ptr<block::ConfigInfo> config, const std::string& method_id, 
-                                        std::vector<vm::StackEntry> input) {
+namespace {
+thread_local GetMethodContext current_context;
+}
+
+GetMethodRunner::GetMethodRunner(std::shared_ptr<block::ConfigInfo> config, GetMethodContext context) 
+    : config_(std::move(config)), libraries_root_(config_->get_libraries_root()), context_(context) {
+  if (context_.utime != 0) {
+    now_ = context_.utime;
+  } else if (config_->utime != 0) {
+    now_ = config_->utime;
+  } else {
+    now_ = static_cast<td::uint32>(td::Time::now());
+  }
+}
+
+const GetMethodRunner& GetMethodRunner::for_config(const std::shared_ptr<block::ConfigInfo>& config) {
+  thread_local std::unique_ptr<GetMethodRunner> runner;
+  if (!runner || runner->config_ != config || !(runner->context_ == current_context)) {
+    runner = std::make_unique<GetMethodRunner>(config, current_context);
+  }
+  return *runner;
+}
+
+GetMethodRunner::ContextScope::ContextScope(GetMethodContext context) : previous_(current_context) {
+  current_context = context;
+}
+
+GetMethodRunner::ContextScope::~ContextScope() {
+  current_context = previous_;
+}
+
+td::Result<std::vector<vm::StackEntry>> GetMethodRunner::run(const block::StdAddress& address, td::Ref<vm::Cell> code, td::Ref<vm::Cell> data, 
+                                                             const std::string& method_id, std::vector<vm::StackEntry> input) const {
   ton::SmartContract smc({code, data});
   ton::SmartContract::Args args;
-  args.set_libraries(vm::Dictionary(config->get_libraries_root(), 256));
-  args.set_config(config);
-  args.set_now(td::Time::now());
-  args.set_address(std::move(address));
+  args.set_libraries(vm::Dictionary(libraries_root_, 256));
+  args.set_config(config_);
+  args.set_now(now_);
+  // block_lt and trans_lt of c7 are always 0 in get-methods, rand_seed is the block's one
+  args.set_rand_seed(context_.rand_seed);
+  args.set_address(address);
   args.set_stack(std::move(input));
 
   args.set_method_id(method_id);
   auto res = smc.run_get_method(args);
 
   if (!res.success) {
-    return td::Status::Error(method_id + " failed");
+    // exit code 11 is thrown by the method selector for an unknown method id, it depends on the code only
+    if (res.code == 11) {
+      return td::Status::Error(ErrorCode::INTERFACE_NOT_IMPLEMENTED, method_id + " is not implemented");
+    }
+    return td::Status::Error(method_id + " failed with exit code " + std::to_string(res.code));
   }
   
   auto stack = res.stack->extract_contents();
 
   return stack;
-}
\ No newline at end of file
+}
+
+td::Result<std::vector<vm::StackEntry>> execute_smc_method(const block::StdAddress& address, td::Ref<vm::Cell> code, td::Ref<vm::Cell> data, 
+                                        std::shared_ptr<block::ConfigInfo> config, const std::string& method_id, 
+                                        std::vector<vm::StackEntry> input) {
+  return GetMethodRunner::for_config(config).run(address, std::move(code), std::move(data), method_id, std::move(input));
+}
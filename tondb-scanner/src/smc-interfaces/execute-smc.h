@@ -1,5 +1,50 @@
+#pragma once
 #include "smc-envelope/SmartContract.h"
 
+// Masterchain block get-methods are executed at. Same block gives same now and rand_seed
+// in c7, so detection results are reproducible on reindex.
+struct GetMethodContext {
+  td::uint32 utime{0};
+  ton::LogicalTime lt{0};
+  td::Bits256 rand_seed = td::Bits256::zero();
+
+  bool operator==(const GetMethodContext& other) const {
+    return utime == other.utime && lt == other.lt && rand_seed == other.rand_seed;
+  }
+};
+
+// Runs get-methods against one config. Every call shares the config's libraries root, the dictionary handed to
+// the VM only references it. Now is taken from the block context (config utime if not set), so results don't
+// depend on the wall clock.
+class GetMethodRunner {
+public:
+  explicit GetMethodRunner(std::shared_ptr<block::ConfigInfo> config, GetMethodContext context = {});
+
+  // runner of the calling thread, rebuilt when config or the thread's context changes
+  static const GetMethodRunner& for_config(const std::shared_ptr<block::ConfigInfo>& config);
+
+  // sets context of get-methods run by the calling thread until destroyed
+  class ContextScope {
+  public:
+    explicit ContextScope(GetMethodContext context);
+    ~ContextScope();
+    ContextScope(const ContextScope&) = delete;
+    ContextScope& operator=(const ContextScope&) = delete;
+  private:
+    GetMethodContext previous_;
+  };
+
+  td::Result<std::vector<vm::StackEntry>> run(const block::StdAddress& address, td::Ref<vm::Cell> code, td::Ref<vm::Cell> data, 
+                                              const std::string& method_id, std::vector<vm::StackEntry> input) const;
+
+  const std::shared_ptr<block::ConfigInfo>& config() const { return config_; }
+private:
+  std::shared_ptr<block::ConfigInfo> config_;
+  td::Ref<vm::Cell> libraries_root_;
+  GetMethodContext context_;
+  td::uint32 now_;
+};
+
 td::Result<std::vector<vm::StackEntry>> execute_smc_method(const block::StdAddress& address, 
                                         td::Ref<vm::Cell> code, td::Ref<vm::Cell> data, 
                                         std::shared_ptr<block::ConfigInfo> config, const std::string& method_id, 
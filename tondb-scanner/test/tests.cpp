@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <filesystem>
+#include <set>
 #include "td/utils/port/signals.h"
 #include "td/utils/OptionParser.h"
 #include "td/utils/format.h"
@@ -9,6 +12,17 @@
 #include "td/utils/tests.h"
 #include "td/actor/actor.h"
 #include "td/utils/base64.h"
+#include "td/utils/Destructor.h"
+#include "td/utils/port/path.h"
+#include "crypto/vm/boc.h"
+#include "smc-envelope/SmartContract.h"
+#include "DataParser.h"
+#include "InsertManagerComposite.h"
+#include "InsertManagerFile.h"
+#include "SeqnoRangeSet.h"
+#include "TraceStitcher.h"
+#include "convert-utils.h"
+#include "smc-interfaces/FastDecoders.h"
 // #include "InterfaceDetector.hpp"
 
 
@@ -36,4 +50,516 @@
 // }
 
 
+namespace {
+schema::Transaction make_tx(td::uint8 account, uint64_t lt, ton::WorkchainId workchain = 0) {
+  schema::Transaction tx;
+  td::Bits256 addr = td::Bits256::zero();
+  addr.as_slice()[31] = account;
+  tx.account = block::StdAddress(workchain, addr);
+  tx.lt = lt;
+  tx.hash = td::Bits256::zero();
+  tx.hash.as_slice()[0] = account;
+  tx.hash.as_slice()[1] = static_cast<td::uint8>(lt);
+  return tx;
+}
 
+// jetton wallet EQDKC7jQ_tIJuYyrWfI4FIAN-hFHakG3GrATpOiqBVtsGOd5 of token-contract jetton-wallet.fc
+const char* jetton_wallet_code_boc = "te6cckECEgEAAzEAART/APSkE/S88sgLAQIBYgIDAgLLBAUAG6D2BdqJofQB9IH0gahhAgEgBgcCAWILDAIBSAgJAfH4Hpn/0AfSAQ+AH2omh9AH0gfSBqGCibUKkVY4L5cWCUYX/5cWEqGiE4KhAJqgoB5CgCfQEsZ4sA54tmZJFkZYCJegB6AGWAZJB8gDg6ZGWBZQPl/+ToAn0gegIY/QAQa6ThAHlxYjvADGRlgqgEZ4s4fQEL5bWJ5kCgC3QgxwCSXwTgAdDTAwFxsJUTXwPwEuD6QPpAMfoAMXHXIfoAMfoAMALTHyGCEA+KfqW6lTE0WfAP4CGCEBeNRRm6ljFERAPwEOA1ghBZXwe8upNZ8BHgXwSED/LwgAEV+kQwcLry4U2ACughAXjUUZyMsfGcs/UAf6AiLPFlAGzxYl+gJQA88WyVAFzCORcpFx4lAIqBOgggiYloCqAIIImJaAoKAUvPLixQTJgED7ABAjyFAE+gJYzxYBzxbMye1UAgEgDQ4AgUgCDXIe1E0PoA+kD6QNQwBNMfIYIQF41FGboCghB73ZfeuhKx8uLF0z8x+gAwE6BQI8hQBPoCWM8WAc8WzMntVIA/c7UTQ+gD6QPpA1DAI0z/6AFFRoAX6QPpAU1vHBVRzbXBUIBNUFAPIUAT6AljPFgHPFszJIsjLARL0APQAywDJ+QBwdMjLAsoHy//J0FANxwUcsfLiwwr6AFGooYIImJaAggiYloAStgihggiYloCgGKEn4w8l1wsBwwAjgDxARAOM7UTQ+gD6QPpA1DAH0z/6APpA9AQwUWKhUkrHBfLiwSjC//LiwoIImJaAqgAXoBe88uLDghB73ZfeyMsfyz9QBfoCIc8WUAPPFvQAyXGAGMjLBSTPFnD6AstqzMmAQPsAQBPIUAT6AljPFgHPFszJ7VSAAcFJ5oBihghBzYtCcyMsfUjDLP1j6AlAHzxZQB88WyXGAEMjLBSTPFlAG+gIVy2oUzMlx+wAQJBAjAA4QSRA4N18EAHbCALCOIYIQ1TJ223CAEMjLBVAIzxZQBPoCFstqEssfEss/yXL7AJM1bCHiA8hQBPoCWM8WAc8WzMntVLp4DOo=";
+const char* jetton_wallet_data_boc = "te6cckECEwEAA3sAAY0xKctoASFZDXpO6Q6ZgXHilrBvG9KSTVMUJk1CMXwYaoCc9JirAC61IQRl0/la95t27xhIpjxZt32vl1QQVF2UgTNuvD18YAEBFP8A9KQT9LzyyAsCAgFiAwQCAssFBgAboPYF2omh9AH0gfSBqGECASAHCAIBYgwNAgFICQoB8fgemf/QB9IBD4AfaiaH0AfSB9IGoYKJtQqRVjgvlxYJRhf/lxYSoaITgqEAmqCgHkKAJ9ASxniwDni2ZkkWRlgIl6AHoAZYBkkHyAODpkZYFlA+X/5OgCfSB6Ahj9ABBrpOEAeXFiO8AMZGWCqARnizh9AQvltYnmQLALdCDHAJJfBOAB0NMDAXGwlRNfA/AS4PpA+kAx+gAxcdch+gAx+gAwAtMfIYIQD4p+pbqVMTRZ8A/gIYIQF41FGbqWMUREA/AQ4DWCEFlfB7y6k1nwEeBfBIQP8vCAARX6RDBwuvLhTYAK6CEBeNRRnIyx8Zyz9QB/oCIs8WUAbPFiX6AlADzxbJUAXMI5FykXHiUAioE6CCCJiWgKoAggiYloCgoBS88uLFBMmAQPsAECPIUAT6AljPFgHPFszJ7VQCASAODwCBSAINch7UTQ+gD6QPpA1DAE0x8hghAXjUUZugKCEHvdl966ErHy4sXTPzH6ADAToFAjyFAE+gJYzxYBzxbMye1UgD9ztRND6APpA+kDUMAjTP/oAUVGgBfpA+kBTW8cFVHNtcFQgE1QUA8hQBPoCWM8WAc8WzMkiyMsBEvQA9ADLAMn5AHB0yMsCygfL/8nQUA3HBRyx8uLDCvoAUaihggiYloCCCJiWgBK2CKGCCJiWgKAYoSfjDyXXCwHDACOAQERIA4ztRND6APpA+kDUMAfTP/oA+kD0BDBRYqFSSscF8uLBKML/8uLCggiYloCqABegF7zy4sOCEHvdl97Iyx/LP1AF+gIhzxZQA88W9ADJcYAYyMsFJM8WcPoCy2rMyYBA+wBAE8hQBPoCWM8WAc8WzMntVIABwUnmgGKGCEHNi0JzIyx9SMMs/WPoCUAfPFlAHzxbJcYAQyMsFJM8WUAb6AhXLahTMyXH7ABAkECMADhBJEDg3XwQAdsIAsI4hghDVMnbbcIAQyMsFUAjPFlAE+gIWy2oSyx8Syz/JcvsAkzVsIeIDyFAE+gJYzxYBzxbMye1U8/HTGA==";
+
+td::Ref<vm::Cell> load_boc(const char* boc) {
+  return vm::std_boc_deserialize(td::base64_decode(td::Slice(boc)).move_as_ok()).move_as_ok();
+}
+
+td::Bits256 make_hash(td::uint8 value) {
+  td::Bits256 hash = td::Bits256::zero();
+  hash.as_slice()[0] = value;
+  return hash;
+}
+
+void add_trace(TraceBoundaryState& state, td::uint8 id, TraceImpl::State trace_state, size_t nodes, size_t edges, size_t pending_edges) {
+  auto trace = std::make_shared<TraceImpl>();
+  trace->trace_id = make_hash(id);
+  trace->mc_seqno_start = state.from_seqno;
+  trace->mc_seqno_end = state.to_seqno;
+  trace->start_lt = state.from_seqno;
+  trace->start_utime = state.from_seqno;
+  trace->end_lt = state.to_seqno;
+  trace->end_utime = state.to_seqno;
+  trace->state = trace_state;
+  trace->nodes = nodes;
+  trace->edges = edges;
+  trace->pending_edges = pending_edges;
+  state.pending_traces[trace->trace_id] = trace;
+}
+
+void add_edge(TraceBoundaryState& state, td::uint8 trace_id, td::uint8 msg, bool broken) {
+  TraceEdgeImpl edge;
+  edge.trace_id = make_hash(trace_id);
+  edge.msg_hash = make_hash(msg);
+  edge.msg_lt = msg;
+  edge.incomplete = true;
+  edge.broken = broken;
+  state.pending_edges[edge.msg_hash] = edge;
+}
+
+// Insert sink answering startup queries with fixed values
+class FakeInsertSink: public InsertManagerInterface {
+public:
+  FakeInsertSink(std::vector<std::uint32_t> existing_seqnos, std::optional<std::uint32_t> commit_watermark) :
+    existing_seqnos_(std::move(existing_seqnos)), commit_watermark_(commit_watermark) {}
+
+  void insert(std::uint32_t mc_seqno, ParsedBlockPtr block_ds, td::Promise<QueueState> queued_promise, td::Promise<td::Unit> inserted_promise) override {
+    queued_promise.set_value(QueueState{});
+    inserted_promise.set_value(td::Unit());
+  }
+  void get_insert_queue_state(td::Promise<QueueState> promise) override {
+    promise.set_value(QueueState{});
+  }
+  void get_existing_seqnos(td::Promise<std::vector<std::uint32_t>> promise, std::int32_t from_seqno, std::int32_t to_seqno) override {
+    promise.set_value(std::vector<std::uint32_t>(existing_seqnos_));
+  }
+  void get_commit_watermark(td::Promise<std::uint32_t> promise, std::int32_t from_seqno, std::int32_t to_seqno) override {
+    if (!commit_watermark_) {
+      promise.set_error(td::Status::Error(ErrorCode::ENTITY_NOT_FOUND, "commit watermark is not written yet"));
+      return;
+    }
+    promise.set_value(std::uint32_t(commit_watermark_.value()));
+  }
+private:
+  std::vector<std::uint32_t> existing_seqnos_;
+  std::optional<std::uint32_t> commit_watermark_;
+};
+
+struct CompositeStartup {
+  td::Result<std::vector<std::uint32_t>> existing_seqnos;
+  td::Result<std::uint32_t> commit_watermark;
+};
+
+// existing seqnos and commit watermark a composite of the sinks reports
+CompositeStartup query_composite(std::vector<std::pair<std::vector<std::uint32_t>, std::optional<std::uint32_t>>> sinks) {
+  CompositeStartup startup;
+  td::actor::Scheduler scheduler({1});
+  auto watcher = td::create_shared_destructor([] { td::actor::SchedulerContext::get()->stop(); });
+  scheduler.run_in_context([&] {
+    std::vector<td::actor::ActorId<InsertManagerInterface>> sink_ids;
+    for (auto& [existing_seqnos, commit_watermark] : sinks) {
+      sink_ids.push_back(td::actor::create_actor<FakeInsertSink>("fake_sink", std::move(existing_seqnos), commit_watermark).release());
+    }
+    auto composite = td::actor::create_actor<InsertManagerComposite>("composite", std::move(sink_ids)).release();
+    td::actor::send_closure(composite, &InsertManagerInterface::get_existing_seqnos, 
+      td::PromiseCreator::lambda([&startup, watcher](td::Result<std::vector<std::uint32_t>> R) {
+        startup.existing_seqnos = std::move(R);
+      }), 0, 0);
+    td::actor::send_closure(composite, &InsertManagerInterface::get_commit_watermark, 
+      td::PromiseCreator::lambda([&startup, watcher](td::Result<std::uint32_t> R) {
+        startup.commit_watermark = std::move(R);
+      }), 0, 0);
+    watcher.reset();
+  });
+  scheduler.run();
+  return startup;
+}
+
+struct FileSinkRound {
+  std::vector<std::string> partitions;  // published ones
+  std::vector<std::uint32_t> existing_seqnos;
+};
+
+// Inserts empty blocks into a file sink with partitions of 10 seqnos in rounds, draining and waiting for the
+// complete partitions to be published after each round.
+class FileSinkDriver: public td::actor::Actor {
+public:
+  FileSinkDriver(std::string dir, std::uint32_t from_seqno, std::uint32_t to_seqno, 
+                 std::vector<std::vector<std::uint32_t>> rounds, td::Promise<std::vector<FileSinkRound>> promise) :
+    dir_(std::move(dir)), from_seqno_(from_seqno), to_seqno_(to_seqno), rounds_(std::move(rounds)), promise_(std::move(promise)) {}
+
+  void start_up() override {
+    sink_ = td::actor::create_actor<InsertManagerFile>("file_sink", dir_, 10);
+    td::actor::send_closure(sink_, &InsertManagerFile::set_seqno_range, from_seqno_, to_seqno_);
+    next_round();
+  }
+
+  // publishing runs after the drain, polled until the expected partitions appear
+  void alarm() override {
+    auto partitions = published_partitions();
+    if (partitions.size() < expected_partitions_ && !deadline_.is_in_past()) {
+      alarm_timestamp() = td::Timestamp::in(0.01);
+      return;
+    }
+    td::actor::send_closure(sink_, &InsertManagerInterface::get_existing_seqnos, 
+      td::PromiseCreator::lambda([SelfId = actor_id(this), partitions](td::Result<std::vector<std::uint32_t>> R) mutable {
+        R.ensure();
+        td::actor::send_closure(SelfId, &FileSinkDriver::round_finished, FileSinkRound{std::move(partitions), R.move_as_ok()});
+      }), 0, 0);
+  }
+private:
+  std::string dir_;
+  std::uint32_t from_seqno_;
+  std::uint32_t to_seqno_;
+  std::vector<std::vector<std::uint32_t>> rounds_;
+  td::Promise<std::vector<FileSinkRound>> promise_;
+
+  td::actor::ActorOwn<InsertManagerFile> sink_;
+  std::vector<FileSinkRound> results_;
+  std::set<std::uint32_t> inserted_;
+  size_t expected_partitions_{0};
+  td::Timestamp deadline_;
+
+  void next_round() {
+    const auto& seqnos = rounds_[results_.size()];
+    for (auto seqno : seqnos) {
+      inserted_.insert(seqno);
+      td::actor::send_closure(sink_, &InsertManagerInterface::insert, seqno, std::make_shared<ParsedBlock>(),
+                              td::PromiseCreator::lambda([](td::Result<QueueState> R) { R.ensure(); }),
+                              td::PromiseCreator::lambda([](td::Result<td::Unit> R) { R.ensure(); }));
+    }
+    // partitions of the range with all their seqnos inserted so far
+    expected_partitions_ = 0;
+    for (std::uint32_t first = from_seqno_ / 10 * 10; first <= to_seqno_; first += 10) {
+      bool complete = true;
+      for (auto seqno = std::max(first, from_seqno_); seqno <= std::min(first + 9, to_seqno_); ++seqno) {
+        complete = complete && inserted_.count(seqno);
+      }
+      expected_partitions_ += complete;
+    }
+    td::actor::send_closure(sink_, &InsertManagerInterface::drain, td::PromiseCreator::lambda([SelfId = actor_id(this)](td::Result<td::Unit> R) {
+      R.ensure();
+      td::actor::send_closure(SelfId, &FileSinkDriver::drained);
+    }));
+  }
+
+  void drained() {
+    deadline_ = td::Timestamp::in(10.0);
+    alarm_timestamp() = td::Timestamp::now();
+  }
+
+  void round_finished(FileSinkRound round) {
+    results_.push_back(std::move(round));
+    if (results_.size() < rounds_.size()) {
+      next_round();
+      return;
+    }
+    promise_.set_value(std::move(results_));
+    stop();
+  }
+
+  std::vector<std::string> published_partitions() const {
+    std::vector<std::string> partitions;
+    for (const auto& entry : std::filesystem::directory_iterator(dir_)) {
+      auto name = entry.path().filename().string();
+      if (entry.is_directory() && name[0] != '.' && std::filesystem::exists(entry.path() / "seqnos")) {
+        partitions.push_back(name);
+      }
+    }
+    std::sort(partitions.begin(), partitions.end());
+    return partitions;
+  }
+};
+
+std::vector<FileSinkRound> run_file_sink(std::uint32_t from_seqno, std::uint32_t to_seqno, std::vector<std::vector<std::uint32_t>> rounds) {
+  auto dir = td::mkdtemp(std::filesystem::temp_directory_path().string(), "test-file-sink").move_as_ok();
+  td::Result<std::vector<FileSinkRound>> result;
+  td::actor::Scheduler scheduler({1});
+  auto watcher = td::create_shared_destructor([] { td::actor::SchedulerContext::get()->stop(); });
+  scheduler.run_in_context([&] {
+    td::actor::create_actor<FileSinkDriver>("file_sink_driver", dir, from_seqno, to_seqno, std::move(rounds), 
+      td::PromiseCreator::lambda([&result, watcher](td::Result<std::vector<FileSinkRound>> R) {
+        result = std::move(R);
+      })).release();
+    watcher.reset();
+  });
+  scheduler.run();
+  std::filesystem::remove_all(dir);
+  return result.move_as_ok();
+}
+
+std::vector<std::uint32_t> seqno_range(std::uint32_t from, std::uint32_t to) {
+  std::vector<std::uint32_t> seqnos;
+  for (auto seqno = from; seqno <= to; ++seqno) {
+    seqnos.push_back(seqno);
+  }
+  return seqnos;
+}
+}  // namespace
+
+TEST(TonDbScanner, MergeAccountRunsMatchesLtSort) {
+  // runs come out of AccountBlocks grouped by account, lts of different accounts interleave
+  std::vector<schema::Transaction> txs{
+    make_tx(1, 10), make_tx(1, 13), make_tx(1, 20),
+    make_tx(2, 11), make_tx(2, 13),
+    make_tx(3, 5),
+    make_tx(4, 12), make_tx(4, 14), make_tx(4, 15), make_tx(4, 21),
+    make_tx(5, 13, -1),
+  };
+  std::vector<size_t> run_ends{3, 5, 5, 6, 10, 11};
+
+  // the sort TraceAssembler did over all transactions before they came sorted
+  auto expected = txs;
+  std::sort(expected.begin(), expected.end(), [](const auto& lhs, const auto& rhs) {
+    if (lhs.lt != rhs.lt) {
+      return lhs.lt < rhs.lt;
+    }
+    if (lhs.account.workchain != rhs.account.workchain) {
+      return lhs.account.workchain < rhs.account.workchain;
+    }
+    return lhs.account.addr < rhs.account.addr;
+  });
+
+  auto merged = merge_account_runs(txs, run_ends);
+  ASSERT_EQ(expected.size(), merged.size());
+  for (size_t i = 0; i < merged.size(); ++i) {
+    ASSERT_TRUE(expected[i].hash == merged[i].hash);
+    ASSERT_EQ(expected[i].account.workchain, merged[i].account.workchain);
+  }
+  // lt 13 is shared by three accounts, the masterchain one goes first
+  ASSERT_EQ(-1, merged[4].account.workchain);
+  ASSERT_EQ(1, merged[5].account.addr.as_slice()[31]);
+  ASSERT_EQ(2, merged[6].account.addr.as_slice()[31]);
+}
+
+TEST(TonDbScanner, MergeAccountRunsSingleRun) {
+  std::vector<schema::Transaction> txs{make_tx(1, 1), make_tx(1, 2), make_tx(1, 3)};
+  auto merged = merge_account_runs(txs, {3});
+  ASSERT_EQ(3u, merged.size());
+  for (size_t i = 0; i < merged.size(); ++i) {
+    ASSERT_EQ(i + 1, merged[i].lt);
+  }
+  ASSERT_TRUE(merge_account_runs({}, {}).empty());
+}
+
+TEST(TonDbScanner, FastDecoderJettonWalletMatchesGetMethod) {
+  block::StdAddress address(std::string("EQDKC7jQ_tIJuYyrWfI4FIAN-hFHakG3GrATpOiqBVtsGOd5"));
+  auto code = load_boc(jetton_wallet_code_boc);
+  auto data = load_boc(jetton_wallet_data_boc);
+  td::Bits256 code_hash(code->get_hash().bits());
+
+  auto fast = FastDecoderRegistry::instance().decode_jetton_wallet(code_hash, data);
+  ASSERT_TRUE(fast.has_value());
+
+  ton::SmartContract smc({code, data});
+  auto res = smc.run_get_method(ton::SmartContract::Args().set_method_id("get_wallet_data").set_address(address));
+  ASSERT_TRUE(res.success);
+  auto stack = res.stack->extract_contents();
+  ASSERT_EQ(4u, stack.size());
+  auto owner = convert::to_std_address(stack[1].as_slice());
+  auto jetton = convert::to_std_address(stack[2].as_slice());
+  ASSERT_TRUE(owner.is_ok());
+  ASSERT_TRUE(jetton.is_ok());
+
+  ASSERT_EQ(0, td::cmp(fast->balance, stack[0].as_int()));
+  ASSERT_TRUE(fast->owner == owner.ok());
+  ASSERT_TRUE(fast->jetton == jetton.ok());
+}
+
+TEST(TonDbScanner, FastDecoderSkipsUnknownCode) {
+  auto data = load_boc(jetton_wallet_data_boc);
+  // same data under a code hash without a checked decoder
+  td::Bits256 code_hash(data->get_hash().bits());
+  ASSERT_TRUE(!FastDecoderRegistry::instance().decode_jetton_wallet(code_hash, data).has_value());
+  ASSERT_TRUE(!FastDecoderRegistry::instance().decode_nft_item(code_hash, data).has_value());
+}
+
+TEST(TonDbScanner, StitchTraceBoundaries) {
+  std::vector<TraceBoundaryState> states(3);
+  states[0].from_seqno = 1;
+  states[0].to_seqno = 100;
+  states[1].from_seqno = 101;
+  states[1].to_seqno = 200;
+  states[2].from_seqno = 201;
+  states[2].to_seqno = 300;
+
+  // trace 1 leaves messages 11 and 12 in flight, continued by trace 2 in the next range and trace 5 two ranges later
+  add_trace(states[0], 1, TraceImpl::State::pending, 3, 2, 2);
+  add_edge(states[0], 1, 11, false);
+  add_edge(states[0], 1, 12, false);
+  add_trace(states[1], 2, TraceImpl::State::broken, 2, 1, 1);
+  add_edge(states[1], 2, 11, true);
+  add_trace(states[2], 5, TraceImpl::State::broken, 1, 0, 1);
+  add_edge(states[2], 5, 12, true);
+
+  // trace 3 is continued by trace 4, which also has a broken edge no range left pending
+  add_trace(states[0], 3, TraceImpl::State::pending, 1, 0, 1);
+  add_edge(states[0], 3, 13, false);
+  add_trace(states[1], 4, TraceImpl::State::broken, 1, 0, 2);
+  add_edge(states[1], 4, 13, true);
+  add_edge(states[1], 4, 18, true);
+
+  auto R = stitch_trace_boundaries(states);
+  ASSERT_TRUE(R.is_ok());
+  auto result = R.move_as_ok();
+  ASSERT_EQ(3u, result.stitched_edges);
+  ASSERT_EQ(1u, result.broken_traces);
+  ASSERT_EQ(0u, result.pending_traces);
+
+  std::map<td::Bits256, td::Bits256> remap(result.remap.begin(), result.remap.end());
+  ASSERT_EQ(3u, remap.size());
+  ASSERT_TRUE(remap[make_hash(2)] == make_hash(1));
+  ASSERT_TRUE(remap[make_hash(5)] == make_hash(1));
+  ASSERT_TRUE(remap[make_hash(4)] == make_hash(3));
+
+  // joined edges were pending on both sides: 2 + (1 - 2) + (1 - 2) pending edges are left
+  ASSERT_EQ(1u, result.completed.size());
+  const auto& trace = result.completed[0];
+  ASSERT_TRUE(trace.trace_id == make_hash(1));
+  ASSERT_TRUE(trace.state == schema::Trace::State::complete);
+  ASSERT_EQ(6, trace.nodes_);
+  ASSERT_EQ(5, trace.edges_);
+  ASSERT_EQ(0, trace.pending_edges_);
+  ASSERT_EQ(300, trace.mc_seqno_end);
+}
+
+TEST(TonDbScanner, StitchTraceBoundariesKeepsPendingTraces) {
+  std::vector<TraceBoundaryState> states(2);
+  states[0].from_seqno = 1;
+  states[0].to_seqno = 100;
+  states[1].from_seqno = 101;
+  states[1].to_seqno = 200;
+
+  // only one of two messages in flight is continued, the trace stays pending
+  add_trace(states[0], 1, TraceImpl::State::pending, 3, 2, 2);
+  add_edge(states[0], 1, 11, false);
+  add_edge(states[0], 1, 12, false);
+  add_trace(states[1], 2, TraceImpl::State::broken, 2, 1, 1);
+  add_edge(states[1], 2, 11, true);
+
+  auto R = stitch_trace_boundaries(states);
+  ASSERT_TRUE(R.is_ok());
+  ASSERT_EQ(1u, R.ok().stitched_edges);
+  ASSERT_EQ(1u, R.ok().pending_traces);
+  ASSERT_TRUE(R.ok().completed.empty());
+
+  states[1].from_seqno = 102;
+  ASSERT_TRUE(stitch_trace_boundaries(states).is_error());
+}
+
+TEST(TonDbScanner, SeqnoRangeSetMergesRanges) {
+  SeqnoRangeSet set;
+  set.insert_range(10, 20);
+  set.insert_range(30, 40);
+  ASSERT_EQ(2u, set.ranges_count());
+  ASSERT_EQ(22u, set.size());
+
+  // touching on both sides
+  set.insert_range(21, 29);
+  ASSERT_EQ(1u, set.ranges_count());
+  ASSERT_EQ(31u, set.size());
+
+  // overlapping the start, inside, and covering the whole run
+  set.insert_range(5, 12);
+  ASSERT_EQ(36u, set.size());
+  set.insert_range(15, 25);
+  ASSERT_EQ(36u, set.size());
+  set.insert_range(50, 60);
+  set.insert_range(1, 100);
+  ASSERT_EQ(1u, set.ranges_count());
+  ASSERT_EQ(100u, set.size());
+  ASSERT_EQ(1u, set.min().value());
+
+  set.insert_range(200, 199);
+  ASSERT_EQ(100u, set.size());
+}
+
+TEST(TonDbScanner, SeqnoRangeSetEraseSplitsRange) {
+  SeqnoRangeSet set;
+  set.insert_range(1, 10);
+  set.erase(5);
+  ASSERT_EQ(2u, set.ranges_count());
+  ASSERT_EQ(9u, set.size());
+  ASSERT_TRUE(!set.contains(5));
+  ASSERT_TRUE(set.contains(4));
+  ASSERT_TRUE(set.contains(6));
+
+  // range ends and seqnos not in the set
+  set.erase(1);
+  set.erase(10);
+  set.erase(5);
+  set.erase(42);
+  ASSERT_EQ(7u, set.size());
+  ASSERT_EQ(2u, set.ranges_count());
+  ASSERT_EQ(2u, set.min().value());
+
+  set.insert(5);
+  ASSERT_EQ(1u, set.ranges_count());
+  ASSERT_EQ(8u, set.size());
+
+  set.clear();
+  ASSERT_TRUE(set.empty());
+  ASSERT_TRUE(!set.min().has_value());
+}
+
+TEST(TonDbScanner, SeqnoRangeSetContiguousEnd) {
+  SeqnoRangeSet set;
+  ASSERT_EQ(9u, set.contiguous_end(10));
+  set.insert_range(10, 20);
+  set.insert_range(25, 30);
+  ASSERT_EQ(20u, set.contiguous_end(10));
+  ASSERT_EQ(20u, set.contiguous_end(15));
+  ASSERT_EQ(20u, set.contiguous_end(20));
+  // in a gap, before and after all ranges
+  ASSERT_EQ(21u, set.contiguous_end(22));
+  ASSERT_EQ(4u, set.contiguous_end(5));
+  ASSERT_EQ(30u, set.contiguous_end(31));
+  ASSERT_EQ(30u, set.contiguous_end(25));
+}
+
+TEST(TonDbScanner, CompositeSinkIntersectsExistingSeqnos) {
+  // unsorted, with seqnos committed by one sink only
+  auto startup = query_composite({
+    {{1, 2, 3, 5, 6}, 3},
+    {{5, 4, 3, 2}, 5},
+    {{0, 2, 5, 3}, 7},
+  });
+  ASSERT_TRUE(startup.existing_seqnos.is_ok());
+  ASSERT_TRUE(startup.existing_seqnos.ok() == std::vector<std::uint32_t>({2, 3, 5}));
+  // the slowest sink decides where the indexing resumes
+  ASSERT_TRUE(startup.commit_watermark.is_ok());
+  ASSERT_EQ(3u, startup.commit_watermark.ok());
+}
+
+TEST(TonDbScanner, CompositeSinkWatermarkNeedsAllSinks) {
+  auto startup = query_composite({
+    {{1, 2, 3}, 3},
+    {{1, 2}, std::nullopt},
+  });
+  ASSERT_TRUE(startup.existing_seqnos.is_ok());
+  ASSERT_TRUE(startup.existing_seqnos.ok() == std::vector<std::uint32_t>({1, 2}));
+  ASSERT_TRUE(startup.commit_watermark.is_error());
+
+  auto single = query_composite({{{4, 3}, 4}});
+  ASSERT_TRUE(single.existing_seqnos.ok() == std::vector<std::uint32_t>({3, 4}));
+  ASSERT_EQ(4u, single.commit_watermark.ok());
+}
+
+TEST(TonDbScanner, FileSinkPublishesCompletePartitions) {
+  // 19 comes last, partition 10-19 waits for it while its neighbours are published
+  auto first = seqno_range(0, 18);
+  auto tail = seqno_range(20, 29);
+  first.insert(first.end(), tail.begin(), tail.end());
+  auto rounds = run_file_sink(0, 29, {first, {19}});
+  ASSERT_EQ(2u, rounds.size());
+
+  ASSERT_TRUE(rounds[0].partitions == std::vector<std::string>({"0-9", "20-29"}));
+  // staged seqnos of the unpublished partition count as existing
+  ASSERT_TRUE(rounds[0].existing_seqnos == first);
+
+  ASSERT_TRUE(rounds[1].partitions == std::vector<std::string>({"0-9", "10-19", "20-29"}));
+  ASSERT_TRUE(rounds[1].existing_seqnos == seqno_range(0, 29));
+}
+
+TEST(TonDbScanner, FileSinkUnalignedRange) {
+  // the first and the last partitions are complete with the seqnos of the range only
+  auto rounds = run_file_sink(5, 27, {seqno_range(5, 16), seqno_range(17, 27)});
+  ASSERT_EQ(2u, rounds.size());
+
+  ASSERT_TRUE(rounds[0].partitions == std::vector<std::string>({"0-9"}));
+  ASSERT_TRUE(rounds[0].existing_seqnos == seqno_range(5, 16));
+
+  ASSERT_TRUE(rounds[1].partitions == std::vector<std::string>({"0-9", "10-19", "20-29"}));
+  ASSERT_TRUE(rounds[1].existing_seqnos == seqno_range(5, 27));
+}
+
+int main(int argc, char** argv) {
+  td::TestsRunner::get_default().run_all();
+  return 0;
+}